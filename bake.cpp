@@ -0,0 +1,75 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Loads a model, builds its BVH and shader data as "ray" would, and
+// writes them to a scene image that "ray" maps at startup instead.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "world.h"
+#include "scene-image.h"
+
+namespace
+{
+
+// Must match data_texture_width in ray.cpp, which checks it
+const unsigned int data_texture_width = 2048;
+
+// Page textures taller than most GPUs allow; set BVH_TEXTURE_PAGE_ROWS
+// for a GPU with a smaller limit
+const unsigned int max_data_rows = 16384;
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s inputfilename outputfilename.scene\n", progname);
+    fprintf(stderr, "input can be .obj, .trisrc, or .instances; see load_instances in world.cpp.\n");
+    fprintf(stderr, "node and vertex formats are chosen by the same environment variables as for ray.\n");
+}
+
+}; // unnamed namespace for file scope
+
+int main(int argc, char *argv[])
+{
+    if(argc != 3 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if(!is_scene_image_filename(argv[2])) {
+        fprintf(stderr, "output filename \"%s\" should end in \".scene\"\n", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    world_ptr w = load_world(argv[1]);
+    if(w == nullptr) {
+        fprintf(stderr, "Cannot set up world.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    scene_shader_data data;
+    get_shader_data(w, data, data_texture_width, max_data_rows);
+
+    if(getenv("BVH_REPORT") != nullptr) {
+        write_bvh_report(w, data, data_texture_width, getenv("BVH_REPORT"));
+    }
+
+    if(!write_scene_image(w, data, argv[2])) {
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
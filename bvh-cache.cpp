@@ -0,0 +1,269 @@
+/*
+   Copyright 2018 Brad Grantham.
+   
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bvh-cache.h"
+#include "bvh.h"
+
+namespace
+{
+
+const char *bvh_cache_dir = nullptr;
+
+void initialize_runtime_parameters() __attribute__((constructor));
+void initialize_runtime_parameters()
+{
+    if(getenv("BVH_CACHE_DIR") != 0) {
+        bvh_cache_dir = getenv("BVH_CACHE_DIR");
+        fprintf(stderr, "BVH cache directory set to %s\n", bvh_cache_dir);
+    }
+}
+
+const char bvh_cache_magic[8] = {'R', 'A', 'Y', 'B', 'V', 'H', '0', '1'};
+
+// Records are stored as they are in memory, so their sizes are checked
+// to catch a cache written by a build with different structs
+struct bvh_cache_header
+{
+    char magic[8];
+    uint64_t key;
+    uint32_t vertex_size;
+    uint32_t triangle_size;
+    uint32_t group_size;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    uint32_t group_count;
+    int32_t root;
+    box3d box;
+};
+
+// FNV-1a over 64-bit words, with the tail bytes taken one at a time
+const uint64_t fnv_offset = 0xcbf29ce484222325ull;
+const uint64_t fnv_prime = 0x100000001b3ull;
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    size_t words = size / sizeof(uint64_t);
+    for(size_t i = 0; i < words; i++) {
+        uint64_t word;
+        memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(word));
+        hash = (hash ^ word) * fnv_prime;
+    }
+    for(size_t i = words * sizeof(uint64_t); i < size; i++) {
+        hash = (hash ^ bytes[i]) * fnv_prime;
+    }
+    return hash;
+}
+
+uint64_t hash_string(uint64_t hash, const char *s)
+{
+    return hash_bytes(hash, s, strlen(s) + 1);
+}
+
+// Parameters read elsewhere that change what's loaded or built; their
+// values are hashed as given rather than as parsed
+const char *bvh_cache_key_variables[] = {
+    "SBVH_ALPHA",
+    "SBVH_MEMORY_BUDGET",
+    "LBVH_MORTON_BITS",
+    "HLBVH_CLUSTER_BITS",
+    "BVH_OPTIMIZE_SECONDS",
+    "BVH_OPTIMIZE_PASSES",
+    "COLORS_ARE_LINEAR",
+    "GEOMETRY_SCALE",
+};
+
+std::string get_bvh_cache_filename(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bvh", static_cast<unsigned long long>(key));
+    return std::string(bvh_cache_dir) + name;
+}
+
+}; // unnamed namespace for file scope
+
+bool bvh_cache_enabled()
+{
+    return bvh_cache_dir != nullptr;
+}
+
+uint64_t get_bvh_cache_key(const std::string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    uint64_t size = st.st_size;
+    uint64_t hash = hash_bytes(fnv_offset, &size, sizeof(size));
+
+    if(size > 0) {
+        void *contents = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(contents == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        hash = hash_bytes(hash, contents, size);
+        munmap(contents, size);
+    }
+    close(fd);
+
+    bvh_parameters params = get_bvh_parameters();
+    hash = hash_bytes(hash, &params.leaf_max, sizeof(params.leaf_max));
+    hash = hash_bytes(hash, &params.max_depth, sizeof(params.max_depth));
+    hash = hash_bytes(hash, &params.leaf_cap, sizeof(params.leaf_cap));
+    hash = hash_bytes(hash, &params.sah_ctrav, sizeof(params.sah_ctrav));
+    hash = hash_bytes(hash, &params.sah_cisec, sizeof(params.sah_cisec));
+    hash = hash_string(hash, get_bvh_builder_name());
+
+    for(const char *name : bvh_cache_key_variables) {
+        hash = hash_string(hash, name);
+        hash = hash_string(hash, (getenv(name) != nullptr) ? getenv(name) : "");
+    }
+
+    return (hash != 0) ? hash : 1;
+}
+
+group_tree *load_bvh_cache(uint64_t key, triangle_set_ptr triangles)
+{
+    if(!bvh_cache_enabled() || key == 0) {
+        return nullptr;
+    }
+
+    std::string filename = get_bvh_cache_filename(key);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(bvh_cache_header)) {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = st.st_size;
+    void *contents = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(contents == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // The mapping is page aligned, so the records can be read in place
+    const char *bytes = static_cast<const char *>(contents);
+    const bvh_cache_header& header = *reinterpret_cast<const bvh_cache_header *>(bytes);
+
+    size_t vertex_bytes = static_cast<size_t>(header.vertex_count) * sizeof(vertex);
+    size_t triangle_bytes = static_cast<size_t>(header.triangle_count) * sizeof(indexed_triangle);
+    size_t group_bytes = static_cast<size_t>(header.group_count) * sizeof(group);
+
+    if(memcmp(header.magic, bvh_cache_magic, sizeof(header.magic)) != 0 ||
+        header.key != key ||
+        header.vertex_size != sizeof(vertex) ||
+        header.triangle_size != sizeof(indexed_triangle) ||
+        header.group_size != sizeof(group) ||
+        header.root < 0 || static_cast<uint32_t>(header.root) >= header.group_count ||
+        size != sizeof(header) + vertex_bytes + triangle_bytes + group_bytes) {
+
+        fprintf(stderr, "ignoring stale or damaged BVH cache \"%s\"\n", filename.c_str());
+        munmap(contents, size);
+        return nullptr;
+    }
+
+    const char *p = bytes + sizeof(header);
+    const vertex *vertices = reinterpret_cast<const vertex *>(p);
+    triangles->vertices.assign(vertices, vertices + header.vertex_count);
+    p += vertex_bytes;
+
+    const indexed_triangle *tris = reinterpret_cast<const indexed_triangle *>(p);
+    triangles->triangles.assign(tris, tris + header.triangle_count);
+    p += triangle_bytes;
+
+    triangles->box = header.box;
+
+    group_tree *tree = new group_tree(triangles, header.group_count);
+    tree->allocate(header.group_count);
+    const group *groups = reinterpret_cast<const group *>(p);
+    std::copy(groups, groups + header.group_count, tree->groups.begin());
+    tree->root = header.root;
+
+    munmap(contents, size);
+
+    fprintf(stderr, "loaded BVH cache \"%s\"\n", filename.c_str());
+
+    return tree;
+}
+
+void save_bvh_cache(uint64_t key, const group_tree& tree)
+{
+    if(!bvh_cache_enabled() || key == 0) {
+        return;
+    }
+
+    const triangle_set& triangles = *tree.triangles;
+
+    bvh_cache_header header;
+    memcpy(header.magic, bvh_cache_magic, sizeof(header.magic));
+    header.key = key;
+    header.vertex_size = sizeof(vertex);
+    header.triangle_size = sizeof(indexed_triangle);
+    header.group_size = sizeof(group);
+    header.vertex_count = triangles.vertices.size();
+    header.triangle_count = triangles.triangles.size();
+    header.group_count = tree.size();
+    header.root = tree.root;
+    header.box = triangles.box;
+
+    // Written under a temporary name and renamed into place so a reader
+    // never sees a partial file
+    std::string filename = get_bvh_cache_filename(key);
+    std::string temporary = filename + "." + std::to_string(getpid());
+
+    FILE *fp = fopen(temporary.c_str(), "wb");
+    if(fp == nullptr) {
+        fprintf(stderr, "couldn't create BVH cache \"%s\"\n", temporary.c_str());
+        return;
+    }
+
+    bool written =
+        fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(triangles.vertices.data(), sizeof(vertex), triangles.vertices.size(), fp) == triangles.vertices.size() &&
+        fwrite(triangles.triangles.data(), sizeof(indexed_triangle), triangles.triangles.size(), fp) == triangles.triangles.size() &&
+        fwrite(tree.groups.data(), sizeof(group), tree.groups.size(), fp) == tree.groups.size();
+    written = (fclose(fp) == 0) && written;
+
+    if(!written || rename(temporary.c_str(), filename.c_str()) != 0) {
+        fprintf(stderr, "couldn't write BVH cache \"%s\"\n", filename.c_str());
+        unlink(temporary.c_str());
+        return;
+    }
+
+    fprintf(stderr, "saved BVH cache \"%s\"\n", filename.c_str());
+}
@@ -0,0 +1,39 @@
+/*
+   Copyright 2018 Brad Grantham.
+   
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "group.h"
+#include "triangle-set.h"
+
+// Finished trees are saved in the directory named by BVH_CACHE_DIR,
+// one file per key, holding the vertices, the triangles in the order
+// the builder left them, and the nodes.  Without BVH_CACHE_DIR nothing
+// is cached.
+bool bvh_cache_enabled();
+
+// Hash of the bytes of "filename" and every parameter that changes the
+// triangles loaded from it or the tree built over them; 0 if the file
+// can't be read
+uint64_t get_bvh_cache_key(const std::string& filename);
+
+// Fills "triangles" and returns the tree saved under "key", or nullptr
+// if there isn't one or it doesn't match this build
+group_tree *load_bvh_cache(uint64_t key, triangle_set_ptr triangles);
+
+void save_bvh_cache(uint64_t key, const group_tree& tree);
@@ -0,0 +1,345 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Node layouts for the shader's data textures, which store node i at
+// texel i of rows "width" texels wide.  Texture caches fetch square
+// tiles of texels, so a layout helps when the nodes one ray visits in
+// a row share tiles.
+//
+//   build    as make_bvh numbers them, depth first with siblings
+//            together and the negative child first
+//   dfs      depth first with siblings together, the child with the
+//            larger surface area (the likelier to be hit) first
+//   veb      van Emde Boas: the top half of the levels first, then
+//            each subtree below them, recursively
+//   treelet  blocks of about layout_treelet_nodes nodes, each grown
+//            from its root by the largest surface area, so most steps
+//            a ray takes stay within a block
+//
+// With BVH_TILED_TEXELS set the textures store whole 8x8 tiles of
+// consecutive nodes instead (see get_data_texel in world.h), so a
+// treelet fills a tile.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <set>
+#include <vector>
+#include "bvh.h"
+#include "wide-bvh.h"
+#include "world.h"
+
+namespace
+{
+
+const char *layout_names[] = {"build", "dfs", "veb", "treelet"};
+enum layout_type { layout_build, layout_dfs, layout_veb, layout_treelet };
+
+layout_type bvh_layout = layout_build;
+
+// One row of an 8x8 tile with nodes stored row by row, or the whole
+// tile with tiled texels
+int layout_treelet_nodes = data_texture_tile;
+
+void initialize_runtime_parameters() __attribute__((constructor));
+void initialize_runtime_parameters()
+{
+    if(getenv("BVH_NODE_LAYOUT") != 0) {
+        const char *name = getenv("BVH_NODE_LAYOUT");
+        bool found = false;
+        for(int i = 0; i < (int)(sizeof(layout_names) / sizeof(layout_names[0])); i++) {
+            if(strcmp(name, layout_names[i]) == 0) {
+                bvh_layout = (layout_type)i;
+                found = true;
+            }
+        }
+        if(found) {
+            fprintf(stderr, "BVH node layout set to %s\n", name);
+        } else {
+            fprintf(stderr, "unknown BVH node layout \"%s\", keeping %s\n", name, layout_names[bvh_layout]);
+        }
+    }
+    if(getenv("BVH_TILED_TEXELS") != 0) {
+        layout_treelet_nodes = data_texture_tile * data_texture_tile;
+    }
+}
+
+float surface_area(const box3d& box)
+{
+    vec3 d = box.dim();
+    return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+// Children of "g" with the larger surface area first, or the negative
+// one first if not "by_area"
+void ordered_children(const group_tree& tree, int g, bool by_area, int& first, int& second)
+{
+    const group& n = tree[g];
+    bool negative_first = !by_area || surface_area(tree[n.negative].box) >= surface_area(tree[n.positive].box);
+    first = negative_first ? n.negative : n.positive;
+    second = negative_first ? n.positive : n.negative;
+}
+
+// Siblings are stored together, since a ray that fetches one usually
+// fetches the other
+void make_dfs_order(const group_tree& tree, bool by_area, std::vector<int>& order)
+{
+    std::vector<int> stack;
+    order.push_back(tree.root);
+    stack.push_back(tree.root);
+    while(!stack.empty()) {
+        int g = stack.back();
+        stack.pop_back();
+        if(!tree[g].is_leaf()) {
+            int first, second;
+            ordered_children(tree, g, by_area, first, second);
+            order.push_back(first);
+            order.push_back(second);
+            stack.push_back(second);
+            stack.push_back(first);
+        }
+    }
+}
+
+int get_height(const group_tree& tree, int g)
+{
+    if(tree[g].is_leaf()) {
+        return 1;
+    }
+    return 1 + std::max(get_height(tree, tree[g].negative), get_height(tree, tree[g].positive));
+}
+
+// Appends the nodes of the subtree at "g" less than "levels" deep in
+// depth first order, and the nodes just below them to "frontier"
+void collect_levels(const group_tree& tree, int g, int levels, std::vector<int>& nodes, std::vector<int>& frontier)
+{
+    if(levels == 0) {
+        frontier.push_back(g);
+        return;
+    }
+    nodes.push_back(g);
+    if(!tree[g].is_leaf()) {
+        int first, second;
+        ordered_children(tree, g, true, first, second);
+        collect_levels(tree, first, levels - 1, nodes, frontier);
+        collect_levels(tree, second, levels - 1, nodes, frontier);
+    }
+}
+
+// Lays out the subtree at "g", which is at most "height" levels
+void make_veb_order(const group_tree& tree, int g, int height, std::vector<int>& order)
+{
+    if(height <= 2) {
+        std::vector<int> frontier;
+        collect_levels(tree, g, height, order, frontier);
+        return;
+    }
+
+    int top = height / 2;
+    std::vector<int> top_nodes, frontier;
+    collect_levels(tree, g, top, top_nodes, frontier);
+    make_veb_order(tree, g, top, order);
+    for(int f : frontier) {
+        make_veb_order(tree, f, height - top, order);
+    }
+}
+
+// Each treelet grows by placing the children of its placed node with
+// the largest surface area, siblings together.  Placed nodes whose
+// children are left over start later treelets, largest first.
+void make_treelet_order(const group_tree& tree, std::vector<int>& order)
+{
+    auto smaller = [&tree](int a, int b) { return surface_area(tree[a].box) < surface_area(tree[b].box); };
+
+    std::vector<int> parents;
+    order.push_back(tree.root);
+    if(!tree[tree.root].is_leaf()) {
+        parents.push_back(tree.root);
+    }
+
+    while(!parents.empty()) {
+        std::priority_queue<int, std::vector<int>, decltype(smaller)> border(smaller);
+        border.push(parents.back());
+        parents.pop_back();
+
+        int taken = 0;
+        while(!border.empty() && taken < layout_treelet_nodes) {
+            int g = border.top();
+            border.pop();
+            for(int child : {tree[g].negative, tree[g].positive}) {
+                order.push_back(child);
+                if(!tree[child].is_leaf()) {
+                    border.push(child);
+                }
+            }
+            taken += 2;
+        }
+
+        std::vector<int> rest;
+        while(!border.empty()) {
+            rest.push_back(border.top());
+            border.pop();
+        }
+        parents.insert(parents.end(), rest.rbegin(), rest.rend());
+    }
+}
+
+// Moves old node "order[i]" to i
+void renumber_nodes(group_tree& tree, const std::vector<int>& order)
+{
+    std::vector<int> new_index(tree.size(), -1);
+    for(size_t i = 0; i < order.size(); i++) {
+        new_index[order[i]] = i;
+    }
+
+    std::vector<group> groups(order.size());
+    for(size_t i = 0; i < order.size(); i++) {
+        groups[i] = tree[order[i]];
+        if(!groups[i].is_leaf()) {
+            groups[i].negative = new_index[groups[i].negative];
+            groups[i].positive = new_index[groups[i].positive];
+        }
+    }
+
+    tree.groups.swap(groups);
+    tree.root = new_index[tree.root];
+}
+
+bool box_entered(const box3d& box, const ray& r, float tmin, float tmax)
+{
+    const float d[3] = {r.d.x, r.d.y, r.d.z};
+    const float o[3] = {r.o.x, r.o.y, r.o.z};
+    const float lo[3] = {box.boxmin.x, box.boxmin.y, box.boxmin.z};
+    const float hi[3] = {box.boxmax.x, box.boxmax.y, box.boxmax.z};
+    for(int a = 0; a < 3; a++) {
+        float near = ((d[a] >= 0 ? lo[a] : hi[a]) - o[a]) / d[a];
+        float far = ((d[a] >= 0 ? hi[a] : lo[a]) - o[a]) / d[a];
+        tmin = std::max(tmin, near);
+        tmax = std::min(tmax, far);
+    }
+    return tmin <= tmax;
+}
+
+// Appends every node the hit/miss traversal fetches for "r" to "fetched"
+void trace_fetches(const group_tree& tree, const ray& r, std::vector<int>& fetched)
+{
+    const float d[3] = {r.d.x, r.d.y, r.d.z};
+    std::vector<int> stack;
+    ray_hit hit;
+
+    stack.push_back(tree.root);
+    while(!stack.empty()) {
+        int g = stack.back();
+        stack.pop_back();
+        const group& n = tree[g];
+        fetched.push_back(g);
+        if(!box_entered(n.box, r, 0, hit.t)) {
+            continue;
+        }
+        if(n.is_leaf()) {
+            for(unsigned int i = 0; i < n.count; i++) {
+                triangle_intersect(*tree.triangles, n.start + i, r, 0, hit);
+            }
+        } else if(d[n.axis] < 0) {
+            stack.push_back(n.negative);
+            stack.push_back(n.positive);
+        } else {
+            stack.push_back(n.positive);
+            stack.push_back(n.negative);
+        }
+    }
+}
+
+}; // unnamed namespace for file scope
+
+const char *get_bvh_layout_name()
+{
+    return layout_names[bvh_layout];
+}
+
+void number_bvh_depth_first(group_tree& tree)
+{
+    std::vector<int> order;
+    order.reserve(tree.size());
+    make_dfs_order(tree, false, order);
+    renumber_nodes(tree, order);
+}
+
+void layout_bvh(group_tree& tree)
+{
+    if(bvh_layout == layout_build) {
+        return;
+    }
+
+    auto then = std::chrono::system_clock::now();
+
+    std::vector<int> order;
+    order.reserve(tree.size());
+    if(bvh_layout == layout_dfs) {
+        make_dfs_order(tree, true, order);
+    } else if(bvh_layout == layout_veb) {
+        make_veb_order(tree, tree.root, get_height(tree, tree.root), order);
+    } else {
+        make_treelet_order(tree, order);
+    }
+    renumber_nodes(tree, order);
+
+    std::chrono::duration<float> elapsed = std::chrono::system_clock::now() - then;
+    fprintf(stderr, "BVH node layout %s: %f seconds\n", get_bvh_layout_name(), elapsed.count());
+}
+
+bvh_locality measure_bvh_locality(const group_tree& tree, const std::vector<ray>& rays, unsigned int texture_width, bool tiled, unsigned int tile_size)
+{
+    bvh_locality locality;
+    locality.fetches_per_ray = 0;
+    locality.tiles_per_ray = 0;
+    locality.same_tile_fraction = 0;
+
+    long long fetches = 0;
+    long long tiles = 0;
+    long long same_tile = 0;
+    std::vector<int> fetched;
+    std::set<long long> touched;
+
+    for(const ray& r : rays) {
+        fetched.clear();
+        touched.clear();
+        trace_fetches(tree, r, fetched);
+
+        long long previous = -1;
+        for(int g : fetched) {
+            unsigned int texel = get_data_texel(g, texture_width, tiled);
+            long long x = (texel % texture_width) / tile_size;
+            long long y = (texel / texture_width) / tile_size;
+            long long tile = y * texture_width + x;
+            same_tile += (tile == previous) ? 1 : 0;
+            previous = tile;
+            touched.insert(tile);
+        }
+        fetches += fetched.size();
+        tiles += touched.size();
+    }
+
+    if(!rays.empty()) {
+        locality.fetches_per_ray = fetches / (float)rays.size();
+        locality.tiles_per_ray = tiles / (float)rays.size();
+        locality.same_tile_fraction = same_tile / (float)std::max(1LL, fetches);
+    }
+    return locality;
+}
@@ -0,0 +1,317 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Treelet restructuring after Karras and Aila, "Fast Parallel
+// Construction of High-Quality Bounding Volume Hierarchies", HPG 2013.
+// Internal nodes are rearranged in place; leaves and the triangle order
+// are never touched.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include "bvh.h"
+#include "task-pool.h"
+
+namespace
+{
+
+// Leaves per treelet; the optimal topology search is 3^n
+const int treelet_size = 7;
+const int treelet_subsets = 1 << treelet_size;
+
+// Each pass only restructures nodes with at least this many triangles
+// below them, doubled every pass, so later passes concentrate on the
+// upper levels
+const int first_pass_min_triangles = treelet_size;
+
+// Subtrees at least this large are optimized as separate tasks
+const int subtree_task_min = 4096;
+
+int bvh_optimize_passes = 3;
+
+void initialize_runtime_parameters() __attribute__((constructor));
+void initialize_runtime_parameters()
+{
+    if(getenv("BVH_OPTIMIZE_PASSES") != 0) {
+        bvh_optimize_passes = atoi(getenv("BVH_OPTIMIZE_PASSES"));
+        fprintf(stderr, "BVH optimization passes set to %d\n", bvh_optimize_passes);
+    }
+}
+
+float surface_area(const box3d& box)
+{
+    vec3 d = box.dim();
+    return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+// Orient a restructured node along the axis that best separates its
+// children, negative child first, the way the builders do
+void set_split_direction(group_tree& tree, int g)
+{
+    vec3 d = tree[tree[g].positive].box.center() - tree[tree[g].negative].box.center();
+    vec3 a = vec3(fabsf(d.x), fabsf(d.y), fabsf(d.z));
+    float along;
+    if(a.x >= a.y && a.x >= a.z) {
+        tree[g].axis = 0;
+        along = d.x;
+    } else if(a.y >= a.z) {
+        tree[g].axis = 1;
+        along = d.y;
+    } else {
+        tree[g].axis = 2;
+        along = d.z;
+    }
+    if(along < 0) {
+        std::swap(tree[g].negative, tree[g].positive);
+    }
+}
+
+struct treelet_optimizer
+{
+    group_tree& tree;
+    task_pool& pool;
+    bvh_parameters params;
+    std::chrono::time_point<std::chrono::steady_clock> deadline;
+    std::atomic<bool> out_of_time;
+    std::atomic<int> restructured;
+
+    // Indexed by group
+    std::vector<double> costs;
+    std::vector<int> heights;
+    std::vector<int> triangle_counts;
+
+    // Trees may not get deeper than this
+    int max_depth;
+
+    treelet_optimizer(group_tree& tree_, task_pool& pool_) :
+        tree(tree_),
+        pool(pool_),
+        params(get_bvh_parameters()),
+        out_of_time(false),
+        restructured(0)
+    {}
+
+    void update_node(int g)
+    {
+        float area = surface_area(tree[g].box);
+        if(tree[g].is_leaf()) {
+            costs[g] = area * params.sah_cisec * tree[g].count;
+            heights[g] = 0;
+            triangle_counts[g] = tree[g].count;
+        } else {
+            int n = tree[g].negative;
+            int p = tree[g].positive;
+            costs[g] = area * params.sah_ctrav + costs[n] + costs[p];
+            heights[g] = 1 + std::max(heights[n], heights[p]);
+            triangle_counts[g] = triangle_counts[n] + triangle_counts[p];
+        }
+    }
+
+    void initialize(int g)
+    {
+        if(!tree[g].is_leaf()) {
+            initialize(tree[g].negative);
+            initialize(tree[g].positive);
+        }
+        update_node(g);
+    }
+
+    bool restructure(int root, int level);
+    int rebuild(int subset, int *leaves, int *best_partition, box3d *boxes, std::vector<int>& internal);
+    void optimize(int g, int level, int min_triangles);
+};
+
+int treelet_optimizer::rebuild(int subset, int *leaves, int *best_partition, box3d *boxes, std::vector<int>& internal)
+{
+    if((subset & (subset - 1)) == 0) {
+        int leaf = 0;
+        while((subset & (1 << leaf)) == 0) {
+            leaf++;
+        }
+        return leaves[leaf];
+    }
+
+    int g = internal.back();
+    internal.pop_back();
+
+    int negative = rebuild(best_partition[subset], leaves, best_partition, boxes, internal);
+    int positive = rebuild(subset & ~best_partition[subset], leaves, best_partition, boxes, internal);
+    tree[g].negative = negative;
+    tree[g].positive = positive;
+    tree[g].box = boxes[subset];
+    set_split_direction(tree, g);
+    update_node(g);
+    return g;
+}
+
+// Replace the treelet under "root" with its lowest-cost topology, if
+// that's cheaper and doesn't push leaves past max_depth
+bool treelet_optimizer::restructure(int root, int level)
+{
+    int leaves[treelet_size];
+    std::vector<int> internal;
+    int leaf_count = 2;
+    leaves[0] = tree[root].negative;
+    leaves[1] = tree[root].positive;
+    internal.push_back(root);
+
+    // Grow the treelet by opening the leaf with the largest area
+    while(leaf_count < treelet_size) {
+        int largest = -1;
+        float largest_area = -1;
+        for(int i = 0; i < leaf_count; i++) {
+            if(!tree[leaves[i]].is_leaf()) {
+                float area = surface_area(tree[leaves[i]].box);
+                if(area > largest_area) {
+                    largest = i;
+                    largest_area = area;
+                }
+            }
+        }
+        if(largest == -1) {
+            break;
+        }
+        int opened = leaves[largest];
+        internal.push_back(opened);
+        leaves[largest] = tree[opened].negative;
+        leaves[leaf_count++] = tree[opened].positive;
+    }
+
+    if(leaf_count < 3) {
+        return false;
+    }
+
+    int subset_count = 1 << leaf_count;
+    box3d boxes[treelet_subsets];
+    double best_cost[treelet_subsets];
+    int best_height[treelet_subsets];
+    int best_partition[treelet_subsets];
+
+    for(int s = 1; s < subset_count; s++) {
+        int low = s & -s;
+        if(s == low) {
+            int leaf = 0;
+            while((low & (1 << leaf)) == 0) {
+                leaf++;
+            }
+            boxes[s] = tree[leaves[leaf]].box;
+            best_cost[s] = costs[leaves[leaf]];
+            best_height[s] = heights[leaves[leaf]];
+            continue;
+        }
+
+        boxes[s] = boxes[s & ~low];
+        boxes[s].add(boxes[low]);
+
+        // Each partition once: the side holding the lowest leaf
+        best_cost[s] = std::numeric_limits<double>::max();
+        for(int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+            if((p & low) == 0) {
+                continue;
+            }
+            double cost = best_cost[p] + best_cost[s & ~p];
+            if(cost < best_cost[s]) {
+                best_cost[s] = cost;
+                best_height[s] = 1 + std::max(best_height[p], best_height[s & ~p]);
+                best_partition[s] = p;
+            }
+        }
+        best_cost[s] += surface_area(boxes[s]) * params.sah_ctrav;
+    }
+
+    int all = subset_count - 1;
+    if(best_cost[all] >= costs[root] * (1 - 1e-6)) {
+        return false;
+    }
+    if(level + best_height[all] > max_depth) {
+        return false;
+    }
+
+    // Reuse the treelet's internal nodes, root last so it stays on top
+    std::reverse(internal.begin(), internal.end());
+    rebuild(all, leaves, best_partition, boxes, internal);
+    return true;
+}
+
+// Post-order, so every treelet is formed from already-optimized subtrees
+void treelet_optimizer::optimize(int g, int level, int min_triangles)
+{
+    if(tree[g].is_leaf()) {
+        return;
+    }
+
+    int negative = tree[g].negative;
+    int positive = tree[g].positive;
+    if(triangle_counts[g] >= subtree_task_min) {
+        task_group children;
+        pool.spawn(children, [&]{ optimize(negative, level + 1, min_triangles); });
+        optimize(positive, level + 1, min_triangles);
+        pool.wait(children);
+    } else {
+        optimize(negative, level + 1, min_triangles);
+        optimize(positive, level + 1, min_triangles);
+    }
+
+    if(!out_of_time && std::chrono::steady_clock::now() > deadline) {
+        out_of_time = true;
+    }
+
+    if(!out_of_time && triangle_counts[g] >= min_triangles && restructure(g, level)) {
+        restructured++;
+    } else {
+        update_node(g);
+    }
+}
+
+}; // unnamed namespace for file scope
+
+void optimize_bvh(group_tree& tree, task_pool& pool, float seconds)
+{
+    auto then = std::chrono::steady_clock::now();
+
+    int root = tree.root;
+    treelet_optimizer optimizer(tree, pool);
+    optimizer.deadline = then + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(seconds));
+
+    int node_count = tree.size();
+    optimizer.costs.resize(node_count);
+    optimizer.heights.resize(node_count);
+    optimizer.triangle_counts.resize(node_count);
+    optimizer.initialize(root);
+    optimizer.max_depth = std::max(optimizer.params.max_depth, optimizer.heights[root]);
+
+    float area = surface_area(tree[root].box);
+    double initial_cost = optimizer.costs[root] / area;
+
+    int min_triangles = first_pass_min_triangles;
+    for(int pass = 0; pass < bvh_optimize_passes && !optimizer.out_of_time; pass++) {
+        optimizer.restructured = 0;
+        optimizer.optimize(root, 0, min_triangles);
+        fprintf(stderr, "BVH optimization pass %d: %d treelets restructured, SAH cost %f\n", pass, optimizer.restructured.load(), optimizer.costs[root] / area);
+        if(optimizer.restructured == 0) {
+            break;
+        }
+        min_triangles *= 2;
+    }
+
+    std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - then;
+    fprintf(stderr, "BVH optimization: SAH cost %f to %f in %f seconds%s\n", initial_cost, optimizer.costs[root] / area, elapsed.count(), optimizer.out_of_time ? " (time budget reached)" : "");
+}
@@ -0,0 +1,60 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Refitting keeps the topology and triangle order of a tree and only
+// recomputes bounds, so it stays valid for any vertex motion but its
+// SAH cost degrades as the motion departs from the pose it was built
+// for.
+
+#include "bvh.h"
+#include "task-pool.h"
+
+namespace
+{
+
+// Subtrees are refit as separate tasks down to this depth
+const int refit_task_levels = 10;
+
+void refit_node(group_tree& tree, task_pool& pool, int g, int level)
+{
+    group& n = tree[g];
+
+    if(n.is_leaf()) {
+        n.make_leaf(*tree.triangles, n.start, n.count);
+        return;
+    }
+
+    if(level < refit_task_levels) {
+        task_group children;
+        pool.spawn(children, [&]{ refit_node(tree, pool, n.negative, level + 1); });
+        refit_node(tree, pool, n.positive, level + 1);
+        pool.wait(children);
+    } else {
+        refit_node(tree, pool, n.negative, level + 1);
+        refit_node(tree, pool, n.positive, level + 1);
+    }
+
+    box3d box = tree[n.negative].box;
+    box.add(tree[n.positive].box);
+    n.box = box;
+}
+
+}; // unnamed namespace for file scope
+
+void refit_bvh(group_tree& tree, task_pool& pool)
+{
+    refit_node(tree, pool, tree.root, 0);
+}
@@ -14,11 +14,20 @@
    limitations under the License.
 */
 
+#include <atomic>
 #include <chrono>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cassert>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "bvh.h"
+#include "task-pool.h"
 
 // unnamed namespace for file scope
 namespace
@@ -31,35 +40,140 @@ unsigned int bvh_leaf_max = 10; // Empirically chosen on Intel embedded on MBP 1
 // Could set to 19 in order to fit in 20 bits for a 1024x1024 texture
 int bvh_max_depth = 30;
 
+// Leaves never hold more shapes than this, whatever bvh_leaf_max,
+// bvh_max_depth, and the SAH say; 0 for no limit.  Set by the renderer
+// to the number of triangles its shader tests per leaf.
+unsigned int bvh_leaf_cap = 0;
+
 // Total shapes processed so far during make_bvh recursion
-int total_shapes_processed = 0;
+std::atomic<int> total_shapes_processed(0);
 
-// Last time total_shapes_processed was printed
+// Last time total_shapes_processed was printed; only touched by thread 0
 std::chrono::time_point<std::chrono::system_clock> previous_total_shapes_print;
 
-// http://en.cppreference.com/w/cpp/language/value_initialization means "int" value in map element is initialized to 0
-std::map<int, int> bvh_node_count_by_level;
-
 // Lump all leaves this size or bigger together for stats
 const int bvh_leaf_max_size_for_stats = 64;
 
-// Number of leaves the max size or bigger
-int bvh_leaf_count_ge_max_size = 0;
+// Each build thread counts into its own bvh_stats, merged after the build
+struct bvh_stats
+{
+    // Number of nodes and then leaves created
+    int node_count;
+    int leaf_count;
+
+    // Number of leaves the max size or bigger
+    int leaf_count_ge_max_size;
+
+    // Ranges over the leaf cap that were split without the SAH, and
+    // the shapes in them
+    int forced_range_count;
+    int forced_shape_count;
+
+    // http://en.cppreference.com/w/cpp/language/value_initialization means "int" value in map element is initialized to 0
+    std::map<int, int> node_count_by_level;
+
+    // Histogram of leaf size
+    std::map<int, int> leaf_count_by_size;
+
+    bvh_stats() :
+        node_count(0),
+        leaf_count(0),
+        leaf_count_ge_max_size(0),
+        forced_range_count(0),
+        forced_shape_count(0)
+    {}
+
+    void merge(const bvh_stats& other)
+    {
+        node_count += other.node_count;
+        leaf_count += other.leaf_count;
+        leaf_count_ge_max_size += other.leaf_count_ge_max_size;
+        forced_range_count += other.forced_range_count;
+        forced_shape_count += other.forced_shape_count;
+        for(auto& b : other.node_count_by_level) {
+            node_count_by_level[b.first] += b.second;
+        }
+        for(auto& b : other.leaf_count_by_size) {
+            leaf_count_by_size[b.first] += b.second;
+        }
+    }
+};
+
+// Stats from the latest make_bvh call
+bvh_stats bvh_total_stats;
 
-// Histogram of leaf size
-std::map<int, int> bvh_leaf_count_by_size;
+// Ranges at least this large are bounded, binned, and partitioned in
+// parallel chunks of this size.  Chunking depends only on the range
+// size so the resulting tree is the same for any thread count.
+const int parallel_chunk_size = 16384;
 
-// Number of nodes and then leaves created
-int bvh_node_count = 0;
-int bvh_leaf_count = 0;
+// Subtrees at least this large are built as separate tasks
+const unsigned int subtree_task_min = 4096;
 
 // Surface area heuristic constants for traversal and intersection
 float sah_ctrav = 1;
 float sah_cisec = 4;    // A guess.
 
+// "sah" bins object splits along the longest axis; "sbvh" also clips
+// triangle references into spatial bins, and tries both kinds of split
+// on all three axes; "lbvh" splits on sorted Morton codes, and "hlbvh"
+// joins LBVH clusters with SAH
+const char *bvh_builder_name = "sah";
+
+// SBVH only tries spatial splits where the children of the best object
+// split overlap by more than this fraction of the root surface area
+float sbvh_alpha = 1e-5;
+
+// SBVH may add at most this fraction of the triangle count as
+// duplicated triangle references
+float sbvh_memory_budget = 0.3;
+
+// Seconds to spend restructuring the finished tree; 0 skips it
+float bvh_optimize_seconds = 0;
+
+// A profile holds "NAME value" lines named like the environment
+// variables, as written by save_bvh_profile
+bool load_bvh_profile(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if(fp == nullptr) {
+        fprintf(stderr, "couldn't open BVH profile \"%s\"\n", filename);
+        return false;
+    }
+
+    char line[512];
+    char name[256];
+    float value;
+    while(fgets(line, sizeof(line), fp) != nullptr) {
+        if(line[0] == '#' || sscanf(line, "%255s %f", name, &value) != 2) {
+            continue;
+        }
+        if(strcmp(name, "BVH_LEAF_MAX") == 0) {
+            bvh_leaf_max = value;
+        } else if(strcmp(name, "BVH_MAX_DEPTH") == 0) {
+            bvh_max_depth = value;
+        } else if(strcmp(name, "SAH_CTRAV") == 0) {
+            sah_ctrav = value;
+        } else if(strcmp(name, "SAH_CISEC") == 0) {
+            sah_cisec = value;
+        } else {
+            fprintf(stderr, "%s: ignoring unknown parameter \"%s\"\n", filename, name);
+        }
+    }
+    fclose(fp);
+
+    fprintf(stderr, "BVH profile \"%s\": max objects per leaf %u, max depth %d, SAH traversal %f, intersection %f\n",
+        filename, bvh_leaf_max, bvh_max_depth, sah_ctrav, sah_cisec);
+    return true;
+}
+
 void initialize_runtime_parameters() __attribute__((constructor));
 void initialize_runtime_parameters()
 {
+    // Environment variables below override the profile
+    if(getenv("BVH_PROFILE") != 0) {
+        load_bvh_profile(getenv("BVH_PROFILE"));
+    }
     if(getenv("BVH_MAX_DEPTH") != 0) {
         bvh_max_depth = atoi(getenv("BVH_MAX_DEPTH"));
         fprintf(stderr, "BVH max depth set to %d\n", bvh_max_depth);
@@ -76,28 +190,194 @@ void initialize_runtime_parameters()
         sah_cisec = atof(getenv("SAH_CISEC"));
         fprintf(stderr, "SAH cost of intersection set to %f\n", sah_cisec);
     }
+    if(getenv("BVH_BUILDER") != 0) {
+        bvh_builder_name = getenv("BVH_BUILDER");
+        fprintf(stderr, "BVH builder set to %s\n", bvh_builder_name);
+    }
+    if(getenv("SBVH_ALPHA") != 0) {
+        sbvh_alpha = atof(getenv("SBVH_ALPHA"));
+        fprintf(stderr, "SBVH spatial split overlap threshold set to %f\n", sbvh_alpha);
+    }
+    if(getenv("SBVH_MEMORY_BUDGET") != 0) {
+        sbvh_memory_budget = atof(getenv("SBVH_MEMORY_BUDGET"));
+        fprintf(stderr, "SBVH reference duplication budget set to %f\n", sbvh_memory_budget);
+    }
+    if(getenv("BVH_OPTIMIZE_SECONDS") != 0) {
+        bvh_optimize_seconds = atof(getenv("BVH_OPTIMIZE_SECONDS"));
+        fprintf(stderr, "BVH optimization time budget set to %f seconds\n", bvh_optimize_seconds);
+    }
 }
 
 }; // unnamed namespace for file scope
 
+const char *get_bvh_builder_name()
+{
+    return bvh_builder_name;
+}
+
+bvh_parameters get_bvh_parameters()
+{
+    bvh_parameters params;
+    params.leaf_max = bvh_leaf_max;
+    params.max_depth = bvh_max_depth;
+    params.leaf_cap = bvh_leaf_cap;
+    params.sah_ctrav = sah_ctrav;
+    params.sah_cisec = sah_cisec;
+    return params;
+}
+
+void set_bvh_parameters(const bvh_parameters& params)
+{
+    bvh_leaf_max = params.leaf_max;
+    bvh_max_depth = params.max_depth;
+    bvh_leaf_cap = params.leaf_cap;
+    sah_ctrav = params.sah_ctrav;
+    sah_cisec = params.sah_cisec;
+}
+
+bool save_bvh_profile(const char *filename, const bvh_parameters& params)
+{
+    FILE *fp = fopen(filename, "w");
+    if(fp == nullptr) {
+        fprintf(stderr, "couldn't create BVH profile \"%s\"\n", filename);
+        return false;
+    }
+    fprintf(fp, "# BVH parameters calibrated for this machine; load with BVH_PROFILE\n");
+    fprintf(fp, "BVH_LEAF_MAX %u\n", params.leaf_max);
+    fprintf(fp, "BVH_MAX_DEPTH %d\n", params.max_depth);
+    fprintf(fp, "SAH_CTRAV %f\n", params.sah_ctrav);
+    fprintf(fp, "SAH_CISEC %f\n", params.sah_cisec);
+    return fclose(fp) == 0;
+}
+
 void print_bvh_stats()
 {
-    fprintf(stderr, "%d bvh nodes\n", bvh_node_count);
-    fprintf(stderr, "%d of those are leaves\n", bvh_leaf_count);
+    fprintf(stderr, "%d bvh nodes\n", bvh_total_stats.node_count);
+    fprintf(stderr, "%d of those are leaves\n", bvh_total_stats.leaf_count);
 
-    for(auto& b : bvh_node_count_by_level) {
+    for(auto& b : bvh_total_stats.node_count_by_level) {
         fprintf(stderr, "bvh level %2d: %6d nodes\n", b.first, b.second);
     }
 
-    for(auto& b : bvh_leaf_count_by_size) {
+    for(auto& b : bvh_total_stats.leaf_count_by_size) {
         fprintf(stderr, "%2d shapes in %6d leaves\n", b.first, b.second);
     }
 
-    if(bvh_leaf_count_ge_max_size > 0) {
-        fprintf(stderr, "%d or more objects in %6d leaves\n", bvh_leaf_max_size_for_stats, bvh_leaf_count_ge_max_size);
+    if(bvh_total_stats.leaf_count_ge_max_size > 0) {
+        fprintf(stderr, "%d or more objects in %6d leaves\n", bvh_leaf_max_size_for_stats, bvh_total_stats.leaf_count_ge_max_size);
+    }
+
+    if(bvh_total_stats.forced_range_count > 0) {
+        fprintf(stderr, "%d objects in %d ranges split to the leaf cap of %u\n", bvh_total_stats.forced_shape_count, bvh_total_stats.forced_range_count, bvh_leaf_cap);
     }
 }
 
+// The SAH builder's working set, one array per component so binning
+// streams through each range.  Partitioning moves entries along with
+// their triangle index, so the triangles themselves are only reordered
+// once the tree is done.  It only lives as long as the build.
+struct build_references
+{
+    std::vector<int> triangle; // relative to the start of the range
+    std::vector<float> center[3];
+    std::vector<float> boxmin[3];
+    std::vector<float> boxmax[3];
+
+    void resize(int count)
+    {
+        triangle.resize(count);
+        for(int a = 0; a < 3; a++) {
+            center[a].resize(count);
+            boxmin[a].resize(count);
+            boxmax[a].resize(count);
+        }
+    }
+
+    void set(int i, int t, const box3d& box, const vec3& barycenter)
+    {
+        triangle[i] = t;
+        center[0][i] = barycenter.x;
+        center[1][i] = barycenter.y;
+        center[2][i] = barycenter.z;
+        boxmin[0][i] = box.boxmin.x;
+        boxmin[1][i] = box.boxmin.y;
+        boxmin[2][i] = box.boxmin.z;
+        boxmax[0][i] = box.boxmax.x;
+        boxmax[1][i] = box.boxmax.y;
+        boxmax[2][i] = box.boxmax.z;
+    }
+
+    void swap(int i, int j)
+    {
+        std::swap(triangle[i], triangle[j]);
+        for(int a = 0; a < 3; a++) {
+            std::swap(center[a][i], center[a][j]);
+            std::swap(boxmin[a][i], boxmin[a][j]);
+            std::swap(boxmax[a][i], boxmax[a][j]);
+        }
+    }
+
+    void copy_to(build_references& to, int from_index, int to_index) const
+    {
+        to.triangle[to_index] = triangle[from_index];
+        for(int a = 0; a < 3; a++) {
+            to.center[a][to_index] = center[a][from_index];
+            to.boxmin[a][to_index] = boxmin[a][from_index];
+            to.boxmax[a][to_index] = boxmax[a][from_index];
+        }
+    }
+
+    vec3 get_center(int i) const
+    {
+        return vec3(center[0][i], center[1][i], center[2][i]);
+    }
+
+    box3d get_box(int i) const
+    {
+        return box3d(vec3(boxmin[0][i], boxmin[1][i], boxmin[2][i]), vec3(boxmax[0][i], boxmax[1][i], boxmax[2][i]));
+    }
+};
+
+// A triangle, or the part of one left by SBVH spatial splits
+struct sbvh_reference
+{
+    int triangle;
+    box3d box;
+    vec3 barycenter;
+};
+
+// State shared by all tasks of one make_bvh call
+struct bvh_builder
+{
+    triangle_set_ptr triangles;
+    group_tree *tree;
+    task_pool& pool;
+    std::vector<bvh_stats> thread_stats;
+
+    // The SAH build works on positions in "refs" relative to "start"
+    int start;
+    build_references refs;
+    build_references scratch; // target of parallel partition
+
+    // SBVH leaves hold their references here, by group index, until
+    // they're laid out
+    std::vector<std::map<int, std::vector<sbvh_reference>>> thread_leaf_refs;
+
+    bvh_builder(triangle_set_ptr triangles_, task_pool& pool_) :
+        triangles(triangles_),
+        tree(nullptr),
+        pool(pool_),
+        thread_stats(pool.get_thread_count()),
+        start(0),
+        thread_leaf_refs(pool.get_thread_count())
+    {}
+
+    bvh_stats& stats()
+    {
+        return thread_stats[task_pool::get_thread_index()];
+    }
+};
+
 float surface_area(const vec3& boxdim)
 {
     return 2 * (boxdim.x * boxdim.y + boxdim.x * boxdim.z + boxdim.y * boxdim.z);
@@ -119,19 +399,122 @@ float sah(const vec3& boxdim, const vec3& lboxdim, int ltri, const vec3& rboxdim
     return sah_ctrav + sah_cisec * (larea / area * ltri + rarea / area * rtri);
 }
 
-group *make_leaf(triangle_set_ptr triangles, int start, int count, int level)
+double get_subtree_sah_cost(const group_tree& tree, int g)
+{
+    double area = surface_area(tree[g].box.dim());
+    if(tree[g].is_leaf()) {
+        return area * sah_cisec * tree[g].count;
+    }
+    return area * sah_ctrav + get_subtree_sah_cost(tree, tree[g].negative) + get_subtree_sah_cost(tree, tree[g].positive);
+}
+
+float get_bvh_sah_cost(const group_tree& tree)
+{
+    return get_subtree_sah_cost(tree, tree.root) / surface_area(tree[tree.root].box.dim());
+}
+
+void add_subtree_quality(const group_tree& tree, int g, int depth, unsigned int leaf_limit, bvh_quality& quality, double& overlap_area, double& inner_area, double& leaf_depth_sum)
+{
+    const group& n = tree[g];
+    quality.node_count++;
+
+    if(n.is_leaf()) {
+        quality.leaf_count++;
+        leaf_depth_sum += depth;
+        quality.max_leaf_depth = std::max(quality.max_leaf_depth, depth);
+        quality.max_leaf_size = std::max(quality.max_leaf_size, n.count);
+        if(n.count > leaf_limit) {
+            quality.leaves_over_limit++;
+            quality.triangles_over_limit += n.count - leaf_limit;
+        }
+        return;
+    }
+
+    const box3d& a = tree[n.negative].box;
+    const box3d& b = tree[n.positive].box;
+    vec3 overlap = min(a.boxmax, b.boxmax) - max(a.boxmin, b.boxmin);
+    if(overlap.x > 0 && overlap.y > 0 && overlap.z > 0) {
+        overlap_area += surface_area(overlap);
+    }
+    inner_area += surface_area(n.box.dim());
+
+    add_subtree_quality(tree, n.negative, depth + 1, leaf_limit, quality, overlap_area, inner_area, leaf_depth_sum);
+    add_subtree_quality(tree, n.positive, depth + 1, leaf_limit, quality, overlap_area, inner_area, leaf_depth_sum);
+}
+
+bvh_quality get_bvh_quality(const group_tree& tree, unsigned int leaf_limit)
+{
+    bvh_quality quality;
+    quality.sah_cost = get_bvh_sah_cost(tree);
+    quality.node_count = 0;
+    quality.leaf_count = 0;
+    quality.max_leaf_depth = 0;
+    quality.max_leaf_size = 0;
+    quality.leaves_over_limit = 0;
+    quality.triangles_over_limit = 0;
+
+    double overlap_area = 0;
+    double inner_area = 0;
+    double leaf_depth_sum = 0;
+    add_subtree_quality(tree, tree.root, 0, leaf_limit, quality, overlap_area, inner_area, leaf_depth_sum);
+
+    unsigned int referenced = 0;
+    for(const group& g : tree.groups) {
+        referenced += g.is_leaf() ? g.count : 0;
+    }
+
+    quality.sibling_overlap = (inner_area > 0) ? overlap_area / inner_area : 0;
+    quality.average_leaf_depth = leaf_depth_sum / quality.leaf_count;
+    quality.average_leaf_size = referenced * 1.0 / quality.leaf_count;
+    return quality;
+}
+
+// Fill in stats from a finished tree, for builders that don't count
+// as they go
+void record_bvh_stats(const group_tree& tree, int g, int level, bvh_stats& stats)
+{
+    stats.node_count++;
+    stats.node_count_by_level[level]++;
+    if(!tree[g].is_leaf()) {
+        record_bvh_stats(tree, tree[g].negative, level + 1, stats);
+        record_bvh_stats(tree, tree[g].positive, level + 1, stats);
+    } else {
+        stats.leaf_count++;
+        if(tree[g].count >= (unsigned int)bvh_leaf_max_size_for_stats) {
+            stats.leaf_count_ge_max_size++;
+        } else {
+            stats.leaf_count_by_size[tree[g].count]++;
+        }
+    }
+}
+
+void make_leaf(bvh_builder& builder, int g, int start, int count, int level)
 {
     total_shapes_processed += count;
-    group* g = new group(triangles, start, count);
+    box3d box;
+    for(int i = start; i < start + count; i++) {
+        box.add(builder.refs.get_box(i));
+    }
+    (*builder.tree)[g].make_leaf(builder.start + start, count, box);
+    bvh_stats& stats = builder.stats();
     if(count >= bvh_leaf_max_size_for_stats) {
-        bvh_leaf_count_ge_max_size++;
+        stats.leaf_count_ge_max_size++;
     } else {
-        bvh_leaf_count_by_size[count]++;
+        stats.leaf_count_by_size[count]++;
     }
-    bvh_leaf_count++;
-    bvh_node_count_by_level[level]++;
-    bvh_node_count++;
-    return g;
+    stats.leaf_count++;
+    stats.node_count_by_level[level]++;
+    stats.node_count++;
+}
+
+float get_axis(const vec3& v, int axis)
+{
+    return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+vec3 axis_vector(int axis)
+{
+    return vec3((axis == 0) ? 1 : 0, (axis == 1) ? 1 : 0, (axis == 2) ? 1 : 0);
 }
 
 struct split_bin
@@ -145,109 +528,220 @@ struct split_bin
     {}
 };
 
-int get_bin_from_triangle(const indexed_triangle& t, const box3d& box, int dimension, int bin_count)
+const int max_bin_count = 40;
+
+// Maps triangle centroids to bins on each axis; bin boundary "i" on
+// "axis" is at origin + i / scale
+struct bin_mapping
 {
-    float start, stop, x;
+    float origin[3];
+    float scale[3]; // 0 on an axis where the centroids don't spread
+    int bin_count;
+
+    bin_mapping(const box3d& centroids, int bin_count_) :
+        bin_count(bin_count_)
+    {
+        for(int axis = 0; axis < 3; axis++) {
+            float lo = get_axis(centroids.boxmin, axis);
+            float extent = get_axis(centroids.boxmax, axis) - lo;
+            origin[axis] = lo;
+            // Shrunk a little so the highest centroid stays in the last bin
+            scale[axis] = (extent > 0) ? bin_count * 0.99999f / extent : 0;
+        }
+    }
 
-    if(dimension == 0) {
-        start = box.boxmin.x;
-        stop = box.boxmax.x;
-        x = t.barycenter.x;
-    } else if(dimension == 1) {
-        start = box.boxmin.y;
-        stop = box.boxmax.y;
-        x = t.barycenter.y;
-    } else {
-        start = box.boxmin.z;
-        stop = box.boxmax.z;
-        x = t.barycenter.z;
+    float split(int axis, int i) const
+    {
+        return origin[axis] + i / scale[axis];
     }
+};
 
-    int y = floor((x - start) * (bin_count) / (stop - start));
-    int bin = std::min(bin_count - 1, std::max(0, y));
+// Bounds and triangle count of every bin on all three axes.  Bounds
+// are kept as 4 floats so the kernel can merge x, y and z with one
+// vector min or max; the fourth lane is unused.
+struct axis_bins
+{
+    float boxmin[3][max_bin_count][4];
+    float boxmax[3][max_bin_count][4];
+    int count[3][max_bin_count];
+
+    axis_bins(int bin_count)
+    {
+        for(int axis = 0; axis < 3; axis++) {
+            for(int i = 0; i < bin_count; i++) {
+                for(int j = 0; j < 4; j++) {
+                    boxmin[axis][i][j] = std::numeric_limits<float>::max();
+                    boxmax[axis][i][j] = -std::numeric_limits<float>::max();
+                }
+                count[axis][i] = 0;
+            }
+        }
+    }
 
-    return bin;
-}
+    void merge(const axis_bins& other, int bin_count)
+    {
+        for(int axis = 0; axis < 3; axis++) {
+            for(int i = 0; i < bin_count; i++) {
+                for(int j = 0; j < 4; j++) {
+                    boxmin[axis][i][j] = std::min(boxmin[axis][i][j], other.boxmin[axis][i][j]);
+                    boxmax[axis][i][j] = std::max(boxmax[axis][i][j], other.boxmax[axis][i][j]);
+                }
+                count[axis][i] += other.count[axis][i];
+            }
+        }
+    }
 
-vec3 get_bin_split(int i, const box3d& box, int dimension, int bin_count)
+    static void reset_bounds(float lo[3], float hi[3])
+    {
+        for(int j = 0; j < 3; j++) {
+            lo[j] = std::numeric_limits<float>::max();
+            hi[j] = -std::numeric_limits<float>::max();
+        }
+    }
+
+    void add_bounds(int axis, int i, float lo[3], float hi[3]) const
+    {
+        for(int j = 0; j < 3; j++) {
+            lo[j] = std::min(lo[j], boxmin[axis][i][j]);
+            hi[j] = std::max(hi[j], boxmax[axis][i][j]);
+        }
+    }
+};
+
+float surface_area(const float lo[3], const float hi[3])
 {
-    float start, stop;
+    float dx = hi[0] - lo[0];
+    float dy = hi[1] - lo[1];
+    float dz = hi[2] - lo[2];
+    return 2 * (dx * dy + dx * dz + dy * dz);
+}
 
-    if(dimension == 0) {
-        start = box.boxmin.x;
-        stop = box.boxmax.x;
-    } else if(dimension == 1) {
-        start = box.boxmin.y;
-        stop = box.boxmax.y;
-    } else {
-        start = box.boxmin.z;
-        stop = box.boxmax.z;
+// Bin triangles [start, start + count) on all three axes in one pass
+void fill_bins(const build_references& refs, int start, int count, const bin_mapping& mapping, axis_bins& bins)
+{
+#if defined(__SSE2__)
+
+    const __m128 origin = _mm_setr_ps(mapping.origin[0], mapping.origin[1], mapping.origin[2], 0);
+    const __m128 scale = _mm_setr_ps(mapping.scale[0], mapping.scale[1], mapping.scale[2], 0);
+    const __m128 first = _mm_setzero_ps();
+    const __m128 last = _mm_set1_ps(mapping.bin_count - 1);
+    alignas(16) int bin[4];
+
+    for(int i = start; i < start + count; i++) {
+        __m128 c = _mm_setr_ps(refs.center[0][i], refs.center[1][i], refs.center[2][i], 0);
+        __m128 lo = _mm_setr_ps(refs.boxmin[0][i], refs.boxmin[1][i], refs.boxmin[2][i], 0);
+        __m128 hi = _mm_setr_ps(refs.boxmax[0][i], refs.boxmax[1][i], refs.boxmax[2][i], 0);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(c, origin), scale), first), last);
+        _mm_store_si128(reinterpret_cast<__m128i *>(bin), _mm_cvttps_epi32(b));
+
+        for(int axis = 0; axis < 3; axis++) {
+            float *bmin = bins.boxmin[axis][bin[axis]];
+            float *bmax = bins.boxmax[axis][bin[axis]];
+            _mm_storeu_ps(bmin, _mm_min_ps(_mm_loadu_ps(bmin), lo));
+            _mm_storeu_ps(bmax, _mm_max_ps(_mm_loadu_ps(bmax), hi));
+            bins.count[axis][bin[axis]]++;
+        }
     }
 
-    float x = start + i * (stop - start) / (bin_count);
+#else
 
-    if(dimension == 0) {
-        return vec3(x, 0, 0);
-    } else if(dimension == 1) {
-        return vec3(0, x, 0);
-    } else {
-        return vec3(0, 0, x);
+    for(int i = start; i < start + count; i++) {
+        const float c[3] = {refs.center[0][i], refs.center[1][i], refs.center[2][i]};
+        const float lo[3] = {refs.boxmin[0][i], refs.boxmin[1][i], refs.boxmin[2][i]};
+        const float hi[3] = {refs.boxmax[0][i], refs.boxmax[1][i], refs.boxmax[2][i]};
+
+        for(int axis = 0; axis < 3; axis++) {
+            float b = (c[axis] - mapping.origin[axis]) * mapping.scale[axis];
+            int bin = std::min(mapping.bin_count - 1, std::max(0, (int)b));
+            for(int j = 0; j < 3; j++) {
+                bins.boxmin[axis][bin][j] = std::min(bins.boxmin[axis][bin][j], lo[j]);
+                bins.boxmax[axis][bin][j] = std::max(bins.boxmax[axis][bin][j], hi[j]);
+            }
+            bins.count[axis][bin]++;
+        }
     }
+
+#endif
 }
 
-float get_best_split(const box3d& box, int dimension, std::vector<indexed_triangle>& triangles, int start, int count, vec3& split, float to_beat)
+// Lowest SAH cost of splitting positions [start, start + count) at a bin
+// boundary on any axis, with "axis" and "split" set to that split, or
+// "to_beat" if no split is cheaper
+float get_best_split(bvh_builder& builder, const box3d& box, const box3d& centroids, int start, int count, int& axis, float& split, float to_beat)
 {
-    const int max_bin_count = 40;
     int bin_count = std::min(max_bin_count, count * 2);
-    split_bin bins[max_bin_count];
+    bin_mapping mapping(centroids, bin_count);
+    axis_bins bins(bin_count);
 
-    // go through triangles, store in bins
-    for(int i = 0; i < count; i++) {
-        int bin = get_bin_from_triangle(triangles[start + i], box, dimension, bin_count);
-        bins[bin].box.add(triangles[start + i].box);
-        bins[bin].count ++;
-    }
+    if(count < 2 * parallel_chunk_size) {
 
-    // go from front to back, accumulate and store "right box" and count of right tris
-    box3d rightbox;
-    int rtri = 0;
-    for(int i = bin_count - 1; i > -1; i--) {
-        split_bin& b = bins[i];
-        rightbox.add(b.box);
-        rtri += b.count;
-        b.rightbox = rightbox;
-        b.in_and_right = rtri;
-        if(false)
-             printf("bin %d: in_and_right = %d\n", i, rtri);
+        fill_bins(builder.refs, start, count, mapping, bins);
+
+    } else {
+
+        // bin each chunk separately, then merge in chunk order
+        int chunk_count = (count + parallel_chunk_size - 1) / parallel_chunk_size;
+        std::vector<axis_bins> chunk_bins(chunk_count, axis_bins(bin_count));
+        builder.pool.parallel_for(0, count, parallel_chunk_size, [&](int s, int e) {
+            fill_bins(builder.refs, start + s, e - s, mapping, chunk_bins[s / parallel_chunk_size]);
+        });
+        for(int c = 0; c < chunk_count; c++) {
+            bins.merge(chunk_bins[c], bin_count);
+        }
     }
 
-    // go from back to front, accumulate left box, left = count-right,
-    // set best_heuristic
+    // Empty bins hold an inverted box, so merging them changes nothing
+    float area = surface_area(box.dim());
     float best_heuristic = to_beat;
-    box3d leftbox;
 
-    leftbox.add(bins[0].box);
+    for(int a = 0; a < 3; a++) {
+        if(mapping.scale[a] == 0) {
+            continue;
+        }
 
-    for(int i = 1; i < bin_count; i++) {
-        split_bin& b = bins[i];
+        // go from back to front, accumulate and store the area and
+        // triangle count to the right of each bin boundary
+        float rightareas[max_bin_count];
+        int rightcounts[max_bin_count];
+        float lo[3], hi[3];
+        bins.reset_bounds(lo, hi);
+        int rtri = 0;
+        for(int i = bin_count - 1; i > 0; i--) {
+            bins.add_bounds(a, i, lo, hi);
+            rtri += bins.count[a][i];
+            rightareas[i] = surface_area(lo, hi);
+            rightcounts[i] = rtri;
+        }
 
-        int rtri = b.in_and_right;
-        int ltri = count - rtri;
-        if((rtri != 0) && (ltri != 0)) {
-            float heuristic = sah(box.dim(), leftbox.dim(), ltri, b.rightbox.dim(), rtri);
-            if(heuristic < best_heuristic) {
-                best_heuristic = heuristic;
-                split = get_bin_split(i, box, dimension, bin_count);
+        // go from front to back, accumulate left box, left = count-right,
+        // set best_heuristic
+        bins.reset_bounds(lo, hi);
+        int ltri = 0;
+        for(int i = 1; i < bin_count; i++) {
+            bins.add_bounds(a, i - 1, lo, hi);
+            ltri += bins.count[a][i - 1];
+
+            int rtri = rightcounts[i];
+            if((rtri != 0) && (ltri != 0)) {
+                float heuristic = sah_ctrav + sah_cisec * (surface_area(lo, hi) * ltri + rightareas[i] * rtri) / area;
+                if(heuristic < best_heuristic) {
+                    best_heuristic = heuristic;
+                    axis = a;
+                    split = mapping.split(a, i);
+                }
             }
         }
-
-        leftbox.add(b.box);
     }
+
     return best_heuristic;
 }
 
-void partition(std::vector<indexed_triangle>& triangles, int start, unsigned int count, const vec3& split_plane, const vec3& split_plane_normal, int* startA, int* countA, int* startB, int *countB)
+// Reorders positions [start, start + count) so the triangles with
+// centroids below "split_plane" on "axis" come first
+void partition(bvh_builder& builder, int start, unsigned int count, int axis, float split_plane, int* startA, int* countA, int* startB, int *countB)
 {
+    build_references& refs = builder.refs;
+    const std::vector<float>& center = refs.center[axis];
     int s1 = start - 1;
     int s2 = start + count;
 
@@ -256,7 +750,7 @@ void partition(std::vector<indexed_triangle>& triangles, int start, unsigned int
         // from s2 to start + count - 1 is positive
         do {
             s1 += 1;
-        } while((s1 < s2) && dot(triangles[s1].barycenter - split_plane, split_plane_normal) < 0);
+        } while((s1 < s2) && center[s1] < split_plane);
 
         // If there wasn't a positive triangle before s2, done.
         if(s1 >= s2)
@@ -266,7 +760,7 @@ void partition(std::vector<indexed_triangle>& triangles, int start, unsigned int
 
         do {
             s2 -= 1;
-        } while((s1 < s2) && dot(triangles[s2].barycenter - split_plane, split_plane_normal) >= 0);
+        } while((s1 < s2) && center[s2] >= split_plane);
 
 
         // If there wasn't a negative triangle between s1 and s2, done
@@ -275,7 +769,7 @@ void partition(std::vector<indexed_triangle>& triangles, int start, unsigned int
         }
 
         // s2 is now location of highest negative triangle 
-        std::swap(triangles[s1], triangles[s2]);
+        refs.swap(s1, s2);
     } while(true);
 
     // s1 is the first of the positive triangles
@@ -285,75 +779,759 @@ void partition(std::vector<indexed_triangle>& triangles, int start, unsigned int
     *countB = start + count - s1;
 }
 
-group* make_bvh(triangle_set_ptr triangles, int start, unsigned int count, int level)
+// Stable version of partition() for big ranges: count each chunk's
+// negative triangles, then scatter chunks into the scratch array at
+// their prefix-summed offsets and copy back.
+void parallel_partition(bvh_builder& builder, int start, unsigned int count, int axis, float split_plane, int* startA, int* countA, int* startB, int *countB)
 {
-    if(level == 0) {
-        previous_total_shapes_print = std::chrono::system_clock::now();
+    build_references& refs = builder.refs;
+    const std::vector<float>& center = refs.center[axis];
+    int chunk_count = (count + parallel_chunk_size - 1) / parallel_chunk_size;
+    std::vector<int> negative_counts(chunk_count, 0);
+
+    builder.pool.parallel_for(0, count, parallel_chunk_size, [&](int s, int e) {
+        int negative = 0;
+        for(int i = s; i < e; i++) {
+            if(center[start + i] < split_plane) {
+                negative++;
+            }
+        }
+        negative_counts[s / parallel_chunk_size] = negative;
+    });
+
+    std::vector<int> negative_offsets(chunk_count);
+    std::vector<int> positive_offsets(chunk_count);
+    int negative_total = 0;
+    for(int c = 0; c < chunk_count; c++) {
+        negative_offsets[c] = negative_total;
+        negative_total += negative_counts[c];
+    }
+    int positive_total = negative_total;
+    for(int c = 0; c < chunk_count; c++) {
+        positive_offsets[c] = positive_total;
+        int chunk_size = std::min((int)count - c * parallel_chunk_size, parallel_chunk_size);
+        positive_total += chunk_size - negative_counts[c];
+    }
+
+    build_references& scratch = builder.scratch;
+    builder.pool.parallel_for(0, count, parallel_chunk_size, [&](int s, int e) {
+        int c = s / parallel_chunk_size;
+        int n = start + negative_offsets[c];
+        int p = start + positive_offsets[c];
+        for(int i = s; i < e; i++) {
+            if(center[start + i] < split_plane) {
+                refs.copy_to(scratch, start + i, n++);
+            } else {
+                refs.copy_to(scratch, start + i, p++);
+            }
+        }
+    });
+
+    builder.pool.parallel_for(0, count, parallel_chunk_size, [&](int s, int e) {
+        for(int i = start + s; i < start + e; i++) {
+            scratch.copy_to(refs, i, i);
+        }
+    });
+
+    *startA = start;
+    *countA = negative_total;
+    *startB = start + negative_total;
+    *countB = count - negative_total;
+}
+
+void print_progress()
+{
+    if(task_pool::get_thread_index() != 0) {
+        return;
     }
     auto now = std::chrono::system_clock::now();
     std::chrono::duration<float> elapsed = now - previous_total_shapes_print;
     if(elapsed.count() > 1.0) {
-        fprintf(stderr, "total shapes processed = %d\n", total_shapes_processed);
+        fprintf(stderr, "total shapes processed = %d\n", total_shapes_processed.load());
         previous_total_shapes_print = std::chrono::system_clock::now();
     }
+}
 
-    if((level >= bvh_max_depth) || count <= bvh_leaf_max) {
-        return make_leaf(triangles, start, count, level);
+void get_bounds(bvh_builder& builder, int start, unsigned int count, box3d& vertexbox, box3d& barycenterbox)
+{
+    const build_references& refs = builder.refs;
+
+    if(count < 2 * parallel_chunk_size) {
+        for(unsigned int i = 0; i < count; i++) {
+            vertexbox.add(refs.get_box(start + i));
+            barycenterbox.add(refs.get_center(start + i));
+        }
+        return;
+    }
+
+    int chunk_count = (count + parallel_chunk_size - 1) / parallel_chunk_size;
+    std::vector<box3d> vertexboxes(chunk_count);
+    std::vector<box3d> barycenterboxes(chunk_count);
+    builder.pool.parallel_for(0, count, parallel_chunk_size, [&](int s, int e) {
+        int c = s / parallel_chunk_size;
+        for(int i = s; i < e; i++) {
+            vertexboxes[c].add(refs.get_box(start + i));
+            barycenterboxes[c].add(refs.get_center(start + i));
+        }
+    });
+    for(int c = 0; c < chunk_count; c++) {
+        vertexbox.add(vertexboxes[c]);
+        barycenterbox.add(barycenterboxes[c]);
+    }
+}
+
+bool exceeds_leaf_cap(unsigned int count)
+{
+    return bvh_leaf_cap > 0 && count > bvh_leaf_cap;
+}
+
+// Fill in group "g" for positions [start, start + count) with leaves
+// of at most bvh_leaf_cap triangles, splitting at the centroid median
+// of the longest axis.  Triangles with the same centroid are split by
+// position, so this always terminates.
+void build_forced_node(bvh_builder& builder, int g, int start, unsigned int count, int level)
+{
+    if(!exceeds_leaf_cap(count)) {
+        make_leaf(builder, g, start, count, level);
+        return;
     }
 
-    // find bounding box
     box3d vertexbox;
     box3d barycenterbox;
+    get_bounds(builder, start, count, vertexbox, barycenterbox);
+    vec3 extent = barycenterbox.dim();
+    int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+
+    const std::vector<float>& center = builder.refs.center[axis];
+    std::vector<int> order(count);
+    for(unsigned int i = 0; i < count; i++) {
+        order[i] = start + i;
+    }
+    std::nth_element(order.begin(), order.begin() + count / 2, order.end(), [&](int a, int b) {
+        return center[a] < center[b];
+    });
+    build_references sorted;
+    sorted.resize(count);
     for(unsigned int i = 0; i < count; i++) {
-        vertexbox.add(triangles->triangles[start + i].box);
-        barycenterbox.add(triangles->triangles[start + i].barycenter);
+        builder.refs.copy_to(sorted, order[i], i);
+    }
+    for(unsigned int i = 0; i < count; i++) {
+        sorted.copy_to(builder.refs, i, start + i);
     }
 
-    vec3 baryboxdim = barycenterbox.dim();
+    int countA = count / 2;
+    int countB = count - countA;
+    int g1 = builder.tree->allocate(2);
+    int g2 = g1 + 1;
+    if((unsigned int)countA >= subtree_task_min) {
+        task_group children;
+        builder.pool.spawn(children, [&]{ build_forced_node(builder, g1, start, countA, level + 1); });
+        build_forced_node(builder, g2, start + countA, countB, level + 1);
+        builder.pool.wait(children);
+    } else {
+        build_forced_node(builder, g1, start, countA, level + 1);
+        build_forced_node(builder, g2, start + countA, countB, level + 1);
+    }
+    (*builder.tree)[g].make_inner(g1, g2, axis, vertexbox);
+    bvh_stats& stats = builder.stats();
+    stats.node_count_by_level[level]++;
+    stats.node_count++;
+}
 
-    float best_heuristic = sah(count);
-    vec3 split_plane_normal;
-    vec3 split_plane;
+// Make a leaf of positions [start, start + count), or a subtree of
+// them if that's more than the leaf cap allows.  "reason" is reported
+// for leaves left bigger than bvh_leaf_max.
+void make_capped_leaf(bvh_builder& builder, int g, int start, unsigned int count, int level, const char *reason)
+{
+    if(exceeds_leaf_cap(count)) {
+        bvh_stats& stats = builder.stats();
+        stats.forced_range_count++;
+        stats.forced_shape_count += count;
+        build_forced_node(builder, g, start, count, level);
+        return;
+    }
+    if(reason != nullptr) {
+        fprintf(stderr, "Large leaf node (%s) at %d, %u triangles, total %d\n", reason, level, count, total_shapes_processed.load());
+    }
+    make_leaf(builder, g, start, count, level);
+}
 
-    if(baryboxdim.x > baryboxdim.y && baryboxdim.x > baryboxdim.z) {
-        split_plane_normal = vec3(1, 0, 0);
-        best_heuristic = get_best_split(vertexbox, 0, triangles->triangles, start, count, split_plane, best_heuristic);
-    } else if(baryboxdim.y > baryboxdim.z) {
-        split_plane_normal = vec3(0, 1, 0);
-        best_heuristic = get_best_split(vertexbox, 1, triangles->triangles, start, count, split_plane, best_heuristic);
-    } else {
-        split_plane_normal = vec3(0, 0, 1);
-        best_heuristic = get_best_split(vertexbox, 2, triangles->triangles, start, count, split_plane, best_heuristic);
+// Fill in group "g" for positions [start, start + count)
+void build_node(bvh_builder& builder, int g, int start, unsigned int count, int level)
+{
+    print_progress();
+
+    if((level >= bvh_max_depth) || count <= bvh_leaf_max) {
+        make_capped_leaf(builder, g, start, count, level, nullptr);
+        return;
     }
 
+    // find bounding box
+    box3d vertexbox;
+    box3d barycenterbox;
+    get_bounds(builder, start, count, vertexbox, barycenterbox);
+
+    int axis = 0;
+    float split_plane;
+    float best_heuristic = get_best_split(builder, vertexbox, barycenterbox, start, count, axis, split_plane, sah(count));
+
     if(best_heuristic >= sah(count)) {
-        fprintf(stderr, "Large leaf node (no good split) at %d, %u triangles, total %d\n", level, count, total_shapes_processed);
-        return make_leaf(triangles, start, count, level);
+        make_capped_leaf(builder, g, start, count, level, "no good split");
+        return;
     }
 
     int startA, countA;
     int startB, countB;
 
-    partition(triangles->triangles, start, count, split_plane, split_plane_normal, &startA, &countA, &startB, &countB);
-
-    group *g;
+    if(count < 2 * parallel_chunk_size) {
+        partition(builder, start, count, axis, split_plane, &startA, &countA, &startB, &countB);
+    } else {
+        parallel_partition(builder, start, count, axis, split_plane, &startA, &countA, &startB, &countB);
+    }
 
     if(countA > 0 && countB > 0) {
 
-        // construct children
-        group *g1 = make_bvh(triangles, startA, countA, level + 1);
-        g = new group(triangles, g1, nullptr, split_plane_normal, vertexbox);
-        group *g2 = make_bvh(triangles, startB, countB, level + 1);
-        g->positive = g2;
-        bvh_node_count_by_level[level]++;
-        bvh_node_count++;
+        // construct children side by side, handing the negative side
+        // to another thread if it's big enough to be worth it
+        int g1 = builder.tree->allocate(2);
+        int g2 = g1 + 1;
+        if((unsigned int)countA >= subtree_task_min) {
+            task_group children;
+            builder.pool.spawn(children, [&]{ build_node(builder, g1, startA, countA, level + 1); });
+            build_node(builder, g2, startB, countB, level + 1);
+            builder.pool.wait(children);
+        } else {
+            build_node(builder, g1, startA, countA, level + 1);
+            build_node(builder, g2, startB, countB, level + 1);
+        }
+        (*builder.tree)[g].make_inner(g1, g2, axis, vertexbox);
+        bvh_stats& stats = builder.stats();
+        stats.node_count_by_level[level]++;
+        stats.node_count++;
+
+    } else {
+
+        make_capped_leaf(builder, g, start, count, level, "all one side");
+    }
+}
+
+
+// Spatial split BVH after Stich, Friedrich, and Dietrich, "Spatial
+// Splits in Bounding Volume Hierarchies", HPG 2009.  Each reference is
+// an sbvh_reference; once a spatial split clips a reference, its box
+// covers only the part of the triangle it stands for and its
+// barycenter moves to that box's center.
+
+box3d intersect_boxes(const box3d& a, const box3d& b)
+{
+    return box3d(max(a.boxmin, b.boxmin), min(a.boxmax, b.boxmax));
+}
+
+bool box_is_empty(const box3d& box)
+{
+    return box.boxmin.x > box.boxmax.x || box.boxmin.y > box.boxmax.y || box.boxmin.z > box.boxmax.z;
+}
+
+// Bounds of the part of triangle "t" between "lo" and "hi" along "axis",
+// limited to "refbox"
+box3d clip_reference(triangle_set& triangles, const sbvh_reference& r, const box3d& refbox, int axis, float lo, float hi)
+{
+    const indexed_triangle& t = triangles.triangles[r.triangle];
+    box3d clipped;
+    for(int i = 0; i < 3; i++) {
+        const vec3& a = triangles.vertices[t.i[i]].v;
+        const vec3& b = triangles.vertices[t.i[(i + 1) % 3]].v;
+        float ax = get_axis(a, axis);
+        float bx = get_axis(b, axis);
+
+        if(ax >= lo && ax <= hi) {
+            clipped.add(a);
+        }
+        for(float plane : {lo, hi}) {
+            if((ax < plane && bx > plane) || (ax > plane && bx < plane)) {
+                clipped.add(a + (b - a) * ((plane - ax) / (bx - ax)));
+            }
+        }
+    }
+    return intersect_boxes(clipped, refbox);
+}
+
+struct spatial_bin
+{
+    box3d box;
+    int entries;
+    int exits;
+    spatial_bin() :
+        entries(0),
+        exits(0)
+    {}
+};
+
+struct sbvh_split
+{
+    float cost;
+    int axis;
+    float plane;
+    bool spatial;
+    box3d leftbox, rightbox;
+};
+
+void find_object_split(const std::vector<sbvh_reference>& refs, const box3d& box, const box3d& centerbox, int axis, sbvh_split& best)
+{
+    int count = refs.size();
+    int bin_count = std::min(max_bin_count, count * 2);
+    float start = get_axis(centerbox.boxmin, axis);
+    float stop = get_axis(centerbox.boxmax, axis);
+    if(stop <= start) {
+        return;
+    }
+
+    split_bin bins[max_bin_count];
+    for(auto& r : refs) {
+        int bin = floor((get_axis(r.barycenter, axis) - start) * bin_count / (stop - start));
+        bin = std::min(bin_count - 1, std::max(0, bin));
+        bins[bin].box.add(r.box);
+        bins[bin].count++;
+    }
+
+    box3d rightbox;
+    int rtri = 0;
+    for(int i = bin_count - 1; i > -1; i--) {
+        rightbox.add(bins[i].box);
+        rtri += bins[i].count;
+        bins[i].rightbox = rightbox;
+        bins[i].in_and_right = rtri;
+    }
+
+    box3d leftbox = bins[0].box;
+    for(int i = 1; i < bin_count; i++) {
+        int rtri = bins[i].in_and_right;
+        int ltri = count - rtri;
+        if((rtri != 0) && (ltri != 0)) {
+            float cost = sah(box.dim(), leftbox.dim(), ltri, bins[i].rightbox.dim(), rtri);
+            if(cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.plane = start + i * (stop - start) / bin_count;
+                best.spatial = false;
+                best.leftbox = leftbox;
+                best.rightbox = bins[i].rightbox;
+            }
+        }
+        leftbox.add(bins[i].box);
+    }
+}
+
+void find_spatial_split(triangle_set& triangles, const std::vector<sbvh_reference>& refs, const box3d& box, int axis, int budget, sbvh_split& best)
+{
+    const int bin_count = max_bin_count;
+    float start = get_axis(box.boxmin, axis);
+    float stop = get_axis(box.boxmax, axis);
+    if(stop <= start) {
+        return;
+    }
+    float bin_size = (stop - start) / bin_count;
+
+    spatial_bin bins[bin_count];
+    for(auto& r : refs) {
+        int first = floor((get_axis(r.box.boxmin, axis) - start) / bin_size);
+        int last = floor((get_axis(r.box.boxmax, axis) - start) / bin_size);
+        first = std::min(bin_count - 1, std::max(0, first));
+        last = std::min(bin_count - 1, std::max(first, last));
+
+        for(int i = first; i <= last; i++) {
+            float lo = (i == first) ? -std::numeric_limits<float>::max() : start + i * bin_size;
+            float hi = (i == last) ? std::numeric_limits<float>::max() : start + (i + 1) * bin_size;
+            bins[i].box.add(clip_reference(triangles, r, r.box, axis, lo, hi));
+        }
+        bins[first].entries++;
+        bins[last].exits++;
+    }
 
+    box3d rightboxes[bin_count];
+    int rightcounts[bin_count];
+    box3d rightbox;
+    int rtri = 0;
+    for(int i = bin_count - 1; i > -1; i--) {
+        rightbox.add(bins[i].box);
+        rtri += bins[i].exits;
+        rightboxes[i] = rightbox;
+        rightcounts[i] = rtri;
+    }
+
+    int count = refs.size();
+    box3d leftbox = bins[0].box;
+    int ltri = bins[0].entries;
+    for(int i = 1; i < bin_count; i++) {
+        int rtri = rightcounts[i];
+        if((rtri != 0) && (ltri != 0) && (ltri + rtri - count <= budget)) {
+            float cost = sah(box.dim(), leftbox.dim(), ltri, rightboxes[i].dim(), rtri);
+            if(cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.plane = start + i * bin_size;
+                best.spatial = true;
+                best.leftbox = leftbox;
+                best.rightbox = rightboxes[i];
+            }
+        }
+        leftbox.add(bins[i].box);
+        ltri += bins[i].entries;
+    }
+}
+
+void make_sbvh_leaf(bvh_builder& builder, int g, std::vector<sbvh_reference>& refs, const box3d& box, int level)
+{
+    int count = refs.size();
+    total_shapes_processed += count;
+    (*builder.tree)[g].make_leaf(0, count, box);
+    builder.thread_leaf_refs[task_pool::get_thread_index()][g].swap(refs);
+
+    bvh_stats& stats = builder.stats();
+    if(count >= bvh_leaf_max_size_for_stats) {
+        stats.leaf_count_ge_max_size++;
     } else {
+        stats.leaf_count_by_size[count]++;
+    }
+    stats.leaf_count++;
+    stats.node_count_by_level[level]++;
+    stats.node_count++;
+}
 
-        fprintf(stderr, "Large leaf node (all one side) at %d, %u triangles, total %d\n", level, count, total_shapes_processed);
-        g = make_leaf(triangles, start, count, level);
+// build_forced_node() for SBVH references
+void build_forced_sbvh_node(bvh_builder& builder, int g, std::vector<sbvh_reference>& refs, const box3d& box, int level)
+{
+    if(!exceeds_leaf_cap(refs.size())) {
+        make_sbvh_leaf(builder, g, refs, box, level);
+        return;
     }
 
-    return g;
+    box3d centerbox;
+    for(auto& r : refs) {
+        centerbox.add(r.barycenter);
+    }
+    vec3 extent = centerbox.dim();
+    int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+
+    auto middle = refs.begin() + refs.size() / 2;
+    std::nth_element(refs.begin(), middle, refs.end(), [axis](const sbvh_reference& a, const sbvh_reference& b) {
+        return get_axis(a.barycenter, axis) < get_axis(b.barycenter, axis);
+    });
+    std::vector<sbvh_reference> left(refs.begin(), middle);
+    std::vector<sbvh_reference> right(middle, refs.end());
+    std::vector<sbvh_reference>().swap(refs);
+
+    box3d leftbox, rightbox;
+    for(auto& r : left) {
+        leftbox.add(r.box);
+    }
+    for(auto& r : right) {
+        rightbox.add(r.box);
+    }
+
+    int g1 = builder.tree->allocate(2);
+    int g2 = g1 + 1;
+    if(left.size() >= subtree_task_min) {
+        task_group children;
+        builder.pool.spawn(children, [&]{ build_forced_sbvh_node(builder, g1, left, leftbox, level + 1); });
+        build_forced_sbvh_node(builder, g2, right, rightbox, level + 1);
+        builder.pool.wait(children);
+    } else {
+        build_forced_sbvh_node(builder, g1, left, leftbox, level + 1);
+        build_forced_sbvh_node(builder, g2, right, rightbox, level + 1);
+    }
+    (*builder.tree)[g].make_inner(g1, g2, axis, box);
+    bvh_stats& stats = builder.stats();
+    stats.node_count_by_level[level]++;
+    stats.node_count++;
 }
 
+// make_capped_leaf() for SBVH references
+void make_capped_sbvh_leaf(bvh_builder& builder, int g, std::vector<sbvh_reference>& refs, const box3d& box, int level, const char *reason)
+{
+    if(exceeds_leaf_cap(refs.size())) {
+        bvh_stats& stats = builder.stats();
+        stats.forced_range_count++;
+        stats.forced_shape_count += refs.size();
+        build_forced_sbvh_node(builder, g, refs, box, level);
+        return;
+    }
+    if(reason != nullptr) {
+        fprintf(stderr, "Large leaf node (%s) at %d, %zd references, total %d\n", reason, level, refs.size(), total_shapes_processed.load());
+    }
+    make_sbvh_leaf(builder, g, refs, box, level);
+}
+
+void split_references(triangle_set& triangles, const std::vector<sbvh_reference>& refs, const sbvh_split& split, std::vector<sbvh_reference>& left, std::vector<sbvh_reference>& right)
+{
+    if(split.spatial) {
+
+        for(auto& r : refs) {
+            if(get_axis(r.box.boxmax, split.axis) <= split.plane) {
+                left.push_back(r);
+            } else if(get_axis(r.box.boxmin, split.axis) >= split.plane) {
+                right.push_back(r);
+            } else {
+                sbvh_reference l = r;
+                sbvh_reference rt = r;
+                l.box = clip_reference(triangles, r, r.box, split.axis, -std::numeric_limits<float>::max(), split.plane);
+                rt.box = clip_reference(triangles, r, r.box, split.axis, split.plane, std::numeric_limits<float>::max());
+                l.barycenter = l.box.center();
+                rt.barycenter = rt.box.center();
+                if(!box_is_empty(l.box)) {
+                    left.push_back(l);
+                }
+                if(!box_is_empty(rt.box)) {
+                    right.push_back(rt);
+                }
+            }
+        }
+
+    } else {
+
+        for(auto& r : refs) {
+            if(get_axis(r.barycenter, split.axis) < split.plane) {
+                left.push_back(r);
+            } else {
+                right.push_back(r);
+            }
+        }
+    }
+}
+
+// Fill in group "g" for "refs"; "budget" is the number of references
+// this subtree may still add
+void build_sbvh_node(bvh_builder& builder, int g, std::vector<sbvh_reference>& refs, int budget, float root_area, int level)
+{
+    triangle_set& triangles = *builder.triangles;
+    unsigned int count = refs.size();
+
+    print_progress();
+
+    box3d box;
+    box3d centerbox;
+    for(auto& r : refs) {
+        box.add(r.box);
+        centerbox.add(r.barycenter);
+    }
+
+    if((level >= bvh_max_depth) || count <= bvh_leaf_max) {
+        make_capped_sbvh_leaf(builder, g, refs, box, level, nullptr);
+        return;
+    }
+
+    sbvh_split object_split;
+    object_split.cost = sah(count);
+    object_split.spatial = false;
+    for(int axis = 0; axis < 3; axis++) {
+        find_object_split(refs, box, centerbox, axis, object_split);
+    }
+    bool found_object_split = object_split.cost < sah(count);
+
+    sbvh_split best = object_split;
+    if(budget > 0) {
+        box3d overlap = intersect_boxes(object_split.leftbox, object_split.rightbox);
+        if(!found_object_split || (!box_is_empty(overlap) && surface_area(overlap.dim()) > sbvh_alpha * root_area)) {
+            for(int axis = 0; axis < 3; axis++) {
+                find_spatial_split(triangles, refs, box, axis, budget, best);
+            }
+        }
+    }
+
+    if(best.cost >= sah(count)) {
+        make_capped_sbvh_leaf(builder, g, refs, box, level, "no good split");
+        return;
+    }
+
+    std::vector<sbvh_reference> left, right;
+    split_references(triangles, refs, best, left, right);
+
+    // Binning only estimates the duplicates, so a spatial split can
+    // come out over budget; use the object split instead
+    if(best.spatial && (left.empty() || right.empty() || (int)(left.size() + right.size() - count) > budget) && found_object_split) {
+        best = object_split;
+        left.clear();
+        right.clear();
+        split_references(triangles, refs, best, left, right);
+    }
+
+    int added = left.size() + right.size() - count;
+    if(left.empty() || right.empty() || added > budget) {
+        make_capped_sbvh_leaf(builder, g, refs, box, level, "all one side");
+        return;
+    }
+
+    std::vector<sbvh_reference>().swap(refs);
+
+    // Hand the remaining budget to the children by reference count so
+    // the split is the same regardless of which thread gets there first
+    int remaining = budget - added;
+    int left_budget = (int)((long long)remaining * left.size() / (left.size() + right.size()));
+    int right_budget = remaining - left_budget;
+
+    int g1 = builder.tree->allocate(2);
+    int g2 = g1 + 1;
+    if(left.size() >= subtree_task_min) {
+        task_group children;
+        builder.pool.spawn(children, [&]{ build_sbvh_node(builder, g1, left, left_budget, root_area, level + 1); });
+        build_sbvh_node(builder, g2, right, right_budget, root_area, level + 1);
+        builder.pool.wait(children);
+    } else {
+        build_sbvh_node(builder, g1, left, left_budget, root_area, level + 1);
+        build_sbvh_node(builder, g2, right, right_budget, root_area, level + 1);
+    }
+
+    (*builder.tree)[g].make_inner(g1, g2, best.axis, box);
+    bvh_stats& stats = builder.stats();
+    stats.node_count_by_level[level]++;
+    stats.node_count++;
+}
+
+// Lay out SBVH leaf references in depth-first order and point each leaf
+// at its range
+void place_sbvh_references(group_tree& tree, int g, std::map<int, std::vector<sbvh_reference>>& leaf_refs, const std::vector<indexed_triangle>& triangles, int start, std::vector<indexed_triangle>& placed)
+{
+    if(!tree[g].is_leaf()) {
+        place_sbvh_references(tree, tree[g].negative, leaf_refs, triangles, start, placed);
+        place_sbvh_references(tree, tree[g].positive, leaf_refs, triangles, start, placed);
+    } else {
+        tree[g].start = start + placed.size();
+        for(auto& r : leaf_refs[g]) {
+            placed.push_back(triangles[r.triangle]);
+        }
+    }
+}
+
+void make_sbvh(bvh_builder& builder, int start, unsigned int count)
+{
+    std::vector<indexed_triangle>& triangles = builder.triangles->triangles;
+    std::vector<sbvh_reference> refs(count);
+
+    box3d box;
+    for(unsigned int i = 0; i < count; i++) {
+        refs[i].triangle = start + i;
+        refs[i].box = builder.triangles->bounds(start + i);
+        refs[i].barycenter = builder.triangles->barycenter(start + i);
+        box.add(refs[i].box);
+    }
+
+    int budget = count * sbvh_memory_budget;
+    group_tree& tree = *builder.tree;
+    tree.root = tree.allocate(1);
+    build_sbvh_node(builder, tree.root, refs, budget, surface_area(box.dim()), 0);
+
+    std::map<int, std::vector<sbvh_reference>> leaf_refs;
+    for(auto& m : builder.thread_leaf_refs) {
+        leaf_refs.insert(m.begin(), m.end());
+    }
+
+    std::vector<indexed_triangle> placed;
+    place_sbvh_references(tree, tree.root, leaf_refs, triangles, start, placed);
+
+    fprintf(stderr, "SBVH: %zd references for %u triangles\n", placed.size(), count);
+
+    // Replace [start, start + count) with the references
+    triangles.erase(triangles.begin() + start, triangles.begin() + start + count);
+    triangles.insert(triangles.begin() + start, placed.begin(), placed.end());
+}
+
+void make_sah_bvh(bvh_builder& builder, int start, unsigned int count)
+{
+    triangle_set_ptr& triangles = builder.triangles;
+    std::vector<indexed_triangle>& tris = triangles->triangles;
+
+    builder.start = start;
+    builder.refs.resize(count);
+    builder.pool.parallel_for(0, count, parallel_chunk_size, [&](int s, int e) {
+        for(int i = s; i < e; i++) {
+            builder.refs.set(i, i, triangles->bounds(start + i), triangles->barycenter(start + i));
+        }
+    });
+    if(count >= 2 * parallel_chunk_size) {
+        builder.scratch.resize(count);
+    }
+
+    group_tree *tree = new group_tree(triangles, std::max(1, 2 * (int)count));
+    builder.tree = tree;
+    tree->root = tree->allocate(1);
+    build_node(builder, tree->root, 0, count, 0);
+    tree->finish();
+
+    // Leaves point at positions, so put the triangles there
+    std::vector<indexed_triangle> ordered(tris.begin() + start, tris.begin() + start + count);
+    builder.pool.parallel_for(0, count, parallel_chunk_size, [&](int s, int e) {
+        for(int i = s; i < e; i++) {
+            ordered[i] = tris[start + builder.refs.triangle[i]];
+        }
+    });
+    std::copy(ordered.begin(), ordered.end(), tris.begin() + start);
+
+    builder.refs = build_references();
+    builder.scratch = build_references();
+}
+
+group_tree* make_bvh(triangle_set_ptr triangles, int start, unsigned int count, const char *builder_name)
+{
+    if(builder_name == nullptr) {
+        builder_name = bvh_builder_name;
+    }
+
+    bvh_builder builder(triangles, get_world_pool());
+    bvh_total_stats = bvh_stats();
+    total_shapes_processed = 0;
+    previous_total_shapes_print = std::chrono::system_clock::now();
+
+    group_tree *tree;
+    bool stats_recorded = true;
+
+    // Every leaf holds at least one triangle or reference, so a binary
+    // tree over n of them has at most 2n - 1 groups
+    if((strcmp(builder_name, "lbvh") == 0) || (strcmp(builder_name, "hlbvh") == 0)) {
+
+        tree = make_lbvh(triangles, start, count, builder.pool, strcmp(builder_name, "hlbvh") == 0);
+        stats_recorded = false;
+
+    } else if(strcmp(builder_name, "sbvh") == 0) {
+
+        int max_references = count + (int)(count * sbvh_memory_budget);
+        tree = new group_tree(triangles, std::max(1, 2 * max_references));
+        builder.tree = tree;
+        make_sbvh(builder, start, count);
+        tree->finish();
+
+    } else {
+
+        if(strcmp(builder_name, "sah") != 0) {
+            fprintf(stderr, "Unknown BVH builder \"%s\", using \"sah\"\n", builder_name);
+        }
+        make_sah_bvh(builder, start, count);
+        tree = builder.tree;
+    }
+
+    if(bvh_optimize_seconds > 0) {
+        optimize_bvh(*tree, builder.pool, bvh_optimize_seconds);
+        stats_recorded = false;
+    }
+
+    number_bvh_depth_first(*tree);
+
+    if(stats_recorded) {
+        for(auto& s : builder.thread_stats) {
+            bvh_total_stats.merge(s);
+        }
+    } else {
+        record_bvh_stats(*tree, tree->root, 0, bvh_total_stats);
+    }
+
+    // Forced splits halve their range, so past the depth limit a tree
+    // grows by at most log2 of its size; twice that for HLBVH, whose
+    // cluster tree and the trees below it can each run past the limit
+    int size_bits = 1;
+    while(size_bits < 31 && (1 << size_bits) < tree->size()) {
+        size_bits++;
+    }
+    assert(bvh_total_stats.node_count_by_level.empty() ||
+        bvh_total_stats.node_count_by_level.rbegin()->first <= std::max(bvh_max_depth, 0) + 2 * size_bits);
+
+    return tree;
+}
@@ -14,8 +14,85 @@
    limitations under the License.
 */
 
+#pragma once
+
+#include <vector>
 #include "group.h"
 #include "triangle-set.h"
 
-group* make_bvh(triangle_set_ptr triangles, int start, unsigned int count, int level = 0);
+class task_pool;
+
+// "builder" is one of "sah", "sbvh", "lbvh", or "hlbvh"; nullptr means
+// the one named by BVH_BUILDER, "sah" by default
+group_tree* make_bvh(triangle_set_ptr triangles, int start, unsigned int count, const char *builder = nullptr);
+const char *get_bvh_builder_name();
 void print_bvh_stats();
+
+// Total SAH cost of the tree, relative to the root's surface area
+float get_bvh_sah_cost(const group_tree& tree);
+
+// Measures of a finished tree for comparing builders and models
+struct bvh_quality
+{
+    float sah_cost;
+    float sibling_overlap; // surface area shared by siblings over that of their parents, summed over the tree
+    int node_count;
+    int leaf_count;
+    float average_leaf_depth;
+    int max_leaf_depth;
+    float average_leaf_size;
+    unsigned int max_leaf_size;
+    int leaves_over_limit; // leaves holding more than "leaf_limit" triangles
+    int triangles_over_limit; // triangles past "leaf_limit" in those leaves
+};
+bvh_quality get_bvh_quality(const group_tree& tree, unsigned int leaf_limit);
+
+// Build parameters from BVH_LEAF_MAX, BVH_MAX_DEPTH, SAH_CTRAV, SAH_CISEC
+struct bvh_parameters
+{
+    unsigned int leaf_max;
+    int max_depth;
+    unsigned int leaf_cap; // hard limit on leaf size, past leaf_max and max_depth; 0 for none
+    float sah_ctrav;
+    float sah_cisec;
+};
+bvh_parameters get_bvh_parameters();
+void set_bvh_parameters(const bvh_parameters& params);
+
+// Writes "params" in the form read from the file named by BVH_PROFILE
+// at startup, before the environment variables above are applied
+bool save_bvh_profile(const char *filename, const bvh_parameters& params);
+
+// In lbvh.cpp; with "sah_top_levels" it's HLBVH
+group_tree* make_lbvh(triangle_set_ptr triangles, int start, unsigned int count, task_pool& pool, bool sah_top_levels);
+
+// In bvh-optimize.cpp; restructures "tree" in place to lower its SAH
+// cost, stopping after "seconds"
+void optimize_bvh(group_tree& tree, task_pool& pool, float seconds);
+
+// In bvh-refit.cpp; recomputes every box in "tree" and the bounds of
+// its triangles from the current vertex positions, keeping the topology
+void refit_bvh(group_tree& tree, task_pool& pool);
+
+// In bvh-layout.cpp; renumbers the nodes of "tree" depth first, negative
+// child first, with siblings together.  make_bvh does this last, since
+// builders allocate nodes from several threads, so the numbering is
+// the same for any thread count.
+void number_bvh_depth_first(group_tree& tree);
+
+// In bvh-layout.cpp; renumbers the nodes of "tree" in the order named by
+// BVH_NODE_LAYOUT, one of "build" (the default, leaving them as
+// make_bvh numbered them), "dfs", "veb", or "treelet"
+void layout_bvh(group_tree& tree);
+const char *get_bvh_layout_name();
+
+// How the nodes one ray fetches spread over the tiles of a data texture
+// "texture_width" texels wide, in square tiles "tile_size" on a side;
+// "tiled" is scene_shader_data::tiled_texels
+struct bvh_locality
+{
+    float fetches_per_ray;
+    float tiles_per_ray; // distinct tiles
+    float same_tile_fraction; // fetches from the tile of the fetch before
+};
+bvh_locality measure_bvh_locality(const group_tree& tree, const std::vector<ray>& rays, unsigned int texture_width, bool tiled, unsigned int tile_size);
@@ -0,0 +1,103 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include "closest-first-bvh.h"
+
+namespace
+{
+
+// Children of a leaf in group_children
+const float leaf_children = 0x7fffffff;
+
+// Entry distance of the ray into node "g", or a miss if the box is
+// behind tmin or past the closest hit
+bool enter_node(const scene_shader_data& data, int g, const ray& r, float tmin, float tmax, float& t)
+{
+    const float d[3] = {r.d.x, r.d.y, r.d.z};
+    const float o[3] = {r.o.x, r.o.y, r.o.z};
+
+    int texel = data.texel(g);
+    float t0 = tmin;
+    float t1 = tmax;
+    for(int a = 0; a < 3; a++) {
+        float lo = data.group_boxmin[texel * 3 + a];
+        float hi = data.group_boxmax[texel * 3 + a];
+        float near = ((d[a] >= 0 ? lo : hi) - o[a]) / d[a];
+        float far = ((d[a] >= 0 ? hi : lo) - o[a]) / d[a];
+        t0 = std::max(t0, near);
+        t1 = std::min(t1, far);
+    }
+    t = t0;
+    return t0 <= t1;
+}
+
+}; // unnamed namespace for file scope
+
+bool closest_first_bvh_intersect(const scene_shader_data& data, const triangle_set& triangles, const ray& r, float tmin, ray_hit& hit)
+{
+    int stack_node[closest_first_max_depth];
+    float stack_t[closest_first_max_depth];
+    int stack_top = 0;
+
+    bool found = false;
+    float t;
+    int g = enter_node(data, data.tree_root, r, tmin, hit.t, t) ? data.tree_root : -1;
+
+    while(g != -1) {
+        int texel = data.texel(g);
+        float negative = data.group_children[texel * 2 + 0];
+        float positive = data.group_children[texel * 2 + 1];
+
+        if(negative < leaf_children) {
+
+            float t0, t1;
+            bool hit0 = enter_node(data, negative, r, tmin, hit.t, t0);
+            bool hit1 = enter_node(data, positive, r, tmin, hit.t, t1);
+            if(hit0 && hit1) {
+                bool negative_first = t0 <= t1;
+                stack_node[stack_top] = negative_first ? positive : negative;
+                stack_t[stack_top] = negative_first ? t1 : t0;
+                stack_top++;
+                g = negative_first ? negative : positive;
+                continue;
+            } else if(hit0 || hit1) {
+                g = hit0 ? negative : positive;
+                continue;
+            }
+
+        } else {
+
+            int start = data.group_objects[texel * 2 + 0];
+            int count = data.group_objects[texel * 2 + 1];
+            for(int j = 0; j < count; j++) {
+                found |= triangle_intersect(triangles, start + j, r, tmin, hit);
+            }
+        }
+
+        // Nearest pushed subtree that may still hold a closer hit
+        g = -1;
+        while(stack_top > 0) {
+            stack_top--;
+            if(stack_t[stack_top] < hit.t) {
+                g = stack_node[stack_top];
+                break;
+            }
+        }
+    }
+
+    return found;
+}
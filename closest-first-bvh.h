@@ -0,0 +1,35 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include "vectormath.h"
+#include "triangle-set.h"
+#include "wide-bvh.h"
+#include "world.h"
+
+// Closest-first traversal over the default float nodes and
+// group_children, without hit/miss links.  At each inner node both
+// children's boxes are tested, the nearer one is entered, and the
+// other is pushed with its entry distance.  Popped subtrees that start
+// past the closest hit so far are skipped.  The stack holds at most
+// one entry per level, so trees deeper than this aren't traversed this
+// way.  Must match closest_first_stack_size in raytracer.es.fs.
+const int closest_first_max_depth = 64;
+
+// Closest hit through group_boxmin, group_boxmax, group_children, and
+// group_objects the way the shader traverses them
+bool closest_first_bvh_intersect(const scene_shader_data& data, const triangle_set& triangles, const ray& r, float tmin, ray_hit& hit);
@@ -0,0 +1,160 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include "compressed-bvh.h"
+#include "compact-vertices.h"
+#include "task-pool.h"
+
+namespace
+{
+
+float sign_not_zero(float f)
+{
+    return (f >= 0) ? 1.0f : -1.0f;
+}
+
+uint32_t quantize_normal(float f)
+{
+    int q = (int)roundf(std::max(-1.0f, std::min(1.0f, f)) * compact_normal_steps);
+    return (uint32_t)(q & 0xffff);
+}
+
+float dequantize_normal(uint32_t bits)
+{
+    return (int16_t)(bits & 0xffff) / compact_normal_steps;
+}
+
+uint16_t quantize_coordinate(float f, float lo, float hi)
+{
+    if(hi <= lo) {
+        return 0;
+    }
+    float q = roundf((f - lo) / (hi - lo) * compact_position_steps);
+    return (uint16_t)std::max(0.0f, std::min(compact_position_steps, q));
+}
+
+vec3 decode_position(const uint16_t q[3], const box3d& frame)
+{
+    vec3 step = frame.dim() * (1.0f / compact_position_steps);
+    return frame.boxmin + vec3(q[0] * step.x, q[1] * step.y, q[2] * step.z);
+}
+
+void get_leaf_frames(const group_tree& tree, int g, int base, const box3d& parent, const scene_shader_data& data, std::vector<box3d>& frames)
+{
+    box3d frame = tree[g].box;
+    if(data.compressed_nodes) {
+        frame = decode_compressed_bounds(data.group_nodes + data.texel(base + g) * 4, parent);
+    }
+
+    if(tree[g].is_leaf()) {
+        for(uint32_t i = 0; i < tree[g].count; i++) {
+            frames[tree[g].start + i] = frame;
+        }
+    } else {
+        get_leaf_frames(tree, tree[g].negative, base, frame, data, frames);
+        get_leaf_frames(tree, tree[g].positive, base, frame, data, frames);
+    }
+}
+
+}; // unnamed namespace for file scope
+
+uint32_t encode_octahedral_normal(const vec3& n)
+{
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if(l1 == 0) {
+        return 0;
+    }
+    float x = n.x / l1;
+    float y = n.y / l1;
+    if(n.z < 0) {
+        float folded_x = (1 - fabsf(y)) * sign_not_zero(x);
+        float folded_y = (1 - fabsf(x)) * sign_not_zero(y);
+        x = folded_x;
+        y = folded_y;
+    }
+    return quantize_normal(x) | (quantize_normal(y) << 16);
+}
+
+vec3 decode_octahedral_normal(uint32_t bits)
+{
+    float x = dequantize_normal(bits);
+    float y = dequantize_normal(bits >> 16);
+    float z = 1 - fabsf(x) - fabsf(y);
+    if(z < 0) {
+        float unfolded_x = (1 - fabsf(y)) * sign_not_zero(x);
+        float unfolded_y = (1 - fabsf(x)) * sign_not_zero(y);
+        x = unfolded_x;
+        y = unfolded_y;
+    }
+    return normalize(vec3(x, y, z));
+}
+
+void get_leaf_frames(const group_tree& tree, int base, const scene_shader_data& data, std::vector<box3d>& frames)
+{
+    box3d root = tree[tree.root].box;
+    if(data.compressed_nodes) {
+        root = box3d(vec3(data.root_boxmin[0], data.root_boxmin[1], data.root_boxmin[2]),
+            vec3(data.root_boxmax[0], data.root_boxmax[1], data.root_boxmax[2]));
+    }
+    get_leaf_frames(tree, tree.root, base, root, data, frames);
+}
+
+bool leaves_contain_triangles(const group_tree& tree)
+{
+    for(const group& g : tree.groups) {
+        if(!g.is_leaf()) {
+            continue;
+        }
+        for(uint32_t i = 0; i < g.count; i++) {
+            const indexed_triangle& t = tree.triangles->triangles[g.start + i];
+            for(int j = 0; j < 3; j++) {
+                const vec3& v = tree.triangles->vertices[t.i[j]].v;
+                if(v.x < g.box.boxmin.x || v.y < g.box.boxmin.y || v.z < g.box.boxmin.z ||
+                    v.x > g.box.boxmax.x || v.y > g.box.boxmax.y || v.z > g.box.boxmax.z) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void store_compact_positions(const triangle_set& triangles, const std::vector<box3d>& frames, scene_shader_data& data, task_pool& pool)
+{
+    pool.parallel_for(0, triangles.triangles.size(), 16384, [&](int first, int last) {
+        for(int i = first; i < last; i++) {
+            const indexed_triangle& t = triangles.triangles[i];
+            const box3d& frame = frames[i];
+            for(int j = 0; j < 3; j++) {
+                const vec3& v = triangles.vertices[t.i[j]].v;
+                uint16_t *q = data.compact_positions + data.texel(i * 3 + j) * 3;
+                q[0] = quantize_coordinate(v.x, frame.boxmin.x, frame.boxmax.x);
+                q[1] = quantize_coordinate(v.y, frame.boxmin.y, frame.boxmax.y);
+                q[2] = quantize_coordinate(v.z, frame.boxmin.z, frame.boxmax.z);
+            }
+        }
+    });
+}
+
+bool compact_triangle_intersect(const scene_shader_data& data, const box3d& frame, int which, const ray& r, float tmin, ray_hit& hit)
+{
+    vec3 v0 = decode_position(data.compact_positions + data.texel(which * 3 + 0) * 3, frame);
+    vec3 v1 = decode_position(data.compact_positions + data.texel(which * 3 + 1) * 3, frame);
+    vec3 v2 = decode_position(data.compact_positions + data.texel(which * 3 + 2) * 3, frame);
+    return triangle_intersect(v0, v1, v2, which, r, tmin, hit);
+}
@@ -0,0 +1,64 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "vectormath.h"
+#include "triangle-set.h"
+#include "group.h"
+#include "wide-bvh.h"
+#include "world.h"
+
+class task_pool;
+
+// Compact vertex attributes for the shader:
+//
+//   compact_positions  three 16-bit unsigned coordinates per vertex,
+//                      quantized in the box of the triangle's leaf as
+//                      the shader decodes it, so a decoded triangle
+//                      stays inside its leaf
+//   compact_normals    one uint per vertex, an octahedral encoding
+//                      with 16-bit signed x in the low half and y in
+//                      the high half
+//
+// A vertex shared by triangles in different leaves is rounded on each
+// leaf's grid, so neighboring triangles may not meet exactly; the gap
+// is at most half a step, a 65535th of a leaf's extent.
+
+const float compact_position_steps = 65535.0f;
+const float compact_normal_steps = 32767.0f;
+
+uint32_t encode_octahedral_normal(const vec3& n);
+vec3 decode_octahedral_normal(uint32_t bits);
+
+// Box each triangle's positions are quantized in, for every triangle
+// in a leaf of "tree", which is stored at "base" in "data"; other
+// entries of "frames" are left alone
+void get_leaf_frames(const group_tree& tree, int base, const scene_shader_data& data, std::vector<box3d>& frames);
+
+// Whether every triangle in a leaf of "tree" lies inside the leaf's
+// box, so it can be quantized there; SBVH leaf boxes are clipped to
+// the parts of their triangles inside them, so theirs may not
+bool leaves_contain_triangles(const group_tree& tree);
+
+// Fills in data.compact_positions for every triangle
+void store_compact_positions(const triangle_set& triangles, const std::vector<box3d>& frames, scene_shader_data& data, task_pool& pool);
+
+// Same test as triangle_intersect in raytracer.es.fs with
+// COMPACT_VERTICES, triangle "which" decoded in "frame"
+bool compact_triangle_intersect(const scene_shader_data& data, const box3d& frame, int which, const ray& r, float tmin, ray_hit& hit);
@@ -0,0 +1,148 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "compressed-bvh.h"
+
+namespace
+{
+
+const int quantized_steps = 255;
+
+// Min and max are measured from opposite ends of the parent so that 0
+// and 255 decode to exactly the parent's bounds
+float dequantize_min(float parent_min, float scale, uint32_t q)
+{
+    return parent_min + q * scale;
+}
+
+float dequantize_max(float parent_max, float scale, uint32_t q)
+{
+    return parent_max - (quantized_steps - q) * scale;
+}
+
+uint32_t quantize_min(float v, float parent_min, float scale)
+{
+    if(!(scale > 0)) {
+        return 0;
+    }
+    int q = floor((v - parent_min) / scale);
+    q = std::min(quantized_steps, std::max(0, q));
+    while(q > 0 && dequantize_min(parent_min, scale, q) > v) {
+        q--;
+    }
+    return q;
+}
+
+uint32_t quantize_max(float v, float parent_max, float scale)
+{
+    if(!(scale > 0)) {
+        return quantized_steps;
+    }
+    int q = quantized_steps - (int)floor((parent_max - v) / scale);
+    q = std::min(quantized_steps, std::max(0, q));
+    while(q < quantized_steps && dequantize_max(parent_max, scale, q) < v) {
+        q++;
+    }
+    return q;
+}
+
+}; // unnamed namespace for file scope
+
+box3d encode_compressed_bounds(const box3d& box, const box3d& parent, int depth, int axis, uint32_t node[4])
+{
+    const float *lo = &box.boxmin.x;
+    const float *hi = &box.boxmax.x;
+    const float *pmin = &parent.boxmin.x;
+    const float *pmax = &parent.boxmax.x;
+
+    uint32_t qmin[3], qmax[3];
+    for(int a = 0; a < 3; a++) {
+        float scale = (pmax[a] - pmin[a]) / quantized_steps;
+        qmin[a] = quantize_min(lo[a], pmin[a], scale);
+        qmax[a] = quantize_max(hi[a], pmax[a], scale);
+    }
+
+    assert(depth <= compressed_bvh_max_depth);
+    node[0] = qmin[0] | (qmin[1] << 8) | (qmin[2] << 16) | (qmax[0] << 24);
+    node[1] = qmax[1] | (qmax[2] << 8) | (depth << 16) | (axis << 24);
+
+    return decode_compressed_bounds(node, parent);
+}
+
+box3d decode_compressed_bounds(const uint32_t node[4], const box3d& parent)
+{
+    uint32_t qmin[3] = {node[0] & 0xff, (node[0] >> 8) & 0xff, (node[0] >> 16) & 0xff};
+    uint32_t qmax[3] = {node[0] >> 24, node[1] & 0xff, (node[1] >> 8) & 0xff};
+    const float *pmin = &parent.boxmin.x;
+    const float *pmax = &parent.boxmax.x;
+
+    float boxmin[3], boxmax[3];
+    for(int a = 0; a < 3; a++) {
+        float scale = (pmax[a] - pmin[a]) / quantized_steps;
+        boxmin[a] = dequantize_min(pmin[a], scale, qmin[a]);
+        boxmax[a] = dequantize_max(pmax[a], scale, qmax[a]);
+    }
+    return box3d(vec3(boxmin[0], boxmin[1], boxmin[2]), vec3(boxmax[0], boxmax[1], boxmax[2]));
+}
+
+bool compressed_bvh_intersect(const scene_shader_data& data, unsigned int data_texture_width, const triangle_set& triangles, const ray& r, float tmin, ray_hit& hit)
+{
+    box3d frames[compressed_bvh_max_depth + 1];
+    frames[0] = box3d(vec3(data.root_boxmin[0], data.root_boxmin[1], data.root_boxmin[2]),
+        vec3(data.root_boxmax[0], data.root_boxmax[1], data.root_boxmax[2]));
+
+    const float d[3] = {r.d.x, r.d.y, r.d.z};
+    int dircode = ((r.d.x > 0) ? 1 : 0) + ((r.d.y > 0) ? 2 : 0) + ((r.d.z > 0) ? 4 : 0);
+    const uint32_t *miss = data.group_miss + dircode * data_texture_width * data.group_data_rows;
+
+    bool found = false;
+    uint32_t g = data.tree_root;
+    while(g != compressed_bvh_stop_traversal) {
+        uint32_t texel = data.texel(g);
+        const uint32_t *node = data.group_nodes + texel * 4;
+        int depth = (node[1] >> 16) & 0xff;
+        box3d box = decode_compressed_bounds(node, frames[depth]);
+
+        float t0 = tmin;
+        float t1 = hit.t;
+        const float *o = &r.o.x;
+        for(int a = 0; a < 3; a++) {
+            float near = ((d[a] >= 0 ? (&box.boxmin.x)[a] : (&box.boxmax.x)[a]) - o[a]) / d[a];
+            float far = ((d[a] >= 0 ? (&box.boxmax.x)[a] : (&box.boxmin.x)[a]) - o[a]) / d[a];
+            t0 = std::max(t0, near);
+            t1 = std::min(t1, far);
+        }
+
+        if(t0 > t1) {
+            g = miss[texel];
+        } else if(node[1] & compressed_bvh_leaf) {
+            for(uint32_t i = 0; i < node[3]; i++) {
+                found |= triangle_intersect(triangles, node[2] + i, r, tmin, hit);
+            }
+            g = miss[texel];
+        } else {
+            assert(depth < compressed_bvh_max_depth);
+            frames[depth + 1] = box;
+            int axis = (node[1] >> 24) & 0x3;
+            g = (d[axis] > 0) ? node[2] : node[3];
+        }
+    }
+
+    return found;
+}
@@ -0,0 +1,55 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include "vectormath.h"
+#include "triangle-set.h"
+#include "wide-bvh.h"
+#include "world.h"
+
+// Compressed node records for the shader, one uint4 per node:
+//
+//   [0] box min x, y, z and box max x in 8 bits each
+//   [1] box max y, z in 8 bits each, depth in bits 16-23, split axis in
+//       bits 24-25, bit 26 set if a leaf
+//   [2] negative child, or first triangle if a leaf
+//   [3] positive child, or triangle count if a leaf
+//
+// The box is quantized relative to the parent's decoded box, rounded
+// outward so it always contains the node's triangles.  The root is
+// relative to the box in scene_shader_data::root_boxmin and root_boxmax.
+// The hit link is implied by the split axis, so only the eight miss
+// links are stored, one uint each in group_miss.
+
+// Deepest node a compressed tree can have; the shader keeps a decoded
+// box for each level.  Must match raytracer.es.fs.
+const int compressed_bvh_max_depth = 64;
+
+const uint32_t compressed_bvh_leaf = 0x4000000U;
+const uint32_t compressed_bvh_stop_traversal = 0xffffffffU;
+
+// Fills in the box, depth, and axis fields of "node"; returns the box
+// the shader will decode, which is what the children are relative to
+box3d encode_compressed_bounds(const box3d& box, const box3d& parent, int depth, int axis, uint32_t node[4]);
+
+// Same as decode_compressed_bounds in raytracer.es.fs
+box3d decode_compressed_bounds(const uint32_t node[4], const box3d& parent);
+
+// Closest hit through the compressed nodes and miss links the way the
+// shader traverses them
+bool compressed_bvh_intersect(const scene_shader_data& data, unsigned int data_texture_width, const triangle_set& triangles, const ray& r, float tmin, ray_hit& hit);
@@ -69,18 +69,15 @@ struct triangle
     ~triangle() {}
 };
 
+// Only the vertex indices stay resident; bounds and centroids are
+// computed by the BVH builders while they need them
 struct indexed_triangle
 {
     int i[3];
-    box3d box;
-    vec3 barycenter;
-    indexed_triangle(int i0, int i1, int i2,
-        const vertex& v0, const vertex& v1, const vertex& v2)
+    indexed_triangle(int i0, int i1, int i2)
     {
         i[0] = i0;
         i[1] = i1;
         i[2] = i2;
-        box.add(v0.v, v1.v, v2.v);
-        barycenter = (v0.v + v1.v + v2.v) / 3.0;
     }
 };
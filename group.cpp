@@ -14,35 +14,56 @@
    limitations under the License.
 */
 
+#include <cassert>
 #include "group.h"
 
-group::group(triangle_set_ptr triangles_, group *neg, group *pos, const vec3& direction, const box3d& box_) :
-    D(direction),
-    box(box_),
-    negative(neg),
-    positive(pos),
-    triangles(triangles_),
-    start(0),
-    count(0)
+void group::make_inner(int negative_, int positive_, int axis_, const box3d& box_)
 {
+    box = box_;
+    negative = negative_;
+    positive = positive_;
+    start = 0;
+    count = 0;
+    axis = axis_;
 }
 
-group::group(triangle_set_ptr triangles_, int start_, unsigned int count_) :
-    negative(nullptr),
-    positive(nullptr),
-    triangles(triangles_),
-    start(start_),
-    count(count_)
+void group::make_leaf(const triangle_set& triangles, int start_, unsigned int count_)
 {
-    for(unsigned int i = 0; i < count; i++) {
-        triangle t = triangles->get(start + i);
-        box.add(t.v[0], t.v[1], t.v[2]);
+    box3d box_;
+    for(unsigned int i = 0; i < count_; i++) {
+        const indexed_triangle& t = triangles.triangles[start_ + i];
+        box_.add(triangles.vertices[t.i[0]].v, triangles.vertices[t.i[1]].v, triangles.vertices[t.i[2]].v);
     }
+    make_leaf(start_, count_, box_);
+}
+
+void group::make_leaf(int start_, unsigned int count_, const box3d& box_)
+{
+    box = box_;
+    negative = -1;
+    positive = -1;
+    start = start_;
+    count = count_;
+    axis = 0;
 }
 
-group::~group()
+group_tree::group_tree(triangle_set_ptr triangles_, int capacity) :
+    triangles(triangles_),
+    groups(capacity),
+    root(0),
+    used(0)
 {
-    delete negative;
-    delete positive;
 }
 
+int group_tree::allocate(int count)
+{
+    int first = used.fetch_add(count);
+    assert(first + count <= (int)groups.size());
+    return first;
+}
+
+void group_tree::finish()
+{
+    groups.resize(used);
+    groups.shrink_to_fit();
+}
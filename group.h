@@ -16,26 +16,49 @@
 
 #pragma once 
 
+#include <atomic>
+#include <cstdint>
+#include <vector>
 #include "triangle-set.h"
 #include "geometry.h"
 
+// A node of a group_tree.  Children are indices into the tree's groups;
+// a leaf has no children and holds triangles [start, start + count).
 struct group
 {
-    vec3 D; /* split direction */
-
     box3d box;
 
-    group *negative, *positive;
-    group *dirhit[8], *dirmiss[8];
+    int32_t negative, positive; // -1 in a leaf
+    int32_t start;
+    uint32_t count;
+    int32_t axis; // split direction, 0 through 2 for X through Z
+
+    bool is_leaf() const { return negative < 0; }
+
+    void make_inner(int negative_, int positive_, int axis_, const box3d& box_);
+    void make_leaf(const triangle_set& triangles, int start_, unsigned int count_);
+    void make_leaf(int start_, unsigned int count_, const box3d& box_);
+};
 
+// All the nodes of one BVH in a single array
+struct group_tree
+{
     triangle_set_ptr triangles;
-    int start;
-    unsigned int count;
+    std::vector<group> groups;
+    int root;
 
-    group(triangle_set_ptr triangles_, group *neg, group *pos, const vec3& direction, const box3d& box_);
-    group(triangle_set_ptr triangles_, int start_, unsigned int count_);
-    ~group();
+    // Builders preallocate "capacity" groups and take them with
+    // allocate(), which is safe to call from any thread; finish()
+    // trims the unused ones
+    group_tree(triangle_set_ptr triangles_, int capacity);
 
-    int my_index;
-};
+    int allocate(int count);
+    void finish();
 
+    group& operator[](int i) { return groups[i]; }
+    const group& operator[](int i) const { return groups[i]; }
+    int size() const { return groups.size(); }
+
+private:
+    std::atomic<int> used;
+};
@@ -0,0 +1,136 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <cstdio>
+#include <cstring>
+#include "instance.h"
+
+instance::instance(int mesh_, const float matrix_[16], const box3d& mesh_box) :
+    mesh(mesh_)
+{
+    memcpy(matrix, matrix_, sizeof(matrix));
+    mat4_invert(matrix, inverse);
+
+    for(int i = 0; i < 8; i++) {
+        vec4 corner(
+            (i & 1) ? mesh_box.boxmax.x : mesh_box.boxmin.x,
+            (i & 2) ? mesh_box.boxmax.y : mesh_box.boxmin.y,
+            (i & 4) ? mesh_box.boxmax.z : mesh_box.boxmin.z,
+            1);
+        vec4 placed = matrix * corner;
+        box.add(vec3(placed.x, placed.y, placed.z));
+    }
+}
+
+ray transform_ray(const instance& inst, const ray& r)
+{
+    vec4 o = inst.inverse * vec4(r.o.x, r.o.y, r.o.z, 1);
+    vec4 d = inst.inverse * vec4(r.d.x, r.d.y, r.d.z, 0);
+    ray t;
+    t.o = vec3(o.x, o.y, o.z);
+    t.d = vec3(d.x, d.y, d.z);
+    return t;
+}
+
+namespace
+{
+
+float surface_area(const box3d& box)
+{
+    vec3 d = box.dim();
+    return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+float get_axis(const vec3& v, int axis)
+{
+    return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+// Every instance gets its own leaf, since testing one means traversing
+// its mesh's whole tree; splits are chosen by a full SAH sweep over the
+// instances sorted by center on each axis
+void build_instance_node(group_tree& tree, std::vector<instance>& instances, int g, int start, int count)
+{
+    box3d box;
+    for(int i = start; i < start + count; i++) {
+        box.add(instances[i].box);
+    }
+
+    if(count == 1) {
+        tree[g].make_leaf(start, 1, box);
+        return;
+    }
+
+    auto first = instances.begin() + start;
+    auto last = first + count;
+    std::vector<float> right_areas(count);
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = 0;
+    int best_split = count / 2;
+
+    for(int axis = 0; axis < 3; axis++) {
+        std::sort(first, last, [axis](const instance& a, const instance& b) {
+            return get_axis(a.box.center(), axis) < get_axis(b.box.center(), axis);
+        });
+
+        box3d right;
+        for(int i = count - 1; i > 0; i--) {
+            right.add(instances[start + i].box);
+            right_areas[i] = surface_area(right);
+        }
+
+        box3d left;
+        for(int i = 1; i < count; i++) {
+            left.add(instances[start + i - 1].box);
+            float cost = surface_area(left) * i + right_areas[i] * (count - i);
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i;
+            }
+        }
+    }
+
+    std::sort(first, last, [best_axis](const instance& a, const instance& b) {
+        return get_axis(a.box.center(), best_axis) < get_axis(b.box.center(), best_axis);
+    });
+
+    int children = tree.allocate(2);
+    tree[g].make_inner(children, children + 1, best_axis, box);
+    build_instance_node(tree, instances, children, start, best_split);
+    build_instance_node(tree, instances, children + 1, start + best_split, count - best_split);
+}
+
+}; // unnamed namespace for file scope
+
+group_tree *make_instance_bvh(std::vector<instance>& instances)
+{
+    auto then = std::chrono::system_clock::now();
+
+    int count = instances.size();
+    group_tree *tree = new group_tree(nullptr, std::max(1, 2 * count - 1));
+    tree->root = tree->allocate(1);
+    build_instance_node(*tree, instances, tree->root, 0, count);
+    tree->finish();
+
+    std::chrono::duration<float> elapsed = std::chrono::system_clock::now() - then;
+    fprintf(stderr, "instance BVH: %d instances, %f seconds\n", count, elapsed.count());
+
+    return tree;
+}
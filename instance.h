@@ -0,0 +1,41 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <vector>
+#include "vectormath.h"
+#include "group.h"
+
+// One placement of a shared mesh.  Matrices are column-major like the
+// rest of vectormath.h.
+struct instance
+{
+    int mesh; // index into world::meshes
+    float matrix[16]; // mesh space to scene space
+    float inverse[16]; // scene space to mesh space
+    box3d box; // the mesh's bounds in scene space
+
+    instance(int mesh_, const float matrix_[16], const box3d& mesh_box);
+};
+
+// Top level tree over "instances", which it reorders so each leaf holds
+// instances [start, start + count).  The tree's triangles are null.
+group_tree *make_instance_bvh(std::vector<instance>& instances);
+
+// "r" in the space of "inst"'s mesh; the direction isn't renormalized,
+// so distances along the ray are the same in both spaces
+ray transform_ray(const instance& inst, const ray& r);
@@ -0,0 +1,482 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Linear BVH after Lauterbach et al., "Fast BVH Construction on GPUs",
+// and the HLBVH refinement from Pantaleoni and Luebke, "HLBVH:
+// Hierarchical LBVH Construction for Real-Time Ray Tracing of Dynamic
+// Geometry", HPG 2010.
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include "bvh.h"
+#include "task-pool.h"
+
+namespace
+{
+
+// 30 packs 10 bits per axis into 32-bit codes, 63 packs 21 bits per
+// axis into 64-bit codes
+int lbvh_morton_bits = 63;
+
+// HLBVH builds the top of the tree with SAH over the clusters of
+// triangles sharing this many leading Morton code bits
+int hlbvh_cluster_bits = 15;
+
+void initialize_runtime_parameters() __attribute__((constructor));
+void initialize_runtime_parameters()
+{
+    if(getenv("LBVH_MORTON_BITS") != 0) {
+        lbvh_morton_bits = (atoi(getenv("LBVH_MORTON_BITS")) <= 30) ? 30 : 63;
+        fprintf(stderr, "LBVH Morton code bits set to %d\n", lbvh_morton_bits);
+    }
+    if(getenv("HLBVH_CLUSTER_BITS") != 0) {
+        hlbvh_cluster_bits = atoi(getenv("HLBVH_CLUSTER_BITS"));
+        fprintf(stderr, "HLBVH cluster bits set to %d\n", hlbvh_cluster_bits);
+        if(hlbvh_cluster_bits < 1 || hlbvh_cluster_bits > lbvh_morton_bits) {
+            hlbvh_cluster_bits = std::min(std::max(hlbvh_cluster_bits, 1), lbvh_morton_bits);
+            fprintf(stderr, "HLBVH cluster bits clamped to %d, between 1 and the Morton code bits\n", hlbvh_cluster_bits);
+        }
+    }
+}
+
+// Sort in chunks of this many items, one task per chunk
+const int sort_chunk_size = 65536;
+
+// Subtrees at least this large are built as separate tasks
+const int subtree_task_min = 4096;
+
+// Triangles in ranges the leaf cap split past the depth limit, for
+// the latest make_lbvh call
+std::atomic<int> forced_triangles(0);
+
+// Spread the low 10 bits of "v" so there are two zero bits between each
+uint32_t spread_bits_10(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Spread the low 21 bits of "v" so there are two zero bits between each
+uint64_t spread_bits_21(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x001f00000000ffffULL;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffULL;
+    v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+    v = (v | (v << 2)) & 0x1249249249249249ULL;
+    return v;
+}
+
+// X lands in the highest bit of each triple, then Y, then Z
+void morton_code(const vec3& p, uint32_t& code)
+{
+    code = (spread_bits_10(p.x * 1023) << 2) | (spread_bits_10(p.y * 1023) << 1) | spread_bits_10(p.z * 1023);
+}
+
+void morton_code(const vec3& p, uint64_t& code)
+{
+    const float scale = (1 << 21) - 1;
+    code = (spread_bits_21(p.x * scale) << 2) | (spread_bits_21(p.y * scale) << 1) | spread_bits_21(p.z * scale);
+}
+
+int code_bits(uint32_t) { return 30; }
+int code_bits(uint64_t) { return 63; }
+
+// Index of the highest set bit of a nonzero code
+int highest_bit(uint64_t v)
+{
+    return 63 - __builtin_clzll(v);
+}
+
+template <class Code>
+struct morton_item
+{
+    Code code;
+    int index;
+};
+
+// Stable LSD radix sort, 8 bits per pass, chunks histogrammed and
+// scattered in parallel.  Passes where every item has the same digit
+// are skipped.
+template <class Code>
+void radix_sort(task_pool& pool, std::vector<morton_item<Code>>& items)
+{
+    int count = items.size();
+    int chunk_count = (count + sort_chunk_size - 1) / sort_chunk_size;
+    std::vector<morton_item<Code>> sorted(count);
+    std::vector<int> histograms(chunk_count * 256);
+
+    for(int shift = 0; shift < code_bits(Code()); shift += 8) {
+
+        std::fill(histograms.begin(), histograms.end(), 0);
+        pool.parallel_for(0, count, sort_chunk_size, [&](int s, int e) {
+            int *h = &histograms[s / sort_chunk_size * 256];
+            for(int i = s; i < e; i++) {
+                h[(items[i].code >> shift) & 0xff]++;
+            }
+        });
+
+        // Turn counts into scatter offsets, digit-major then chunk order
+        int offset = 0;
+        int digits_used = 0;
+        for(int d = 0; d < 256; d++) {
+            int digit_count = 0;
+            for(int c = 0; c < chunk_count; c++) {
+                int n = histograms[c * 256 + d];
+                histograms[c * 256 + d] = offset;
+                offset += n;
+                digit_count += n;
+            }
+            if(digit_count > 0) {
+                digits_used++;
+            }
+        }
+        if(digits_used <= 1) {
+            continue;
+        }
+
+        pool.parallel_for(0, count, sort_chunk_size, [&](int s, int e) {
+            int *h = &histograms[s / sort_chunk_size * 256];
+            for(int i = s; i < e; i++) {
+                sorted[h[(items[i].code >> shift) & 0xff]++] = items[i];
+            }
+        });
+        items.swap(sorted);
+    }
+}
+
+template <class Code>
+struct lbvh_builder
+{
+    triangle_set_ptr triangles;
+    group_tree& tree;
+    task_pool& pool;
+    bvh_parameters params;
+    std::vector<Code> codes; // sorted, parallel to triangles from "start"
+    int start;
+
+    lbvh_builder(triangle_set_ptr triangles_, group_tree& tree_, task_pool& pool_) :
+        triangles(triangles_),
+        tree(tree_),
+        pool(pool_),
+        params(get_bvh_parameters())
+    {}
+
+    // Fill in group "g" over sorted items [first, last), splitting where
+    // the highest bit below "bit" first differs, or in half once "forced"
+    void build(int g, int first, int last, int bit, int level, bool forced)
+    {
+        int count = last - first;
+
+        bool over_cap = params.leaf_cap > 0 && count > (int)params.leaf_cap;
+        if((count <= (int)params.leaf_max || level >= params.max_depth) && !over_cap) {
+            tree[g].make_leaf(*triangles, start + first, count);
+            return;
+        }
+
+        // Past the depth limit only the leaf cap keeps splitting
+        if(level >= params.max_depth && !forced) {
+            forced_triangles += count;
+            forced = true;
+        }
+
+        int split;
+        int axis;
+        Code differing = (codes[first] ^ codes[last - 1]) & ((Code(1) << (bit + 1)) - 1);
+
+        if(forced) {
+
+            // Split in half whatever the codes say, so the levels past
+            // the limit grow with log2 of the range, not the code bits
+            split = first + count / 2;
+            axis = (differing == 0) ? 0 : 2 - (highest_bit(differing) % 3);
+
+        } else if(differing == 0) {
+
+            // All codes identical from "bit" down; split the range in half
+            split = first + count / 2;
+            axis = 0;
+            bit = -1;
+
+        } else {
+
+            bit = highest_bit(differing);
+            Code bit_mask = Code(1) << bit;
+
+            // First item with "bit" set; codes are sorted so it's a
+            // binary search
+            int lo = first;
+            int hi = last - 1;
+            while(lo < hi) {
+                int mid = (lo + hi) / 2;
+                if(codes[mid] & bit_mask) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            split = lo;
+            axis = 2 - (bit % 3);
+            bit--;
+        }
+
+        int g1 = tree.allocate(2);
+        int g2 = g1 + 1;
+        if(split - first >= subtree_task_min) {
+            task_group children;
+            pool.spawn(children, [&]{ build(g1, first, split, bit, level + 1, forced); });
+            build(g2, split, last, bit, level + 1, forced);
+            pool.wait(children);
+        } else {
+            build(g1, first, split, bit, level + 1, forced);
+            build(g2, split, last, bit, level + 1, forced);
+        }
+
+        box3d box(tree[g1].box);
+        box.add(tree[g2].box);
+        tree[g].make_inner(g1, g2, axis, box);
+    }
+};
+
+struct cluster
+{
+    int first, last; // sorted items
+    box3d box;
+    vec3 center;
+    int count;
+};
+
+float get_axis(const vec3& v, int axis)
+{
+    return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+float surface_area(const box3d& box)
+{
+    vec3 d = box.dim();
+    return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+// Binned SAH over whole clusters.  Every cluster ends up as a leaf of
+// this upper tree, so a range always splits, falling back to halves
+// when the centers can't be separated or the range is past the depth
+// limit.  Each cluster's own LBVH, from the code bits below "bit", is
+// built where it lands, so the depth limit counts the levels above it.
+template <class Code>
+void build_cluster_tree(lbvh_builder<Code>& builder, std::vector<cluster>& clusters, int g, int first, int last, int bit, int level)
+{
+    if(last - first == 1) {
+        builder.build(g, clusters[first].first, clusters[first].last, bit, level, false);
+        return;
+    }
+
+    box3d box;
+    box3d centerbox;
+    for(int i = first; i < last; i++) {
+        box.add(clusters[i].box);
+        centerbox.add(clusters[i].center);
+    }
+
+    const int bin_count = 16;
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    float best_plane = 0;
+
+    bool past_max_depth = level >= builder.params.max_depth;
+    for(int axis = 0; axis < 3 && !past_max_depth; axis++) {
+        float start = get_axis(centerbox.boxmin, axis);
+        float stop = get_axis(centerbox.boxmax, axis);
+        if(stop <= start) {
+            continue;
+        }
+
+        box3d bins[bin_count];
+        int counts[bin_count] = {0};
+        for(int i = first; i < last; i++) {
+            int bin = floor((get_axis(clusters[i].center, axis) - start) * bin_count / (stop - start));
+            bin = std::min(bin_count - 1, std::max(0, bin));
+            bins[bin].add(clusters[i].box);
+            counts[bin] += clusters[i].count;
+        }
+
+        for(int b = 1; b < bin_count; b++) {
+            box3d left, right;
+            int lcount = 0, rcount = 0;
+            for(int i = 0; i < b; i++) {
+                left.add(bins[i]);
+                lcount += counts[i];
+            }
+            for(int i = b; i < bin_count; i++) {
+                right.add(bins[i]);
+                rcount += counts[i];
+            }
+            if(lcount == 0 || rcount == 0) {
+                continue;
+            }
+            float cost = surface_area(left) * lcount + surface_area(right) * rcount;
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_plane = start + b * (stop - start) / bin_count;
+            }
+        }
+    }
+
+    int split = first;
+    if(best_axis >= 0) {
+        auto middle = std::stable_partition(clusters.begin() + first, clusters.begin() + last,
+            [&](const cluster& c) { return get_axis(c.center, best_axis) < best_plane; });
+        split = middle - clusters.begin();
+    }
+    if(split == first || split == last) {
+        split = first + (last - first) / 2;
+        best_axis = std::max(0, best_axis);
+    }
+
+    int split_count = 0;
+    for(int i = first; i < split; i++) {
+        split_count += clusters[i].count;
+    }
+
+    int g1 = builder.tree.allocate(2);
+    int g2 = g1 + 1;
+    if(split_count >= subtree_task_min) {
+        task_group children;
+        builder.pool.spawn(children, [&]{ build_cluster_tree(builder, clusters, g1, first, split, bit, level + 1); });
+        build_cluster_tree(builder, clusters, g2, split, last, bit, level + 1);
+        builder.pool.wait(children);
+    } else {
+        build_cluster_tree(builder, clusters, g1, first, split, bit, level + 1);
+        build_cluster_tree(builder, clusters, g2, split, last, bit, level + 1);
+    }
+    builder.tree[g].make_inner(g1, g2, best_axis, box);
+}
+
+template <class Code>
+void build_lbvh(group_tree& tree, int start, unsigned int count, task_pool& pool, bool sah_top_levels)
+{
+    triangle_set_ptr triangles = tree.triangles;
+    std::vector<indexed_triangle>& tris = triangles->triangles;
+
+    // Morton codes are relative to the barycenter bounds
+    int chunk_count = (count + sort_chunk_size - 1) / sort_chunk_size;
+    std::vector<box3d> chunk_boxes(chunk_count);
+    std::vector<vec3> barycenters(count);
+    pool.parallel_for(0, count, sort_chunk_size, [&](int s, int e) {
+        for(int i = s; i < e; i++) {
+            barycenters[i] = triangles->barycenter(start + i);
+            chunk_boxes[s / sort_chunk_size].add(barycenters[i]);
+        }
+    });
+    box3d centerbox;
+    for(auto& b : chunk_boxes) {
+        centerbox.add(b);
+    }
+    vec3 extent = max(centerbox.dim(), vec3(std::numeric_limits<float>::min()));
+
+    std::vector<morton_item<Code>> items(count);
+    pool.parallel_for(0, count, sort_chunk_size, [&](int s, int e) {
+        for(int i = s; i < e; i++) {
+            vec3 p = (barycenters[i] - centerbox.boxmin) * vec3(1 / extent.x, 1 / extent.y, 1 / extent.z);
+            p = min(vec3(1), max(vec3(0), p));
+            morton_code(p, items[i].code);
+            items[i].index = start + i;
+        }
+    });
+    std::vector<vec3>().swap(barycenters);
+
+    radix_sort(pool, items);
+
+    lbvh_builder<Code> builder(triangles, tree, pool);
+    builder.start = start;
+    builder.codes.resize(count);
+    std::vector<indexed_triangle> sorted(tris.begin() + start, tris.begin() + start + count);
+    pool.parallel_for(0, count, sort_chunk_size, [&](int s, int e) {
+        for(int i = s; i < e; i++) {
+            builder.codes[i] = items[i].code;
+            sorted[i] = tris[items[i].index];
+        }
+    });
+    std::copy(sorted.begin(), sorted.end(), tris.begin() + start);
+
+    int top_bit = code_bits(Code()) - 1;
+
+    if(!sah_top_levels) {
+        tree.root = tree.allocate(1);
+        builder.build(tree.root, 0, count, top_bit, 0, false);
+        return;
+    }
+
+    // Clusters are runs of codes sharing their leading bits; each gets
+    // an LBVH from the bits below, then SAH joins them
+    int cluster_shift = std::max(0, code_bits(Code()) - hlbvh_cluster_bits);
+    std::vector<int> cluster_starts;
+    for(unsigned int i = 0; i < count; i++) {
+        if(i == 0 || (builder.codes[i] >> cluster_shift) != (builder.codes[i - 1] >> cluster_shift)) {
+            cluster_starts.push_back(i);
+        }
+    }
+    cluster_starts.push_back(count);
+
+    std::vector<cluster> clusters(cluster_starts.size() - 1);
+    pool.parallel_for(0, clusters.size(), 64, [&](int s, int e) {
+        for(int c = s; c < e; c++) {
+            cluster& cl = clusters[c];
+            cl.first = cluster_starts[c];
+            cl.last = cluster_starts[c + 1];
+            for(int i = cl.first; i < cl.last; i++) {
+                cl.box.add(triangles->bounds(start + i));
+            }
+            cl.center = cl.box.center();
+            cl.count = cl.last - cl.first;
+        }
+    });
+
+    fprintf(stderr, "HLBVH: %zd clusters\n", clusters.size());
+
+    tree.root = tree.allocate(1);
+    build_cluster_tree(builder, clusters, tree.root, 0, clusters.size(), cluster_shift - 1, 0);
+}
+
+}; // unnamed namespace for file scope
+
+group_tree* make_lbvh(triangle_set_ptr triangles, int start, unsigned int count, task_pool& pool, bool sah_top_levels)
+{
+    // At most 2n - 1 groups over n triangles, cluster roots included
+    group_tree *tree = new group_tree(triangles, std::max(1, 2 * (int)count));
+    forced_triangles = 0;
+    if(lbvh_morton_bits == 30) {
+        build_lbvh<uint32_t>(*tree, start, count, pool, sah_top_levels);
+    } else {
+        build_lbvh<uint64_t>(*tree, start, count, pool, sah_top_levels);
+    }
+    tree->finish();
+    if(forced_triangles > 0) {
+        fprintf(stderr, "LBVH: %d triangles past the depth limit split to the leaf cap of %u\n", forced_triangles.load(), get_bvh_parameters().leaf_cap);
+    }
+    return tree;
+}
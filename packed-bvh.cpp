@@ -0,0 +1,102 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include "packed-bvh.h"
+
+namespace
+{
+
+uint32_t float_bits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+float bits_float(uint32_t u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+}; // unnamed namespace for file scope
+
+void encode_packed_bounds(const box3d& box, uint32_t lower[4], uint32_t upper[4])
+{
+    lower[0] = float_bits(box.boxmin.x);
+    lower[1] = float_bits(box.boxmin.y);
+    lower[2] = float_bits(box.boxmin.z);
+    upper[0] = float_bits(box.boxmax.x);
+    upper[1] = float_bits(box.boxmax.y);
+    upper[2] = float_bits(box.boxmax.z);
+}
+
+void encode_packed_node(const group& g, uint32_t base, uint32_t lower[4], uint32_t upper[4])
+{
+    encode_packed_bounds(g.box, lower, upper);
+    if(g.is_leaf()) {
+        lower[3] = g.start;
+        upper[3] = g.count | packed_bvh_leaf;
+    } else {
+        lower[3] = base + g.negative;
+        upper[3] = (base + g.positive) | (g.axis << 29);
+    }
+}
+
+bool packed_bvh_intersect(const scene_shader_data& data, const triangle_set& triangles, const ray& r, float tmin, ray_hit& hit)
+{
+    const float d[3] = {r.d.x, r.d.y, r.d.z};
+    const float o[3] = {r.o.x, r.o.y, r.o.z};
+    int dircode = ((r.d.x > 0) ? 1 : 0) + ((r.d.y > 0) ? 2 : 0) + ((r.d.z > 0) ? 4 : 0);
+
+    bool found = false;
+    uint32_t g = data.tree_root;
+    while(g != packed_bvh_stop_traversal) {
+        uint32_t first = g * packed_bvh_texels_per_node;
+        const uint32_t *lower = data.group_records + data.texel(first + 0) * 4;
+        const uint32_t *upper = data.group_records + data.texel(first + 1) * 4;
+        uint32_t miss = data.group_records[data.texel(first + 2 + dircode / 4) * 4 + dircode % 4];
+
+        float t0 = tmin;
+        float t1 = hit.t;
+        for(int a = 0; a < 3; a++) {
+            float lo = bits_float(lower[a]);
+            float hi = bits_float(upper[a]);
+            float near = ((d[a] >= 0 ? lo : hi) - o[a]) / d[a];
+            float far = ((d[a] >= 0 ? hi : lo) - o[a]) / d[a];
+            t0 = std::max(t0, near);
+            t1 = std::min(t1, far);
+        }
+
+        if(t0 > t1) {
+            g = miss;
+        } else if(upper[3] & packed_bvh_leaf) {
+            uint32_t count = upper[3] & packed_bvh_link_mask;
+            for(uint32_t i = 0; i < count; i++) {
+                found |= triangle_intersect(triangles, lower[3] + i, r, tmin, hit);
+            }
+            g = miss;
+        } else {
+            int axis = (upper[3] >> 29) & 0x3;
+            g = (d[axis] > 0) ? lower[3] : (upper[3] & packed_bvh_link_mask);
+        }
+    }
+
+    return found;
+}
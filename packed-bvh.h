@@ -0,0 +1,62 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include "vectormath.h"
+#include "triangle-set.h"
+#include "group.h"
+#include "wide-bvh.h"
+#include "world.h"
+
+// Packed node records for the shader, four uint4 texels per node in
+// one RGBA32UI texture, so a node never straddles a row:
+//
+//   texel 0: box min x, y, z as float bits; negative child, or first
+//            triangle if a leaf
+//   texel 1: box max x, y, z as float bits; positive child with the
+//            split axis in bits 29-30, or triangle count with bit 31
+//            set if a leaf
+//   texels 2 and 3: miss links for the eight ray direction codes, in
+//            the order of get_coded_dir in world.cpp
+//
+// Traversal fetches texels 0 and 1 for every node, and the miss texel
+// for its direction only when it leaves a node.  The hit link is
+// implied by the split axis.  Links and triangle indices are integers,
+// so neither is limited to the 2^24 a float holds exactly.  With
+// BVH_TILED_TEXELS set the four texels are a 2x2 block instead of a
+// run along a row; see get_data_texel in world.h.
+
+const int packed_bvh_texels_per_node = 4;
+
+const uint32_t packed_bvh_leaf = 0x80000000U;
+const uint32_t packed_bvh_link_mask = 0x1fffffffU;
+const uint32_t packed_bvh_stop_traversal = 0xffffffffU;
+
+// Most nodes a packed tree can index
+const uint32_t packed_bvh_max_nodes = packed_bvh_link_mask;
+
+// Fills in texels 0 and 1, "lower" and "upper", for "g", whose children
+// are at "base" plus their index in the tree
+void encode_packed_node(const group& g, uint32_t base, uint32_t lower[4], uint32_t upper[4]);
+
+// Replaces just the bounds in texels 0 and 1, for refitting
+void encode_packed_bounds(const box3d& box, uint32_t lower[4], uint32_t upper[4]);
+
+// Closest hit through the packed records the way the shader traverses
+// them
+bool packed_bvh_intersect(const scene_shader_data& data, const triangle_set& triangles, const ray& r, float tmin, ray_hit& hit);
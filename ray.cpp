@@ -14,6 +14,7 @@
    limitations under the License.
 */
 
+#include <algorithm>
 #include <chrono>
 #include <string>
 #include <vector>
@@ -31,6 +32,9 @@
 #include <GLFW/glfw3.h>
 
 #include "world.h"
+#include "scene-image.h"
+#include "packed-bvh.h"
+#include "bvh.h"
 
 bool redraw_window = false;
 bool stream_frames = false;
@@ -285,12 +289,31 @@ struct raytracer_gl_binding
     GLuint group_boxmax_texture;
     GLint group_data_rows_uniform;
 
+    GLint group_nodes_uniform;
+    GLint group_miss_uniform;
+    GLuint group_nodes_texture;
+    GLuint group_miss_texture;
+    GLint root_boxmin_uniform;
+    GLint root_boxmax_uniform;
+
+    GLint group_records_uniform;
+    GLuint group_records_texture;
+
+    GLint group_children_uniform;
+    GLint group_links_uniform;
+    GLuint group_children_texture;
+    GLuint group_links_texture;
+
+    GLint instance_data_uniform;
+    GLuint instance_data_texture;
+    GLint instance_data_rows_uniform;
+
     GLint vertex_positions_uniform;
-    GLint vertex_colors_uniform;
     GLint vertex_normals_uniform;
+    GLint triangle_records_uniform;
     GLuint vertex_positions_texture;
-    GLuint vertex_colors_texture;
     GLuint vertex_normals_texture;
+    GLuint triangle_records_texture;
     GLint vertex_data_rows_uniform;
 
     GLint background_texture_uniform;
@@ -343,17 +366,55 @@ struct float2Dimage
 float2Dimage *background_image;
 float2Dimage *background_convolved;
 
+// Data textures are arrays of layers if scene_data is paged, see
+// scene_shader_data::paged_rows
+GLenum data_texture_target()
+{
+    return (scene_data.data_page_rows != 0) ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+}
+
 int new_data_texture()
 {
     GLuint tex;
     glGenTextures(1, &tex);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(data_texture_target(), tex);
+    glTexParameteri(data_texture_target(), GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(data_texture_target(), GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     check_opengl(__FILE__, __LINE__);
     return tex;
 }
 
+// Fill the bound data texture with "rows" rows of "pixels"
+void upload_data_texture(GLint internal_format, unsigned int rows, GLenum format, GLenum type, const void *pixels)
+{
+    if(scene_data.data_page_rows == 0) {
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, data_texture_width, rows, 0, format, type, pixels);
+        return;
+    }
+
+    unsigned int layer_rows = std::min(rows, scene_data.data_page_rows);
+    unsigned int layers = scene_data.paged_rows(rows) / layer_rows;
+    GLint max_layers;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+    if(layers > (unsigned int)max_layers) {
+        fprintf(stderr, "data texture needs %u layers of %u rows but only %d layers are supported\n", layers, layer_rows, max_layers);
+        exit(EXIT_FAILURE);
+    }
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internal_format, data_texture_width, layer_rows, layers, 0, format, type, pixels);
+}
+
+// Replace the contents of the bound data texture
+void update_data_texture(unsigned int rows, GLenum format, GLenum type, const void *pixels)
+{
+    if(scene_data.data_page_rows == 0) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, data_texture_width, rows, format, type, pixels);
+        return;
+    }
+
+    unsigned int layer_rows = std::min(rows, scene_data.data_page_rows);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, data_texture_width, layer_rows, scene_data.paged_rows(rows) / layer_rows, format, type, pixels);
+}
+
 void load_scene_data(world_ptr w, raytracer_gl_binding &binding)
 {
     const char *filename;
@@ -379,7 +440,40 @@ void load_scene_data(world_ptr w, raytracer_gl_binding &binding)
     gRayTracingVertexShaderText = load_text(fp);
     fclose(fp);
 
-    get_shader_data(w, scene_data, data_texture_width);
+    // Taller data textures are split into layers
+    GLint max_texture_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+    if(scene_data.image == nullptr) {
+
+        get_shader_data(w, scene_data, data_texture_width, max_texture_size);
+
+        if(getenv("BVH_REPORT") != nullptr) {
+            write_bvh_report(w, scene_data, data_texture_width, getenv("BVH_REPORT"));
+        }
+
+    } else {
+
+        // A scene image was laid out when it was baked, so it has to fit as is
+        if(scene_data.data_texture_width != data_texture_width) {
+            fprintf(stderr, "scene image has data textures %u wide, not %u\n", scene_data.data_texture_width, data_texture_width);
+            exit(EXIT_FAILURE);
+        }
+        unsigned int tallest = std::max(scene_data.vertex_data_rows, (unsigned int)scene_data.instance_data_rows);
+        if(scene_data.group_hitmiss != nullptr || scene_data.group_miss != nullptr) {
+            tallest = std::max(tallest, (unsigned int)scene_data.group_data_rows * 8);
+        } else if(scene_data.packed_nodes) {
+            tallest = std::max(tallest, (unsigned int)scene_data.group_data_rows * packed_bvh_texels_per_node);
+        } else {
+            tallest = std::max(tallest, (unsigned int)scene_data.group_data_rows);
+        }
+        if(scene_data.data_page_rows != 0) {
+            tallest = std::min(tallest, scene_data.data_page_rows);
+        }
+        if(tallest > (unsigned int)max_texture_size) {
+            fprintf(stderr, "scene image has data textures %u rows tall but the GPU allows only %d; bake it again with BVH_TEXTURE_PAGE_ROWS=%d\n", tallest, max_texture_size, max_texture_size);
+            exit(EXIT_FAILURE);
+        }
+    }
 
 #if 0
     if(true) {
@@ -399,7 +493,25 @@ void load_scene_data(world_ptr w, raytracer_gl_binding &binding)
     char preamble[512];
     char *strings[3];
     sprintf(version, "#version 140\n");
-    sprintf(preamble, "const int data_texture_width = %u;\n", data_texture_width);
+    const char *node_format = "";
+    if(scene_data.compressed_nodes) {
+        node_format = "#define COMPRESSED_NODES\n";
+    } else if(scene_data.packed_nodes) {
+        node_format = "#define PACKED_NODES\n";
+    } else if(scene_data.stackless_nodes) {
+        node_format = "#define STACKLESS_NODES\n";
+    } else if(scene_data.closest_first) {
+        node_format = "#define CLOSEST_FIRST\n";
+    }
+    char paging[128] = "";
+    if(scene_data.data_page_rows != 0) {
+        sprintf(paging, "const int data_page_rows = %u;\n#define PAGED_TEXTURES\n", scene_data.data_page_rows);
+    }
+    sprintf(preamble, "const int data_texture_width = %u;\n%s%s%s%s%s%s", data_texture_width, paging, node_format,
+        scene_data.tiled_texels ? "#define TILED_TEXELS\n" : "",
+        scene_data.precomputed_triangles ? "#define TRIANGLE_RECORDS\n" : "",
+        scene_data.compact_vertices ? "#define COMPACT_VERTICES\n" : "",
+        (scene_data.instance_count > 0) ? "#define INSTANCES\n" : "");
 
     strings[0] = version;
     strings[1] = preamble;
@@ -443,7 +555,7 @@ void load_scene_data(world_ptr w, raytracer_gl_binding &binding)
     raytracer_gl.vertex_data_rows_uniform = glGetUniformLocation(raytracer_gl.program, "vertex_data_rows");
     raytracer_gl.vertex_positions_uniform = glGetUniformLocation(raytracer_gl.program, "vertex_positions");
     raytracer_gl.vertex_normals_uniform = glGetUniformLocation(raytracer_gl.program, "vertex_normals");
-    raytracer_gl.vertex_colors_uniform = glGetUniformLocation(raytracer_gl.program, "vertex_colors");
+    raytracer_gl.triangle_records_uniform = glGetUniformLocation(raytracer_gl.program, "triangle_records");
 
     raytracer_gl.group_data_rows_uniform = glGetUniformLocation(raytracer_gl.program, "group_data_rows");
     raytracer_gl.group_objects_uniform = glGetUniformLocation(raytracer_gl.program, "group_objects");
@@ -451,6 +563,15 @@ void load_scene_data(world_ptr w, raytracer_gl_binding &binding)
     raytracer_gl.group_directions_uniform = glGetUniformLocation(raytracer_gl.program, "group_directions");
     raytracer_gl.group_boxmin_uniform = glGetUniformLocation(raytracer_gl.program, "group_boxmin");
     raytracer_gl.group_boxmax_uniform = glGetUniformLocation(raytracer_gl.program, "group_boxmax");
+    raytracer_gl.group_nodes_uniform = glGetUniformLocation(raytracer_gl.program, "group_nodes");
+    raytracer_gl.group_miss_uniform = glGetUniformLocation(raytracer_gl.program, "group_miss");
+    raytracer_gl.root_boxmin_uniform = glGetUniformLocation(raytracer_gl.program, "root_boxmin");
+    raytracer_gl.root_boxmax_uniform = glGetUniformLocation(raytracer_gl.program, "root_boxmax");
+    raytracer_gl.group_records_uniform = glGetUniformLocation(raytracer_gl.program, "group_records");
+    raytracer_gl.group_children_uniform = glGetUniformLocation(raytracer_gl.program, "group_children");
+    raytracer_gl.group_links_uniform = glGetUniformLocation(raytracer_gl.program, "group_links");
+    raytracer_gl.instance_data_uniform = glGetUniformLocation(raytracer_gl.program, "instance_data");
+    raytracer_gl.instance_data_rows_uniform = glGetUniformLocation(raytracer_gl.program, "instance_data_rows");
     raytracer_gl.background_texture_uniform = glGetUniformLocation(raytracer_gl.program, "background");
 
     raytracer_gl.which_uniform = glGetUniformLocation(raytracer_gl.program, "which");
@@ -467,34 +588,86 @@ void load_scene_data(world_ptr w, raytracer_gl_binding &binding)
     raytracer_gl.up_uniform = glGetUniformLocation(raytracer_gl.program, "up");
     check_opengl(__FILE__, __LINE__);
 
-    raytracer_gl.vertex_positions_texture = new_data_texture();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, data_texture_width, scene_data.vertex_data_rows, 0, GL_RGB, GL_FLOAT, scene_data.vertex_positions);
+    if(scene_data.precomputed_triangles) {
+        raytracer_gl.triangle_records_texture = new_data_texture();
+        upload_data_texture(GL_RGBA32F, scene_data.vertex_data_rows, GL_RGBA, GL_FLOAT, scene_data.triangle_records);
+    } else if(scene_data.compact_vertices) {
+        raytracer_gl.vertex_positions_texture = new_data_texture();
+        upload_data_texture(GL_RGB16UI, scene_data.vertex_data_rows, GL_RGB_INTEGER, GL_UNSIGNED_SHORT, scene_data.compact_positions);
+    } else {
+        raytracer_gl.vertex_positions_texture = new_data_texture();
+        upload_data_texture(GL_RGB32F, scene_data.vertex_data_rows, GL_RGB, GL_FLOAT, scene_data.vertex_positions);
+    }
 
     raytracer_gl.vertex_normals_texture = new_data_texture();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, data_texture_width, scene_data.vertex_data_rows, 0, GL_RGB, GL_FLOAT, scene_data.vertex_normals);
+    if(scene_data.compact_vertices) {
+        upload_data_texture(GL_R32UI, scene_data.vertex_data_rows, GL_RED_INTEGER, GL_UNSIGNED_INT, scene_data.compact_normals);
+    } else {
+        upload_data_texture(GL_RGB16F, scene_data.vertex_data_rows, GL_RGB, GL_FLOAT, scene_data.vertex_normals);
+    }
 
-    raytracer_gl.vertex_colors_texture = new_data_texture();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, data_texture_width, scene_data.vertex_data_rows, 0, GL_RGB, GL_FLOAT, scene_data.vertex_colors);
+    // Vertex colors aren't uploaded, since the shader doesn't read them
 
-    raytracer_gl.group_objects_texture = new_data_texture();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, data_texture_width, scene_data.group_data_rows, 0, GL_RG, GL_FLOAT, scene_data.group_objects);
-    check_opengl(__FILE__, __LINE__);
+    if(scene_data.compressed_nodes) {
 
-    raytracer_gl.group_hitmiss_texture = new_data_texture();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, data_texture_width, scene_data.group_data_rows * 8, 0, GL_RG, GL_FLOAT, scene_data.group_hitmiss);
-    check_opengl(__FILE__, __LINE__);
+        raytracer_gl.group_nodes_texture = new_data_texture();
+        upload_data_texture(GL_RGBA32UI, scene_data.group_data_rows, GL_RGBA_INTEGER, GL_UNSIGNED_INT, scene_data.group_nodes);
+        check_opengl(__FILE__, __LINE__);
 
-    raytracer_gl.group_directions_texture = new_data_texture();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, data_texture_width, scene_data.group_data_rows, 0, GL_RGB, GL_FLOAT, scene_data.group_directions);
-    check_opengl(__FILE__, __LINE__);
+        raytracer_gl.group_miss_texture = new_data_texture();
+        upload_data_texture(GL_R32UI, scene_data.group_data_rows * 8, GL_RED_INTEGER, GL_UNSIGNED_INT, scene_data.group_miss);
+        check_opengl(__FILE__, __LINE__);
 
-    raytracer_gl.group_boxmin_texture = new_data_texture();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, data_texture_width, scene_data.group_data_rows, 0, GL_RGB, GL_FLOAT, scene_data.group_boxmin);
-    check_opengl(__FILE__, __LINE__);
+    } else if(scene_data.packed_nodes) {
 
-    raytracer_gl.group_boxmax_texture = new_data_texture();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, data_texture_width, scene_data.group_data_rows, 0, GL_RGB, GL_FLOAT, scene_data.group_boxmax);
-    check_opengl(__FILE__, __LINE__);
+        raytracer_gl.group_records_texture = new_data_texture();
+        upload_data_texture(GL_RGBA32UI, scene_data.group_data_rows * packed_bvh_texels_per_node, GL_RGBA_INTEGER, GL_UNSIGNED_INT, scene_data.group_records);
+        check_opengl(__FILE__, __LINE__);
+
+    } else {
+
+        raytracer_gl.group_objects_texture = new_data_texture();
+        upload_data_texture(GL_RG32F, scene_data.group_data_rows, GL_RG, GL_FLOAT, scene_data.group_objects);
+        check_opengl(__FILE__, __LINE__);
+
+        if(scene_data.stackless_nodes || scene_data.closest_first) {
+
+            raytracer_gl.group_children_texture = new_data_texture();
+            upload_data_texture(GL_RG32F, scene_data.group_data_rows, GL_RG, GL_FLOAT, scene_data.group_children);
+            check_opengl(__FILE__, __LINE__);
+        }
+
+        if(scene_data.stackless_nodes) {
+
+            raytracer_gl.group_links_texture = new_data_texture();
+            upload_data_texture(GL_RG32F, scene_data.group_data_rows, GL_RG, GL_FLOAT, scene_data.group_links);
+            check_opengl(__FILE__, __LINE__);
+
+        } else if(!scene_data.closest_first) {
+
+            raytracer_gl.group_hitmiss_texture = new_data_texture();
+            upload_data_texture(GL_RG32F, scene_data.group_data_rows * 8, GL_RG, GL_FLOAT, scene_data.group_hitmiss);
+            check_opengl(__FILE__, __LINE__);
+        }
+
+        raytracer_gl.group_directions_texture = new_data_texture();
+        upload_data_texture(GL_RGB, scene_data.group_data_rows, GL_RGB, GL_FLOAT, scene_data.group_directions);
+        check_opengl(__FILE__, __LINE__);
+
+        raytracer_gl.group_boxmin_texture = new_data_texture();
+        upload_data_texture(GL_RGB32F, scene_data.group_data_rows, GL_RGB, GL_FLOAT, scene_data.group_boxmin);
+        check_opengl(__FILE__, __LINE__);
+
+        raytracer_gl.group_boxmax_texture = new_data_texture();
+        upload_data_texture(GL_RGB32F, scene_data.group_data_rows, GL_RGB, GL_FLOAT, scene_data.group_boxmax);
+        check_opengl(__FILE__, __LINE__);
+    }
+
+    if(scene_data.instance_count > 0) {
+        raytracer_gl.instance_data_texture = new_data_texture();
+        upload_data_texture(GL_RGBA32F, scene_data.instance_data_rows, GL_RGBA, GL_FLOAT, scene_data.instance_data);
+        check_opengl(__FILE__, __LINE__);
+    }
 
     glGenTextures(1, &raytracer_gl.background_texture);
     glBindTexture(GL_TEXTURE_2D, raytracer_gl.background_texture);
@@ -512,6 +685,69 @@ void load_scene_data(world_ptr w, raytracer_gl_binding &binding)
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+// After update_shader_data_bounds, replace the contents of the textures
+// it changed; their sizes and formats are the same
+void upload_refit_scene_data()
+{
+    if(scene_data.precomputed_triangles) {
+        glBindTexture(data_texture_target(), raytracer_gl.triangle_records_texture);
+        update_data_texture(scene_data.vertex_data_rows, GL_RGBA, GL_FLOAT, scene_data.triangle_records);
+    } else if(scene_data.compact_vertices) {
+        glBindTexture(data_texture_target(), raytracer_gl.vertex_positions_texture);
+        update_data_texture(scene_data.vertex_data_rows, GL_RGB_INTEGER, GL_UNSIGNED_SHORT, scene_data.compact_positions);
+    } else {
+        glBindTexture(data_texture_target(), raytracer_gl.vertex_positions_texture);
+        update_data_texture(scene_data.vertex_data_rows, GL_RGB, GL_FLOAT, scene_data.vertex_positions);
+    }
+    check_opengl(__FILE__, __LINE__);
+
+    if(scene_data.compressed_nodes) {
+
+        glBindTexture(data_texture_target(), raytracer_gl.group_nodes_texture);
+        update_data_texture(scene_data.group_data_rows, GL_RGBA_INTEGER, GL_UNSIGNED_INT, scene_data.group_nodes);
+        check_opengl(__FILE__, __LINE__);
+
+    } else if(scene_data.packed_nodes) {
+
+        glBindTexture(data_texture_target(), raytracer_gl.group_records_texture);
+        update_data_texture(scene_data.group_data_rows * packed_bvh_texels_per_node, GL_RGBA_INTEGER, GL_UNSIGNED_INT, scene_data.group_records);
+        check_opengl(__FILE__, __LINE__);
+
+    } else {
+
+        glBindTexture(data_texture_target(), raytracer_gl.group_boxmin_texture);
+        update_data_texture(scene_data.group_data_rows, GL_RGB, GL_FLOAT, scene_data.group_boxmin);
+        check_opengl(__FILE__, __LINE__);
+
+        glBindTexture(data_texture_target(), raytracer_gl.group_boxmax_texture);
+        update_data_texture(scene_data.group_data_rows, GL_RGB, GL_FLOAT, scene_data.group_boxmax);
+        check_opengl(__FILE__, __LINE__);
+    }
+
+    glBindTexture(data_texture_target(), 0);
+}
+
+vertex_cache animation;
+int animation_frame = 0;
+
+// Move the scene to the next frame of the vertex cache
+void advance_animation()
+{
+    std::vector<vec3> positions;
+    if(!animation.read_frame(animation_frame, positions)) {
+        fclose(animation.fp);
+        animation.fp = nullptr;
+        return;
+    }
+
+    refit_world(gWorld, positions);
+    update_shader_data_bounds(gWorld, scene_data);
+    upload_refit_scene_data();
+
+    animation_frame = (animation_frame + 1) % animation.frame_count;
+    redraw_window = true;
+}
+
 void init_screenquad_geometry(void)
 {
     float verts[4][4];
@@ -599,44 +835,97 @@ void DrawFrame(GLFWwindow *window)
     int which_texture = 0;
 
     glActiveTexture(GL_TEXTURE0 + which_texture);
-    glBindTexture(GL_TEXTURE_2D, raytracer_gl.vertex_positions_texture);
-    glUniform1i(raytracer_gl.vertex_positions_uniform, which_texture);
-    which_texture++;
-
-    glActiveTexture(GL_TEXTURE0 + which_texture);
-    glBindTexture(GL_TEXTURE_2D, raytracer_gl.vertex_colors_texture);
-    glUniform1i(raytracer_gl.vertex_colors_uniform, which_texture);
+    if(scene_data.precomputed_triangles) {
+        glBindTexture(data_texture_target(), raytracer_gl.triangle_records_texture);
+        glUniform1i(raytracer_gl.triangle_records_uniform, which_texture);
+    } else {
+        glBindTexture(data_texture_target(), raytracer_gl.vertex_positions_texture);
+        glUniform1i(raytracer_gl.vertex_positions_uniform, which_texture);
+    }
     which_texture++;
 
     glActiveTexture(GL_TEXTURE0 + which_texture);
-    glBindTexture(GL_TEXTURE_2D, raytracer_gl.vertex_normals_texture);
+    glBindTexture(data_texture_target(), raytracer_gl.vertex_normals_texture);
     glUniform1i(raytracer_gl.vertex_normals_uniform, which_texture);
     which_texture++;
 
-    glActiveTexture(GL_TEXTURE0 + which_texture);
-    glBindTexture(GL_TEXTURE_2D, raytracer_gl.group_objects_texture);
-    glUniform1i(raytracer_gl.group_objects_uniform, which_texture);
-    which_texture++;
+    if(scene_data.compressed_nodes) {
 
-    glActiveTexture(GL_TEXTURE0 + which_texture);
-    glBindTexture(GL_TEXTURE_2D, raytracer_gl.group_hitmiss_texture);
-    glUniform1i(raytracer_gl.group_hitmiss_uniform, which_texture);
-    which_texture++;
+        glActiveTexture(GL_TEXTURE0 + which_texture);
+        glBindTexture(data_texture_target(), raytracer_gl.group_nodes_texture);
+        glUniform1i(raytracer_gl.group_nodes_uniform, which_texture);
+        which_texture++;
 
-    glActiveTexture(GL_TEXTURE0 + which_texture);
-    glBindTexture(GL_TEXTURE_2D, raytracer_gl.group_directions_texture);
-    glUniform1i(raytracer_gl.group_directions_uniform, which_texture);
-    which_texture++;
+        glActiveTexture(GL_TEXTURE0 + which_texture);
+        glBindTexture(data_texture_target(), raytracer_gl.group_miss_texture);
+        glUniform1i(raytracer_gl.group_miss_uniform, which_texture);
+        which_texture++;
 
-    glActiveTexture(GL_TEXTURE0 + which_texture);
-    glBindTexture(GL_TEXTURE_2D, raytracer_gl.group_boxmin_texture);
-    glUniform1i(raytracer_gl.group_boxmin_uniform, which_texture);
-    which_texture++;
+        glUniform3fv(raytracer_gl.root_boxmin_uniform, 1, scene_data.root_boxmin);
+        glUniform3fv(raytracer_gl.root_boxmax_uniform, 1, scene_data.root_boxmax);
 
-    glActiveTexture(GL_TEXTURE0 + which_texture);
-    glBindTexture(GL_TEXTURE_2D, raytracer_gl.group_boxmax_texture);
-    glUniform1i(raytracer_gl.group_boxmax_uniform, which_texture);
-    which_texture++;
+    } else if(scene_data.packed_nodes) {
+
+        glActiveTexture(GL_TEXTURE0 + which_texture);
+        glBindTexture(data_texture_target(), raytracer_gl.group_records_texture);
+        glUniform1i(raytracer_gl.group_records_uniform, which_texture);
+        which_texture++;
+
+    } else {
+
+        glActiveTexture(GL_TEXTURE0 + which_texture);
+        glBindTexture(data_texture_target(), raytracer_gl.group_objects_texture);
+        glUniform1i(raytracer_gl.group_objects_uniform, which_texture);
+        which_texture++;
+
+        if(scene_data.stackless_nodes || scene_data.closest_first) {
+
+            glActiveTexture(GL_TEXTURE0 + which_texture);
+            glBindTexture(data_texture_target(), raytracer_gl.group_children_texture);
+            glUniform1i(raytracer_gl.group_children_uniform, which_texture);
+            which_texture++;
+        }
+
+        if(scene_data.stackless_nodes) {
+
+            glActiveTexture(GL_TEXTURE0 + which_texture);
+            glBindTexture(data_texture_target(), raytracer_gl.group_links_texture);
+            glUniform1i(raytracer_gl.group_links_uniform, which_texture);
+            which_texture++;
+
+        } else if(!scene_data.closest_first) {
+
+            glActiveTexture(GL_TEXTURE0 + which_texture);
+            glBindTexture(data_texture_target(), raytracer_gl.group_hitmiss_texture);
+            glUniform1i(raytracer_gl.group_hitmiss_uniform, which_texture);
+            which_texture++;
+        }
+
+        glActiveTexture(GL_TEXTURE0 + which_texture);
+        glBindTexture(data_texture_target(), raytracer_gl.group_directions_texture);
+        glUniform1i(raytracer_gl.group_directions_uniform, which_texture);
+        which_texture++;
+
+        glActiveTexture(GL_TEXTURE0 + which_texture);
+        glBindTexture(data_texture_target(), raytracer_gl.group_boxmin_texture);
+        glUniform1i(raytracer_gl.group_boxmin_uniform, which_texture);
+        which_texture++;
+
+        glActiveTexture(GL_TEXTURE0 + which_texture);
+        glBindTexture(data_texture_target(), raytracer_gl.group_boxmax_texture);
+        glUniform1i(raytracer_gl.group_boxmax_uniform, which_texture);
+        which_texture++;
+    }
+
+    if(scene_data.instance_count > 0) {
+
+        glActiveTexture(GL_TEXTURE0 + which_texture);
+        glBindTexture(data_texture_target(), raytracer_gl.instance_data_texture);
+        glUniform1i(raytracer_gl.instance_data_uniform, which_texture);
+        which_texture++;
+
+        glUniform1i(raytracer_gl.instance_data_rows_uniform, scene_data.instance_data_rows);
+    }
 
     glActiveTexture(GL_TEXTURE0 + which_texture);
     glBindTexture(GL_TEXTURE_2D, raytracer_gl.background_texture);
@@ -945,6 +1234,8 @@ void ResizeCallback(GLFWwindow *window, int x, int y)
 void usage(char *progname)
 {
     fprintf(stderr, "usage: %s inputfilename backgroundcolorspec\n", progname);
+    fprintf(stderr, "input can be .obj, .trisrc, or .instances; see load_instances in world.cpp.\n");
+    fprintf(stderr, "or a .scene image written by bake, which is mapped without building anything.\n");
     fprintf(stderr, "background color can be floats as \"r, g, b\", or hex as \"rrggbb\", or the\n");
     fprintf(stderr, "name of a spheremap texture file.\n");
 }
@@ -993,12 +1284,25 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if((gWorld = load_world(argv[1])) == nullptr) {
+    if(is_scene_image_filename(argv[1])) {
+        gWorld = load_scene_image(argv[1], scene_data);
+    } else {
+        gWorld = load_world(argv[1]);
+    }
+    if(gWorld == nullptr) {
         fprintf(stderr, "Cannot set up world.\n");
         exit(EXIT_FAILURE);
     }
     fprintf(stderr, "loaded\n");
 
+    if(getenv("VERTEX_CACHE") != nullptr) {
+        if(gWorld->tree != nullptr) {
+            animation.open(getenv("VERTEX_CACHE"), gWorld->triangles->vertices.size());
+        } else {
+            fprintf(stderr, "vertex caches aren't supported with instances or scene images\n");
+        }
+    }
+
     unsigned int rx, gx, bx;
     float rf, gf, bf;
     if(sscanf(argv[2], "%f, %f, %f", &rf, &gf, &bf) == 3) {
@@ -1114,7 +1418,7 @@ int main(int argc, char *argv[])
             }
             glfwSwapBuffers(window);
 
-            printf("%d frames:\n", frame_count);
+            printf("%d frames, %s nodes, %s layout:\n", frame_count, get_node_format_name(scene_data), get_bvh_layout_name());
             const int bucket_count = 10;
             for(int i = 0; i < bucket_count; i++) {
                 float duration_range = frame_max - frame_min;
@@ -1129,13 +1433,18 @@ int main(int argc, char *argv[])
                 printf("%.2f to %.2f ms, %.2f fps : %d\n", bucket_start * 1000.0, bucket_end * 1000.0, 1 / ((bucket_start + bucket_end) / 2.0), count);
             }
             do_benchmark_run = false;
-        } else if(redraw_window) {
-            DrawFrame(window);
-            glfwSwapBuffers(window);
-            redraw_window = false;
+        } else {
+            if(animation.fp != nullptr) {
+                advance_animation();
+            }
+            if(redraw_window) {
+                DrawFrame(window);
+                glfwSwapBuffers(window);
+                redraw_window = false;
+            }
         }
 
-        if(stream_frames) {
+        if(stream_frames || (animation.fp != nullptr)) {
             glfwPollEvents();
         } else {
             glfwWaitEvents();
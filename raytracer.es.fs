@@ -31,16 +31,60 @@ uniform mat4 object_inverse;
 uniform mat4 object_normal_matrix;
 uniform mat4 object_normal_inverse;
 
+// With PAGED_TEXTURES, data textures taller than data_page_rows are
+// arrays of layers that many rows high; see scene_shader_data::paged_rows
+#ifdef PAGED_TEXTURES
+#define data_sampler sampler2DArray
+#define data_usampler usampler2DArray
+#define data_coord vec3
+#else
+#define data_sampler sampler2D
+#define data_usampler usampler2D
+#define data_coord vec2
+#endif
+
 uniform int vertex_data_rows;
-uniform highp sampler2D vertex_positions;
+#if defined(TRIANGLE_RECORDS)
+uniform highp data_sampler triangle_records;
+#elif defined(COMPACT_VERTICES)
+uniform highp data_usampler vertex_positions;
+#else
+uniform highp data_sampler vertex_positions;
+#endif
 // uniform sampler2D vertex_colors;
-uniform sampler2D vertex_normals;
+#if defined(COMPACT_VERTICES)
+uniform highp data_usampler vertex_normals;
+#else
+uniform data_sampler vertex_normals;
+#endif
 
 uniform int group_data_rows;
-uniform highp sampler2D group_boxmin;
-uniform highp sampler2D group_boxmax;
-uniform highp sampler2D group_objects;
-uniform highp sampler2D group_hitmiss;
+#if defined(COMPRESSED_NODES)
+uniform highp data_usampler group_nodes;
+uniform highp data_usampler group_miss;
+uniform highp vec3 root_boxmin;
+uniform highp vec3 root_boxmax;
+#elif defined(PACKED_NODES)
+uniform highp data_usampler group_records;
+#else
+uniform highp data_sampler group_boxmin;
+uniform highp data_sampler group_boxmax;
+uniform highp data_sampler group_objects;
+#if defined(STACKLESS_NODES)
+uniform highp data_sampler group_children;
+uniform mediump data_sampler group_directions;
+uniform highp data_sampler group_links;
+#elif defined(CLOSEST_FIRST)
+uniform highp data_sampler group_children;
+#else
+uniform highp data_sampler group_hitmiss;
+#endif
+#endif
+
+#ifdef INSTANCES
+uniform int instance_data_rows;
+uniform highp data_sampler instance_data;
+#endif
 
 uniform highp vec3 right;
 uniform highp vec3 up;
@@ -110,6 +154,7 @@ struct surface_hit
     highp float t;
     highp float which;
     mediump vec3 uvw;
+    highp float instance; // -1 unless hit through an instance
 };
 
 const highp float infinitely_far = 10000000.0;
@@ -156,7 +201,7 @@ vec3 sample_environment(in ray r, sampler2D sampler)
 
 surface_hit surface_hit_init()
 {
-    return surface_hit(infinitely_far, -1.0, vec3(1, 0, 0));
+    return surface_hit(infinitely_far, -1.0, vec3(1, 0, 0), -1.0);
 }
 
 void set_bad_hit(inout surface_hit hit, float r, float g, float b)
@@ -216,18 +261,80 @@ range range_intersect_box(in highp vec3 boxmin, in highp vec3 boxmax, in ray the
     return r2;
 }
 
-struct group {
-    bool is_branch;
-    highp float start;
-    highp float count;
-    highp vec3 boxmin;
-    highp vec3 boxmax;
-    highp float hit_next;
-    highp float miss_next;
-};
-
 const highp float sample_offset = .25; // 0.0; // 0.25;
 
+#ifdef TILED_TEXELS
+
+// 8x8 tiles of 64 consecutive indices in Morton order, like
+// get_data_texel in world.cpp
+ivec2 index_to_plane_texel(highp uint which)
+{
+    highp uint tile = which >> 6;
+    highp uint x = (which & 1u) | ((which >> 1) & 2u) | ((which >> 2) & 4u);
+    highp uint y = ((which >> 1) & 1u) | ((which >> 2) & 2u) | ((which >> 3) & 4u);
+    highp uint tiles_per_row = uint(data_texture_width) / 8u;
+    return ivec2(int((tile % tiles_per_row) * 8u + x), int((tile / tiles_per_row) * 8u + y));
+}
+
+#else
+
+ivec2 index_to_plane_texel(highp uint which)
+{
+    return ivec2(int(which % uint(data_texture_width)), int(which / uint(data_texture_width)));
+}
+
+#endif
+
+#if defined(PAGED_TEXTURES)
+
+// Row y of the whole texture is row y % data_page_rows of layer
+// y / data_page_rows; textures no taller than that have one layer
+ivec3 index_to_texel(highp uint which)
+{
+    ivec2 texel = index_to_plane_texel(which);
+    return ivec3(texel.x, texel.y % data_page_rows, texel.y / data_page_rows);
+}
+
+// "height" is the rows of all of the texture's layers together
+mediump vec3 index_to_sample(highp int which, highp int width, highp int height)
+{
+    ivec3 texel = index_to_texel(uint(which));
+    highp int layer_rows = min(height, data_page_rows);
+    mediump vec3 sample = vec3((float(texel.x) + sample_offset) / float(width), (float(texel.y) + sample_offset) / float(layer_rows), float(texel.z));
+    return sample;
+}
+
+mediump vec3 index_to_sample(highp float which, highp int width, highp int height)
+{
+    return index_to_sample(int(which), width, height);
+}
+
+#elif defined(TILED_TEXELS)
+
+ivec2 index_to_texel(highp uint which)
+{
+    return index_to_plane_texel(which);
+}
+
+mediump vec2 index_to_sample(highp int which, highp int width, highp int height)
+{
+    ivec2 texel = index_to_texel(uint(which));
+    mediump vec2 sample = vec2((float(texel.x) + sample_offset) / float(width), (float(texel.y) + sample_offset) / float(height));
+    return sample;
+}
+
+mediump vec2 index_to_sample(highp float which, highp int width, highp int height)
+{
+    return index_to_sample(int(which), width, height);
+}
+
+#else
+
+ivec2 index_to_texel(highp uint which)
+{
+    return index_to_plane_texel(which);
+}
+
 mediump vec2 index_to_sample(highp int which, highp int width, highp int height)
 {
     highp int j = which / width;
@@ -244,16 +351,30 @@ mediump vec2 index_to_sample(highp float which, highp int width, highp int heigh
     return sample;
 }
 
+#endif
+
+#if !defined(COMPRESSED_NODES) && !defined(PACKED_NODES) && !defined(STACKLESS_NODES) && !defined(CLOSEST_FIRST)
+
+struct group {
+    bool is_branch;
+    highp float start;
+    highp float count;
+    highp vec3 boxmin;
+    highp vec3 boxmax;
+    highp float hit_next;
+    highp float miss_next;
+};
+
 group get_group(highp float which, highp float hitmiss_offset)
 {
     group g;
 
-    mediump vec2 sample = index_to_sample(which, data_texture_width, group_data_rows);
+    mediump data_coord sample = index_to_sample(which, data_texture_width, group_data_rows);
 
     g.boxmin = texture(group_boxmin, sample).xyz;
     g.boxmax = texture(group_boxmax, sample).xyz;
 
-    mediump vec2 sample2 = index_to_sample(which + hitmiss_offset, data_texture_width, group_data_rows * 8);
+    mediump data_coord sample2 = index_to_sample(int(which) + int(hitmiss_offset), data_texture_width, group_data_rows * 8);
     highp vec2 group_next = texture(group_hitmiss, sample2).xy;
     g.hit_next = group_next.x;
     g.miss_next = group_next.y;
@@ -274,6 +395,8 @@ range group_bounds_intersect(in group g, in ray theray, in range prevr)
     return range_intersect_box(g.boxmin, g.boxmax, theray, prevr);
 }
 
+#endif
+
 /*
 vec3 triangle_interpolate_color(highp float which, in vec3 uvw)
 {
@@ -285,22 +408,43 @@ vec3 triangle_interpolate_color(highp float which, in vec3 uvw)
 }
 */
 
+#if defined(COMPACT_VERTICES)
+
+// Same as decode_octahedral_normal in compact-vertices.cpp
+mediump vec3 decode_octahedral_normal(highp uint bits)
+{
+    highp vec2 e = vec2(float(int(bits << 16) >> 16), float(int(bits) >> 16)) / 32767.0;
+    highp vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if(n.z < 0.0) {
+        n.xy = (1.0 - abs(n.yx)) * vec2((n.x >= 0.0) ? 1.0 : -1.0, (n.y >= 0.0) ? 1.0 : -1.0);
+    }
+    return normalize(n);
+}
+
 vec3 triangle_interpolate_normal(highp float which, in vec3 uvw)
 {
-    mediump vec3 n0 = texture(vertex_normals, index_to_sample(which * 3.0 + 0.0, data_texture_width, vertex_data_rows)).xyz;
-    mediump vec3 n1 = texture(vertex_normals, index_to_sample(which * 3.0 + 1.0, data_texture_width, vertex_data_rows)).xyz;
-    mediump vec3 n2 = texture(vertex_normals, index_to_sample(which * 3.0 + 2.0, data_texture_width, vertex_data_rows)).xyz;
+    mediump vec3 n0 = decode_octahedral_normal(texture(vertex_normals, index_to_sample(int(which) * 3 + 0, data_texture_width, vertex_data_rows)).x);
+    mediump vec3 n1 = decode_octahedral_normal(texture(vertex_normals, index_to_sample(int(which) * 3 + 1, data_texture_width, vertex_data_rows)).x);
+    mediump vec3 n2 = decode_octahedral_normal(texture(vertex_normals, index_to_sample(int(which) * 3 + 2, data_texture_width, vertex_data_rows)).x);
 
     return n0 * uvw.x + n1 * uvw.y + n2 * uvw.z;
 }
 
-void triangle_intersect(highp float which, in ray theray, in range r, inout surface_hit hit)
+#else
+
+vec3 triangle_interpolate_normal(highp float which, in vec3 uvw)
 {
-    highp vec3 v0, v1, v2;
-    v0 = texture(vertex_positions, index_to_sample(which * 3.0 + 0.0, data_texture_width, vertex_data_rows)).xyz;
-    v1 = texture(vertex_positions, index_to_sample(which * 3.0 + 1.0, data_texture_width, vertex_data_rows)).xyz;
-    v2 = texture(vertex_positions, index_to_sample(which * 3.0 + 2.0, data_texture_width, vertex_data_rows)).xyz;
+    mediump vec3 n0 = texture(vertex_normals, index_to_sample(int(which) * 3 + 0, data_texture_width, vertex_data_rows)).xyz;
+    mediump vec3 n1 = texture(vertex_normals, index_to_sample(int(which) * 3 + 1, data_texture_width, vertex_data_rows)).xyz;
+    mediump vec3 n2 = texture(vertex_normals, index_to_sample(int(which) * 3 + 2, data_texture_width, vertex_data_rows)).xyz;
+
+    return n0 * uvw.x + n1 * uvw.y + n2 * uvw.z;
+}
+
+#endif
 
+void triangle_intersect_vertices(highp float which, in highp vec3 v0, in highp vec3 v1, in highp vec3 v2, in ray theray, in range r, inout surface_hit hit)
+{
     highp vec3 e0 = v1 - v0;
     highp vec3 e1 = v0 - v2;
     highp vec3 e2 = v2 - v1;
@@ -359,6 +503,108 @@ void triangle_intersect(highp float which, in ray theray, in range r, inout surf
 #endif
 }
 
+#if defined(TRIANGLE_RECORDS)
+
+// See triangle-records.h for the record layout; same test as
+// triangle_record_intersect in triangle-records.cpp
+void triangle_intersect_record(highp float which, in highp vec4 u_row, in highp vec4 v_row, in highp vec4 plane, in ray theray, in range r, inout surface_hit hit)
+{
+    highp float dz = dot(plane.xyz, theray.D);
+    if(dz == 0.0) {
+        return;
+    }
+
+    highp float d = -(dot(plane.xyz, theray.P) + plane.w) / dz;
+    if(d > hit.t) {
+        return;
+    }
+    if(d < r.t0 || d > r.t1) {
+        return;
+    }
+
+    mediump float u = dot(u_row.xyz, theray.P) + u_row.w + d * dot(u_row.xyz, theray.D);
+    if(u < 0.0 || u > 1.0) {
+        return;
+    }
+
+    mediump float v = dot(v_row.xyz, theray.P) + v_row.w + d * dot(v_row.xyz, theray.D);
+    if(v < 0.0 || u + v > 1.0) {
+        return;
+    }
+
+    hit.which = which;
+    hit.t = d;
+    hit.uvw[0] = 1.0 - u - v;
+    hit.uvw[1] = u;
+    hit.uvw[2] = v;
+}
+
+void triangle_intersect(highp float which, in highp vec3 leaf_min, in highp vec3 leaf_max, in ray theray, in range r, inout surface_hit hit)
+{
+    highp vec4 u_row = texture(triangle_records, index_to_sample(int(which) * 3 + 0, data_texture_width, vertex_data_rows));
+    highp vec4 v_row = texture(triangle_records, index_to_sample(int(which) * 3 + 1, data_texture_width, vertex_data_rows));
+    highp vec4 plane = texture(triangle_records, index_to_sample(int(which) * 3 + 2, data_texture_width, vertex_data_rows));
+    triangle_intersect_record(which, u_row, v_row, plane, theray, r, hit);
+}
+
+// Same, with the record addressed in integers
+void triangle_intersect(highp uint which, in highp vec3 leaf_min, in highp vec3 leaf_max, in ray theray, in range r, inout surface_hit hit)
+{
+    highp vec4 u_row = texelFetch(triangle_records, index_to_texel(which * 3u + 0u), 0);
+    highp vec4 v_row = texelFetch(triangle_records, index_to_texel(which * 3u + 1u), 0);
+    highp vec4 plane = texelFetch(triangle_records, index_to_texel(which * 3u + 2u), 0);
+    triangle_intersect_record(float(which), u_row, v_row, plane, theray, r, hit);
+}
+
+#elif defined(COMPACT_VERTICES)
+
+// Positions are quantized in the box of the leaf being tested; see
+// compact-vertices.h
+void triangle_intersect(highp float which, in highp vec3 leaf_min, in highp vec3 leaf_max, in ray theray, in range r, inout surface_hit hit)
+{
+    highp vec3 step = (leaf_max - leaf_min) / 65535.0;
+    highp vec3 v0, v1, v2;
+    v0 = leaf_min + vec3(texture(vertex_positions, index_to_sample(int(which) * 3 + 0, data_texture_width, vertex_data_rows)).xyz) * step;
+    v1 = leaf_min + vec3(texture(vertex_positions, index_to_sample(int(which) * 3 + 1, data_texture_width, vertex_data_rows)).xyz) * step;
+    v2 = leaf_min + vec3(texture(vertex_positions, index_to_sample(int(which) * 3 + 2, data_texture_width, vertex_data_rows)).xyz) * step;
+    triangle_intersect_vertices(which, v0, v1, v2, theray, r, hit);
+}
+
+// Same, with the vertices addressed in integers
+void triangle_intersect(highp uint which, in highp vec3 leaf_min, in highp vec3 leaf_max, in ray theray, in range r, inout surface_hit hit)
+{
+    highp vec3 step = (leaf_max - leaf_min) / 65535.0;
+    highp vec3 v0, v1, v2;
+    v0 = leaf_min + vec3(texelFetch(vertex_positions, index_to_texel(which * 3u + 0u), 0).xyz) * step;
+    v1 = leaf_min + vec3(texelFetch(vertex_positions, index_to_texel(which * 3u + 1u), 0).xyz) * step;
+    v2 = leaf_min + vec3(texelFetch(vertex_positions, index_to_texel(which * 3u + 2u), 0).xyz) * step;
+    triangle_intersect_vertices(float(which), v0, v1, v2, theray, r, hit);
+}
+
+#else
+
+// "leaf_min" and "leaf_max" are only for compact vertices
+void triangle_intersect(highp float which, in highp vec3 leaf_min, in highp vec3 leaf_max, in ray theray, in range r, inout surface_hit hit)
+{
+    highp vec3 v0, v1, v2;
+    v0 = texture(vertex_positions, index_to_sample(int(which) * 3 + 0, data_texture_width, vertex_data_rows)).xyz;
+    v1 = texture(vertex_positions, index_to_sample(int(which) * 3 + 1, data_texture_width, vertex_data_rows)).xyz;
+    v2 = texture(vertex_positions, index_to_sample(int(which) * 3 + 2, data_texture_width, vertex_data_rows)).xyz;
+    triangle_intersect_vertices(which, v0, v1, v2, theray, r, hit);
+}
+
+// Same, with the vertices addressed in integers
+void triangle_intersect(highp uint which, in highp vec3 leaf_min, in highp vec3 leaf_max, in ray theray, in range r, inout surface_hit hit)
+{
+    highp vec3 v0, v1, v2;
+    v0 = texelFetch(vertex_positions, index_to_texel(which * 3u + 0u), 0).xyz;
+    v1 = texelFetch(vertex_positions, index_to_texel(which * 3u + 1u), 0).xyz;
+    v2 = texelFetch(vertex_positions, index_to_texel(which * 3u + 2u), 0).xyz;
+    triangle_intersect_vertices(float(which), v0, v1, v2, theray, r, hit);
+}
+
+#endif
+
 void shade(in surface_hit hit, in ray theray, out mediump vec3 normal, out highp vec3 point, out vec3 color)
 {
     if(hit.which < 0.0) {
@@ -381,6 +627,360 @@ void shade(in surface_hit hit, in ray theray, out mediump vec3 normal, out highp
 const highp int max_bvh_iterations = 400; // 400 is just a little too few for the models with more triangles
 const highp float max_leaf_tests = 10.0;
 
+#if defined(COMPRESSED_NODES)
+
+// See compressed-bvh.h for the node layout
+const int max_compressed_depth = 64;
+const highp uint compressed_leaf = 0x4000000u;
+const highp uint compressed_stop_traversal = 0xffffffffu;
+
+// Same as decode_compressed_bounds in compressed-bvh.cpp
+void decode_compressed_bounds(in highp uvec4 node, in highp vec3 parent_min, in highp vec3 parent_max, out highp vec3 boxmin, out highp vec3 boxmax)
+{
+    highp vec3 qmin = vec3(float(node.x & 0xffu), float((node.x >> 8) & 0xffu), float((node.x >> 16) & 0xffu));
+    highp vec3 qmax = vec3(float(node.x >> 24), float(node.y & 0xffu), float((node.y >> 8) & 0xffu));
+    highp vec3 scale = (parent_max - parent_min) / 255.0;
+    boxmin = parent_min + qmin * scale;
+    boxmax = parent_max - (vec3(255.0) - qmax) * scale;
+}
+
+void group_intersect(highp float root, in ray theray, in range prevr, inout surface_hit hit)
+{
+    // Decoded box of the last inner node hit at each depth; the parent
+    // of any node reached by a miss link was the last one hit at its depth
+    highp vec3 frame_min[max_compressed_depth + 1];
+    highp vec3 frame_max[max_compressed_depth + 1];
+    frame_min[0] = root_boxmin;
+    frame_max[0] = root_boxmax;
+
+    highp uint g = uint(root);
+    int xd = (theray.D.x > 0.0) ? 1 : 0;
+    int yd = (theray.D.y > 0.0) ? 2 : 0;
+    int zd = (theray.D.z > 0.0) ? 4 : 0;
+    highp uint miss_offset = uint((xd + yd + zd) * group_data_rows * data_texture_width);
+    bvec3 positive = greaterThan(theray.D, vec3(0.0));
+
+#ifdef CONSTANT_LENGTH_LOOPS
+    for(highp int i = 0; i < max_bvh_iterations; i++) {
+#else
+    while(g != compressed_stop_traversal) {
+#endif
+        highp uvec4 node = texelFetch(group_nodes, index_to_texel(g), 0);
+        int depth = int((node.y >> 16) & 0xffu);
+
+        highp vec3 boxmin, boxmax;
+        decode_compressed_bounds(node, frame_min[depth], frame_max[depth], boxmin, boxmax);
+        range r = range_intersect_box(boxmin, boxmax, theray, prevr);
+
+        if((!range_is_empty(r)) && (r.t0 < hit.t) && ((node.y & compressed_leaf) == 0u)) {
+
+            frame_min[depth + 1] = boxmin;
+            frame_max[depth + 1] = boxmax;
+            int axis = int((node.y >> 24) & 0x3u);
+            g = positive[axis] ? node.z : node.w;
+
+        } else {
+
+            if((!range_is_empty(r)) && (r.t0 < hit.t)) {
+                highp float start = float(node.z);
+                highp float count = float(node.w);
+#ifdef CONSTANT_LENGTH_LOOPS
+                for(highp float j = 0.0; j < max_leaf_tests; j++) {
+                    if(j >= count) {
+                        break;
+                    }
+                    triangle_intersect(start + j, boxmin, boxmax, theray, r, hit);
+                }
+#else
+                for(highp float j = 0.0; j < count; j++) {
+                    triangle_intersect(start + j, boxmin, boxmax, theray, r, hit);
+                }
+#endif
+            }
+            g = texelFetch(group_miss, index_to_texel(g + miss_offset), 0).x;
+        }
+
+#ifdef CONSTANT_LENGTH_LOOPS
+        if(g == compressed_stop_traversal) {
+            return;
+        }
+
+        if(i == max_bvh_iterations - 1) {
+            set_bad_hit(hit, 1.0, 0.0, 0.0);
+        }
+    }
+#else
+    }
+#endif
+}
+
+#elif defined(PACKED_NODES)
+
+// See packed-bvh.h for the record layout
+const highp uint packed_leaf = 0x80000000u;
+const highp uint packed_link_mask = 0x1fffffffu;
+const highp uint packed_stop_traversal = 0xffffffffu;
+
+void group_intersect(highp float root, in ray theray, in range prevr, inout surface_hit hit)
+{
+    highp uint g = uint(root);
+    int dircode = ((theray.D.x > 0.0) ? 1 : 0) + ((theray.D.y > 0.0) ? 2 : 0) + ((theray.D.z > 0.0) ? 4 : 0);
+    int miss_texel = 2 + dircode / 4;
+    int miss_lane = dircode - (dircode / 4) * 4;
+    bvec3 positive = greaterThan(theray.D, vec3(0.0));
+
+#ifdef CONSTANT_LENGTH_LOOPS
+    for(highp int i = 0; i < max_bvh_iterations; i++) {
+#else
+    while(g != packed_stop_traversal) {
+#endif
+        highp uvec4 lower = texelFetch(group_records, index_to_texel(g * 4u + 0u), 0);
+        highp uvec4 upper = texelFetch(group_records, index_to_texel(g * 4u + 1u), 0);
+        range r = range_intersect_box(uintBitsToFloat(lower.xyz), uintBitsToFloat(upper.xyz), theray, prevr);
+
+        if((!range_is_empty(r)) && (r.t0 < hit.t) && ((upper.w & packed_leaf) == 0u)) {
+
+            int axis = int((upper.w >> 29) & 0x3u);
+            g = positive[axis] ? lower.w : (upper.w & packed_link_mask);
+
+        } else {
+
+            if((!range_is_empty(r)) && (r.t0 < hit.t)) {
+                highp uint start = lower.w;
+                highp uint count = upper.w & packed_link_mask;
+                highp vec3 boxmin = uintBitsToFloat(lower.xyz);
+                highp vec3 boxmax = uintBitsToFloat(upper.xyz);
+#ifdef CONSTANT_LENGTH_LOOPS
+                for(highp uint j = 0u; j < uint(max_leaf_tests); j++) {
+                    if(j >= count) {
+                        break;
+                    }
+                    triangle_intersect(start + j, boxmin, boxmax, theray, r, hit);
+                }
+#else
+                for(highp uint j = 0u; j < count; j++) {
+                    triangle_intersect(start + j, boxmin, boxmax, theray, r, hit);
+                }
+#endif
+            }
+            g = texelFetch(group_records, index_to_texel(g * 4u + uint(miss_texel)), 0)[miss_lane];
+        }
+
+#ifdef CONSTANT_LENGTH_LOOPS
+        if(g == packed_stop_traversal) {
+            return;
+        }
+
+        if(i == max_bvh_iterations - 1) {
+            set_bad_hit(hit, 1.0, 0.0, 0.0);
+        }
+    }
+#else
+    }
+#endif
+}
+
+#elif defined(STACKLESS_NODES)
+
+// See stackless-bvh.h; a node is entered from its parent as the near
+// child, from its sibling as the far child, or from a child whose
+// subtree is finished
+const int from_parent = 0;
+const int from_sibling = 1;
+const int from_child = 2;
+
+const highp float terminator = 16777215.0;
+
+// Going back up takes more iterations than following hit/miss links
+const highp int max_stackless_iterations = 2 * max_bvh_iterations;
+
+void group_intersect(highp float root, in ray theray, in range prevr, inout surface_hit hit)
+{
+    highp float g = root;
+    highp float child = terminator;
+    int state = from_parent;
+
+#ifdef CONSTANT_LENGTH_LOOPS
+    for(highp int i = 0; i < max_stackless_iterations; i++) {
+#else
+    while(g < terminator) {
+#endif
+        mediump data_coord sample = index_to_sample(g, data_texture_width, group_data_rows);
+        highp vec2 children = texture(group_children, sample).xy;
+
+        if(state == from_child) {
+
+            // Go to the far child if "child" was the near one, else
+            // this subtree is finished too
+            highp float near = (dot(texture(group_directions, sample).xyz, theray.D) > 0.0) ? children.x : children.y;
+            if(child == near) {
+                g = (near == children.x) ? children.y : children.x;
+                state = from_sibling;
+            } else {
+                child = g;
+                g = texture(group_links, sample).x;
+            }
+
+        } else {
+
+            highp vec3 boxmin = texture(group_boxmin, sample).xyz;
+            highp vec3 boxmax = texture(group_boxmax, sample).xyz;
+            range r = range_intersect_box(boxmin, boxmax, theray, prevr);
+            bool entered = (!range_is_empty(r)) && (r.t0 < hit.t);
+
+            if(entered && (children.x < terminator)) {
+
+                g = (dot(texture(group_directions, sample).xyz, theray.D) > 0.0) ? children.x : children.y;
+                state = from_parent;
+
+            } else {
+
+                if(entered) {
+                    highp vec2 group_object = texture(group_objects, sample).xy;
+#ifdef CONSTANT_LENGTH_LOOPS
+                    for(highp float j = 0.0; j < max_leaf_tests; j++) {
+                        if(j >= group_object.y) {
+                            break;
+                        }
+                        triangle_intersect(group_object.x + j, boxmin, boxmax, theray, r, hit);
+                    }
+#else
+                    for(highp float j = 0.0; j < group_object.y; j++) {
+                        triangle_intersect(group_object.x + j, boxmin, boxmax, theray, r, hit);
+                    }
+#endif
+                }
+
+                highp vec2 links = texture(group_links, sample).xy;
+                if(state == from_parent) {
+                    g = links.y;
+                    state = from_sibling;
+                } else {
+                    child = g;
+                    g = links.x;
+                    state = from_child;
+                }
+            }
+        }
+
+#ifdef CONSTANT_LENGTH_LOOPS
+        if(g >= terminator) {
+            return;
+        }
+
+        if(i == max_stackless_iterations - 1) {
+            set_bad_hit(hit, 1.0, 0.0, 0.0);
+        }
+    }
+#else
+    }
+#endif
+}
+
+#elif defined(CLOSEST_FIRST)
+
+// See closest-first-bvh.h; the stack holds the far child pushed at each
+// level and its entry distance.  Must match closest_first_max_depth.
+const int closest_first_stack_size = 64;
+
+const highp float terminator = 16777215.0;
+
+range node_range(highp float which, in ray theray, in range prevr)
+{
+    mediump data_coord sample = index_to_sample(which, data_texture_width, group_data_rows);
+    return range_intersect_box(texture(group_boxmin, sample).xyz, texture(group_boxmax, sample).xyz, theray, prevr);
+}
+
+void group_intersect(highp float root, in ray theray, in range prevr, inout surface_hit hit)
+{
+    highp float stack_node[closest_first_stack_size];
+    highp float stack_t[closest_first_stack_size];
+    int stack_top = 0;
+
+    range r = node_range(root, theray, prevr);
+    if(range_is_empty(r) || (r.t0 >= hit.t)) {
+        return;
+    }
+    highp float g = root;
+
+#ifdef CONSTANT_LENGTH_LOOPS
+    for(highp int i = 0; i < max_bvh_iterations; i++) {
+#else
+    while(g < terminator) {
+#endif
+        mediump data_coord sample = index_to_sample(g, data_texture_width, group_data_rows);
+        highp vec2 children = texture(group_children, sample).xy;
+        bool descended = false;
+
+        if(children.x < terminator) {
+
+            range r0 = node_range(children.x, theray, prevr);
+            range r1 = node_range(children.y, theray, prevr);
+            bool hit0 = (!range_is_empty(r0)) && (r0.t0 < hit.t);
+            bool hit1 = (!range_is_empty(r1)) && (r1.t0 < hit.t);
+
+            if(hit0 && hit1) {
+                bool negative_first = r0.t0 <= r1.t0;
+                stack_node[stack_top] = negative_first ? children.y : children.x;
+                stack_t[stack_top] = negative_first ? r1.t0 : r0.t0;
+                stack_top++;
+                g = negative_first ? children.x : children.y;
+                descended = true;
+            } else if(hit0 || hit1) {
+                g = hit0 ? children.x : children.y;
+                descended = true;
+            }
+
+        } else {
+
+            highp vec2 group_object = texture(group_objects, sample).xy;
+            highp vec3 boxmin = texture(group_boxmin, sample).xyz;
+            highp vec3 boxmax = texture(group_boxmax, sample).xyz;
+#ifdef CONSTANT_LENGTH_LOOPS
+            for(highp float j = 0.0; j < max_leaf_tests; j++) {
+                if(j >= group_object.y) {
+                    break;
+                }
+                triangle_intersect(group_object.x + j, boxmin, boxmax, theray, prevr, hit);
+            }
+#else
+            for(highp float j = 0.0; j < group_object.y; j++) {
+                triangle_intersect(group_object.x + j, boxmin, boxmax, theray, prevr, hit);
+            }
+#endif
+        }
+
+        if(!descended) {
+            // Nearest pushed subtree that may still hold a closer hit
+            g = terminator;
+            for(int k = 0; k < closest_first_stack_size; k++) {
+                if(stack_top == 0) {
+                    break;
+                }
+                stack_top--;
+                if(stack_t[stack_top] < hit.t) {
+                    g = stack_node[stack_top];
+                    break;
+                }
+            }
+        }
+
+#ifdef CONSTANT_LENGTH_LOOPS
+        if(g >= terminator) {
+            return;
+        }
+
+        if(i == max_bvh_iterations - 1) {
+            set_bad_hit(hit, 1.0, 0.0, 0.0);
+        }
+    }
+#else
+    }
+#endif
+}
+
+#else
+
 const highp float terminator = 16777215.0;
 
 void group_intersect(highp float root, in ray theray, in range prevr, inout surface_hit hit)
@@ -413,13 +1013,13 @@ void group_intersect(highp float root, in ray theray, in range prevr, inout surf
                     if(j >= gg.count) {
                         break;
                     }
-                    triangle_intersect(gg.start + j, theray, r, hit);
+                    triangle_intersect(gg.start + j, gg.boxmin, gg.boxmax, theray, r, hit);
                 }
 
 #else
 
                 for(highp float j = 0.0; j < gg.count; j++) {
-                    triangle_intersect(gg.start + j, theray, r, hit);
+                    triangle_intersect(gg.start + j, gg.boxmin, gg.boxmax, theray, r, hit);
                 }
 #endif
             }
@@ -442,6 +1042,111 @@ void group_intersect(highp float root, in ray theray, in range prevr, inout surf
 #endif
 }
 
+#ifdef INSTANCES
+
+// Four texels per instance, see scene_shader_data::instance_data
+void get_instance(highp float which, out highp vec4 row0, out highp vec4 row1, out highp vec4 row2, out highp float root)
+{
+    row0 = texture(instance_data, index_to_sample(int(which) * 4 + 0, data_texture_width, instance_data_rows));
+    row1 = texture(instance_data, index_to_sample(int(which) * 4 + 1, data_texture_width, instance_data_rows));
+    row2 = texture(instance_data, index_to_sample(int(which) * 4 + 2, data_texture_width, instance_data_rows));
+    root = texture(instance_data, index_to_sample(int(which) * 4 + 3, data_texture_width, instance_data_rows)).x;
+}
+
+// Trace the ray through the instance's mesh in the mesh's space; the
+// direction isn't renormalized so t is the same in both spaces
+void instance_intersect(highp float which, in ray theray, in range r, inout surface_hit hit)
+{
+    highp vec4 row0, row1, row2;
+    highp float root;
+    get_instance(which, row0, row1, row2, root);
+
+    ray meshray;
+    meshray.P = vec3(dot(row0, vec4(theray.P, 1.0)), dot(row1, vec4(theray.P, 1.0)), dot(row2, vec4(theray.P, 1.0)));
+    meshray.D = vec3(dot(row0.xyz, theray.D), dot(row1.xyz, theray.D), dot(row2.xyz, theray.D));
+
+    highp float previous_t = hit.t;
+    group_intersect(root, meshray, r, hit);
+    if(hit.t != previous_t) {
+        hit.instance = which;
+    }
+}
+
+// Mesh space normal to scene space, by the transpose of the inverse
+vec3 instance_normal(highp float which, in vec3 normal)
+{
+    highp vec4 row0, row1, row2;
+    highp float root;
+    get_instance(which, row0, row1, row2, root);
+    return normalize(normal.x * row0.xyz + normal.y * row1.xyz + normal.z * row2.xyz);
+}
+
+// Same traversal as group_intersect, but leaves hold instances
+void instance_tree_intersect(highp float root, in ray theray, in range prevr, inout surface_hit hit)
+{
+    highp float g = root;
+    highp float xd = (theray.D.x > 0.0) ? 1.0 : 0.0;
+    highp float yd = (theray.D.y > 0.0) ? 2.0 : 0.0;
+    highp float zd = (theray.D.z > 0.0) ? 4.0 : 0.0;
+    highp float offset = (xd + yd + zd) * float(group_data_rows) * float(data_texture_width);
+
+#ifdef CONSTANT_LENGTH_LOOPS
+    for(highp int i = 0; i < max_bvh_iterations; i++) {
+#else
+    while(g < terminator) {
+#endif
+        group gg = get_group(g, offset);
+
+        range r = group_bounds_intersect(gg, theray, prevr);
+
+        if((!range_is_empty(r)) && (r.t0 < hit.t)) {
+            if(!gg.is_branch) {
+#ifdef CONSTANT_LENGTH_LOOPS
+                for(highp float j = 0.0; j < max_leaf_tests; j++) {
+                    if(j >= gg.count) {
+                        break;
+                    }
+                    instance_intersect(gg.start + j, theray, r, hit);
+                }
+#else
+                for(highp float j = 0.0; j < gg.count; j++) {
+                    instance_intersect(gg.start + j, theray, r, hit);
+                }
+#endif
+            }
+            g = gg.hit_next;
+        } else {
+            g = gg.miss_next;
+        }
+
+#ifdef CONSTANT_LENGTH_LOOPS
+        if(g >= terminator) {
+            return;
+        }
+
+        if(i == max_bvh_iterations - 1) {
+            set_bad_hit(hit, 0.0, 0.0, 1.0);
+        }
+    }
+#else
+    }
+#endif
+}
+
+#endif
+
+#endif
+
+// Closest hit in the whole scene, through the instances if there are any
+void scene_intersect(in ray theray, in range prevr, inout surface_hit hit)
+{
+#ifdef INSTANCES
+    instance_tree_intersect(tree_root, theray, prevr, hit);
+#else
+    group_intersect(tree_root, theray, prevr, hit);
+#endif
+}
+
 const bool cast_shadows = true;
 
 vec3 approximate_diffuse(in vec3 view, in vec3 point, in vec3 normal)
@@ -460,7 +1165,7 @@ vec3 approximate_diffuse(in vec3 view, in vec3 point, in vec3 normal)
         world_shadowray.P = point;
         world_shadowray.D = light_dir;
         ray_transform(world_shadowray, object_matrix, object_normal_matrix, object_shadowray);
-        group_intersect(tree_root, object_shadowray, make_range(0.0, 100000000.0), shadow_hit);
+        scene_intersect(object_shadowray, make_range(0.0, 100000000.0), shadow_hit);
         if(shadow_hit.t >= infinitely_far) {
             diffuse += light_diffuse;
         }
@@ -488,7 +1193,7 @@ int intersect_and_shade(in ray worldray, out vec3 object_diffuse, out vec3 objec
     ray objectray;
     ray_transform(worldray, object_matrix, object_normal_matrix, objectray);
 
-    group_intersect(tree_root, objectray, make_range(0.0, 100000000.0), shading);
+    scene_intersect(objectray, make_range(0.0, 100000000.0), shading);
 
     if(shading.t >= infinitely_far) {
         return 0;
@@ -503,6 +1208,9 @@ int intersect_and_shade(in ray worldray, out vec3 object_diffuse, out vec3 objec
     vec3 object_color;
     highp vec3 object_normal, object_point;
     shade(shading, objectray, object_normal, object_point, object_color);
+#ifdef INSTANCES
+    object_normal = instance_normal(shading.instance, object_normal);
+#endif
 
     highp vec3 world_normal;
     world_normal = (object_normal_inverse * vec4(object_normal, 0.0)).xyz;
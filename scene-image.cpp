@@ -0,0 +1,384 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scene-image.h"
+#include "packed-bvh.h"
+
+namespace
+{
+
+const char scene_image_magic[8] = {'R', 'A', 'Y', 'S', 'C', 'N', '0', '1'};
+
+const int scene_image_array_count = 16;
+
+// Everything in scene_shader_data besides its arrays, and what the
+// viewer needs of the world; an array's offset is 0 if it's absent
+struct scene_image_header
+{
+    char magic[8];
+    uint32_t header_size;
+    uint32_t data_texture_width;
+    uint32_t data_page_rows;
+    uint32_t vertex_count;
+    uint32_t vertex_data_rows;
+    int32_t group_count;
+    int32_t group_data_rows;
+    int32_t tree_root;
+    int32_t instance_count;
+    int32_t instance_data_rows;
+    int32_t triangle_count;
+    uint8_t tiled_texels;
+    uint8_t precomputed_triangles;
+    uint8_t compact_vertices;
+    uint8_t stackless_nodes;
+    uint8_t closest_first;
+    uint8_t compressed_nodes;
+    uint8_t packed_nodes;
+    uint8_t unused;
+    float root_boxmin[3];
+    float root_boxmax[3];
+    float scene_center[3];
+    float scene_extent;
+    uint64_t array_offsets[scene_image_array_count];
+};
+
+struct image_array
+{
+    const void *pixels; // null if "data" doesn't have the array
+    size_t bytes; // as allocated by get_shader_data
+};
+
+// The arrays of "data" in the order they're stored, sized from its
+// counts; set_image_arrays must list them in the same order
+void get_image_arrays(const scene_shader_data& data, image_array arrays[scene_image_array_count])
+{
+    size_t width = data.data_texture_width;
+    size_t vertex_texels = width * data.vertex_data_rows;
+    size_t group_texels = width * data.group_data_rows;
+    size_t direction_texels = width * data.paged_rows(data.group_data_rows * 8);
+    size_t record_texels = width * data.paged_rows(data.group_data_rows * packed_bvh_texels_per_node);
+    size_t instance_texels = width * data.instance_data_rows;
+
+    image_array list[scene_image_array_count] = {
+        {data.vertex_positions, sizeof(float) * 3 * vertex_texels},
+        {data.vertex_normals, sizeof(float) * 3 * vertex_texels},
+        {data.triangle_records, sizeof(float) * 4 * vertex_texels},
+        {data.compact_positions, sizeof(unsigned short) * 3 * vertex_texels},
+        {data.compact_normals, sizeof(unsigned int) * vertex_texels},
+        {data.group_boxmin, sizeof(float) * 3 * group_texels},
+        {data.group_boxmax, sizeof(float) * 3 * group_texels},
+        {data.group_directions, sizeof(float) * 3 * group_texels},
+        {data.group_children, sizeof(float) * 2 * group_texels},
+        {data.group_hitmiss, sizeof(float) * 2 * direction_texels},
+        {data.group_objects, sizeof(float) * 2 * group_texels},
+        {data.group_links, sizeof(float) * 2 * group_texels},
+        {data.group_nodes, sizeof(unsigned int) * 4 * group_texels},
+        {data.group_miss, sizeof(unsigned int) * direction_texels},
+        {data.group_records, sizeof(unsigned int) * 4 * record_texels},
+        {data.instance_data, sizeof(float) * 4 * instance_texels},
+    };
+    std::copy(list, list + scene_image_array_count, arrays);
+}
+
+void set_image_arrays(scene_shader_data& data, char *const pointers[scene_image_array_count])
+{
+    data.vertex_positions = reinterpret_cast<float *>(pointers[0]);
+    data.vertex_normals = reinterpret_cast<float *>(pointers[1]);
+    data.triangle_records = reinterpret_cast<float *>(pointers[2]);
+    data.compact_positions = reinterpret_cast<unsigned short *>(pointers[3]);
+    data.compact_normals = reinterpret_cast<unsigned int *>(pointers[4]);
+    data.group_boxmin = reinterpret_cast<float *>(pointers[5]);
+    data.group_boxmax = reinterpret_cast<float *>(pointers[6]);
+    data.group_directions = reinterpret_cast<float *>(pointers[7]);
+    data.group_children = reinterpret_cast<float *>(pointers[8]);
+    data.group_hitmiss = reinterpret_cast<float *>(pointers[9]);
+    data.group_objects = reinterpret_cast<float *>(pointers[10]);
+    data.group_links = reinterpret_cast<float *>(pointers[11]);
+    data.group_nodes = reinterpret_cast<unsigned int *>(pointers[12]);
+    data.group_miss = reinterpret_cast<unsigned int *>(pointers[13]);
+    data.group_records = reinterpret_cast<unsigned int *>(pointers[14]);
+    data.instance_data = reinterpret_cast<float *>(pointers[15]);
+}
+
+// Whether "data" has every array load_scene_data uploads for its
+// formats, and row counts get_shader_data would have given its counts
+bool has_consistent_arrays(const scene_shader_data& data)
+{
+    int node_formats = data.compressed_nodes + data.packed_nodes + data.stackless_nodes + data.closest_first;
+    if(node_formats > 1) {
+        return false;
+    }
+
+    if(data.vertex_data_rows != get_data_rows(data, data.vertex_count) ||
+        (unsigned int)data.group_data_rows != get_data_rows(data, data.group_count) ||
+        (unsigned int)data.instance_data_rows != ((data.instance_count > 0) ? get_data_rows(data, data.instance_count * 4) : 0)) {
+        return false;
+    }
+
+    bool has_positions;
+    if(data.precomputed_triangles) {
+        has_positions = data.triangle_records != nullptr;
+    } else if(data.compact_vertices) {
+        has_positions = data.compact_positions != nullptr;
+    } else {
+        has_positions = data.vertex_positions != nullptr;
+    }
+    bool has_normals = data.compact_vertices ? (data.compact_normals != nullptr) : (data.vertex_normals != nullptr);
+
+    bool has_nodes;
+    if(data.compressed_nodes) {
+        has_nodes = data.group_nodes != nullptr && data.group_miss != nullptr;
+    } else if(data.packed_nodes) {
+        has_nodes = data.group_records != nullptr;
+    } else {
+        has_nodes = data.group_objects != nullptr && data.group_directions != nullptr &&
+            data.group_boxmin != nullptr && data.group_boxmax != nullptr;
+        if(data.stackless_nodes) {
+            has_nodes = has_nodes && data.group_children != nullptr && data.group_links != nullptr;
+        } else if(data.closest_first) {
+            has_nodes = has_nodes && data.group_children != nullptr;
+        } else {
+            has_nodes = has_nodes && data.group_hitmiss != nullptr;
+        }
+    }
+
+    bool has_instances = (data.instance_count == 0) || (data.instance_data != nullptr);
+
+    return has_positions && has_normals && has_nodes && has_instances;
+}
+
+size_t align_offset(size_t offset)
+{
+    return (offset + scene_image_alignment - 1) / scene_image_alignment * scene_image_alignment;
+}
+
+bool write_padding(FILE *fp, size_t bytes)
+{
+    static const char zeroes[4096] = {};
+    while(bytes > 0) {
+        size_t chunk = std::min(bytes, sizeof(zeroes));
+        if(fwrite(zeroes, 1, chunk, fp) != chunk) {
+            return false;
+        }
+        bytes -= chunk;
+    }
+    return true;
+}
+
+}; // unnamed namespace for file scope
+
+bool is_scene_image_filename(const std::string& filename)
+{
+    const std::string extension = ".scene";
+    return filename.size() > extension.size() &&
+        filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+bool write_scene_image(world_ptr w, const scene_shader_data& data, const char *filename)
+{
+    scene_image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, scene_image_magic, sizeof(header.magic));
+    header.header_size = sizeof(header);
+    header.data_texture_width = data.data_texture_width;
+    header.data_page_rows = data.data_page_rows;
+    header.vertex_count = data.vertex_count;
+    header.vertex_data_rows = data.vertex_data_rows;
+    header.group_count = data.group_count;
+    header.group_data_rows = data.group_data_rows;
+    header.tree_root = data.tree_root;
+    header.instance_count = data.instance_count;
+    header.instance_data_rows = data.instance_data_rows;
+    header.triangle_count = w->triangle_count;
+    header.tiled_texels = data.tiled_texels;
+    header.precomputed_triangles = data.precomputed_triangles;
+    header.compact_vertices = data.compact_vertices;
+    header.stackless_nodes = data.stackless_nodes;
+    header.closest_first = data.closest_first;
+    header.compressed_nodes = data.compressed_nodes;
+    header.packed_nodes = data.packed_nodes;
+    if(data.compressed_nodes) {
+        std::copy(data.root_boxmin, data.root_boxmin + 3, header.root_boxmin);
+        std::copy(data.root_boxmax, data.root_boxmax + 3, header.root_boxmax);
+    }
+    header.scene_center[0] = w->scene_center.x;
+    header.scene_center[1] = w->scene_center.y;
+    header.scene_center[2] = w->scene_center.z;
+    header.scene_extent = w->scene_extent;
+
+    image_array arrays[scene_image_array_count];
+    get_image_arrays(data, arrays);
+    size_t size = sizeof(header);
+    for(int i = 0; i < scene_image_array_count; i++) {
+        if(arrays[i].pixels != nullptr) {
+            header.array_offsets[i] = align_offset(size);
+            size = header.array_offsets[i] + arrays[i].bytes;
+        }
+    }
+
+    // Written under a temporary name and renamed into place so a reader
+    // never maps a partial file
+    std::string temporary = std::string(filename) + "." + std::to_string(getpid());
+
+    FILE *fp = fopen(temporary.c_str(), "wb");
+    if(fp == nullptr) {
+        fprintf(stderr, "couldn't create scene image \"%s\"\n", temporary.c_str());
+        return false;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, fp) == 1;
+    size_t offset = sizeof(header);
+    for(int i = 0; written && i < scene_image_array_count; i++) {
+        if(arrays[i].pixels != nullptr) {
+            written =
+                write_padding(fp, header.array_offsets[i] - offset) &&
+                fwrite(arrays[i].pixels, 1, arrays[i].bytes, fp) == arrays[i].bytes;
+            offset = header.array_offsets[i] + arrays[i].bytes;
+        }
+    }
+    written = (fclose(fp) == 0) && written;
+
+    if(!written || rename(temporary.c_str(), filename) != 0) {
+        fprintf(stderr, "couldn't write scene image \"%s\"\n", filename);
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    fprintf(stderr, "saved %s scene image \"%s\", %f megabytes\n", get_node_format_name(data), filename, size / 1000000.0);
+
+    return true;
+}
+
+world_ptr load_scene_image(const std::string& filename, scene_shader_data& data)
+{
+    auto then = std::chrono::system_clock::now();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "couldn't open scene image \"%s\"\n", filename.c_str());
+        return nullptr;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(scene_image_header)) {
+        fprintf(stderr, "\"%s\" is too short to be a scene image\n", filename.c_str());
+        close(fd);
+        return nullptr;
+    }
+
+    // Private and writable so nothing written to the arrays, as
+    // update_shader_data_bounds would, reaches the file
+    size_t size = st.st_size;
+    void *contents = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(contents == MAP_FAILED) {
+        fprintf(stderr, "couldn't map scene image \"%s\"\n", filename.c_str());
+        return nullptr;
+    }
+
+    // The arrays are about to be read from start to end by the uploads
+    madvise(contents, size, MADV_WILLNEED);
+
+    char *bytes = static_cast<char *>(contents);
+    const scene_image_header& header = *reinterpret_cast<const scene_image_header *>(bytes);
+
+    bool valid =
+        memcmp(header.magic, scene_image_magic, sizeof(header.magic)) == 0 &&
+        header.header_size == sizeof(header) &&
+        header.data_texture_width > 0;
+
+    if(valid) {
+        data.data_texture_width = header.data_texture_width;
+        data.tiled_texels = header.tiled_texels;
+        data.data_page_rows = header.data_page_rows;
+        data.vertex_count = header.vertex_count;
+        data.vertex_data_rows = header.vertex_data_rows;
+        data.precomputed_triangles = header.precomputed_triangles;
+        data.compact_vertices = header.compact_vertices;
+        data.group_count = header.group_count;
+        data.group_data_rows = header.group_data_rows;
+        data.tree_root = header.tree_root;
+        data.stackless_nodes = header.stackless_nodes;
+        data.closest_first = header.closest_first;
+        data.compressed_nodes = header.compressed_nodes;
+        std::copy(header.root_boxmin, header.root_boxmin + 3, data.root_boxmin);
+        std::copy(header.root_boxmax, header.root_boxmax + 3, data.root_boxmax);
+        data.packed_nodes = header.packed_nodes;
+        data.instance_count = header.instance_count;
+        data.instance_data_rows = header.instance_data_rows;
+
+        valid = data.group_count > 0 && data.tree_root >= 0 && data.tree_root < data.group_count &&
+            data.instance_count >= 0 && data.group_data_rows >= 0 && data.instance_data_rows >= 0 &&
+            (!data.tiled_texels || data.data_page_rows % data_texture_tile == 0) &&
+            (!data.tiled_texels || data.data_texture_width % data_texture_tile == 0);
+    }
+
+    // Sizes come from the counts in the header, so each present array
+    // only has to be aligned and inside the file
+    image_array arrays[scene_image_array_count];
+    char *pointers[scene_image_array_count];
+    if(valid) {
+        get_image_arrays(data, arrays);
+        for(int i = 0; i < scene_image_array_count; i++) {
+            uint64_t offset = header.array_offsets[i];
+            if(offset == 0) {
+                pointers[i] = nullptr;
+            } else if(offset % scene_image_alignment != 0 || offset > size || arrays[i].bytes > size - offset) {
+                valid = false;
+            } else {
+                pointers[i] = bytes + offset;
+            }
+        }
+    }
+
+    if(valid) {
+        set_image_arrays(data, pointers);
+        valid = has_consistent_arrays(data);
+    }
+
+    if(!valid) {
+        char *none[scene_image_array_count] = {};
+        set_image_arrays(data, none);
+        fprintf(stderr, "ignoring damaged or incompatible scene image \"%s\"\n", filename.c_str());
+        munmap(contents, size);
+        return nullptr;
+    }
+
+    data.image = contents;
+    data.image_bytes = size;
+
+    auto w = std::make_shared<world>();
+    w->triangles = std::make_shared<triangle_set>();
+    w->filename = filename;
+    w->triangle_count = header.triangle_count;
+    w->scene_center = vec3(header.scene_center[0], header.scene_center[1], header.scene_center[2]);
+    w->scene_extent = header.scene_extent;
+
+    auto now = std::chrono::system_clock::now();
+    std::chrono::duration<float> elapsed = now - then;
+    fprintf(stderr, "mapped %s scene image with %d triangles in %f seconds\n", get_node_format_name(data), w->triangle_count, elapsed.count());
+
+    return w;
+}
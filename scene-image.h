@@ -0,0 +1,40 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include "world.h"
+
+// A scene image is a ".scene" file holding a finished
+// scene_shader_data: a header with its counts, row counts, node format
+// and tree_root, then every array it has exactly as load_scene_data
+// uploads it.  Each array starts on a multiple of
+// scene_image_alignment, so a mapped image's pages go to the GL
+// as they are, with no parsing, BVH build or packing.  Images are
+// written by "bake" (see bake.cpp) and hold whatever node format and
+// vertex format the environment chose when they were baked.
+const size_t scene_image_alignment = 16384; // largest common page size
+
+bool is_scene_image_filename(const std::string& filename);
+
+bool write_scene_image(world_ptr w, const scene_shader_data& data, const char *filename);
+
+// Maps "filename" and points the arrays of "data" into it; the mapping
+// is released with "data".  The world has no triangles or trees, only
+// what the viewer needs to place the camera.
+world_ptr load_scene_image(const std::string& filename, scene_shader_data& data);
@@ -0,0 +1,119 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include "stackless-bvh.h"
+
+namespace
+{
+
+enum traversal_state { from_parent, from_sibling, from_child };
+
+// Near child of inner node "g" for a ray in direction "d"
+int near_child(const scene_shader_data& data, int g, const vec3& d)
+{
+    int texel = data.texel(g);
+    const float *axis = data.group_directions + texel * 3;
+    bool positive = (axis[0] * d.x + axis[1] * d.y + axis[2] * d.z) > 0;
+    return data.group_children[texel * 2 + (positive ? 0 : 1)];
+}
+
+}; // unnamed namespace for file scope
+
+void store_stackless_links(const group_tree& tree, int base, scene_shader_data& data)
+{
+    float *root = data.group_links + data.texel(base + tree.root) * 2;
+    root[0] = stackless_bvh_stop_traversal;
+    root[1] = stackless_bvh_stop_traversal;
+
+    for(int g = 0; g < tree.size(); g++) {
+        const group& n = tree[g];
+        if(!n.is_leaf()) {
+            float *negative = data.group_links + data.texel(base + n.negative) * 2;
+            float *positive = data.group_links + data.texel(base + n.positive) * 2;
+            negative[0] = base + g;
+            negative[1] = base + n.positive;
+            positive[0] = base + g;
+            positive[1] = base + n.negative;
+        }
+    }
+}
+
+bool stackless_bvh_intersect(const scene_shader_data& data, const triangle_set& triangles, const ray& r, float tmin, ray_hit& hit)
+{
+    const float d[3] = {r.d.x, r.d.y, r.d.z};
+    const float o[3] = {r.o.x, r.o.y, r.o.z};
+
+    bool found = false;
+    float g = data.tree_root;
+    float child = stackless_bvh_terminator;
+    traversal_state state = from_parent;
+
+    while(g < stackless_bvh_terminator) {
+        int i = data.texel(g);
+
+        if(state == from_child) {
+
+            // Go to the far child if "child" was the near one, else
+            // this subtree is finished too
+            float near = near_child(data, g, r.d);
+            if(child == near) {
+                g = (near == data.group_children[i * 2 + 0]) ? data.group_children[i * 2 + 1] : data.group_children[i * 2 + 0];
+                state = from_sibling;
+            } else {
+                child = g;
+                g = data.group_links[i * 2 + 0];
+            }
+
+        } else {
+
+            float t0 = tmin;
+            float t1 = hit.t;
+            for(int a = 0; a < 3; a++) {
+                float lo = data.group_boxmin[i * 3 + a];
+                float hi = data.group_boxmax[i * 3 + a];
+                float near = ((d[a] >= 0 ? lo : hi) - o[a]) / d[a];
+                float far = ((d[a] >= 0 ? hi : lo) - o[a]) / d[a];
+                t0 = std::max(t0, near);
+                t1 = std::min(t1, far);
+            }
+            bool entered = t0 <= t1;
+
+            if(entered && data.group_children[i * 2 + 0] < stackless_bvh_terminator) {
+                g = near_child(data, g, r.d);
+                state = from_parent;
+            } else {
+                if(entered) {
+                    int start = data.group_objects[i * 2 + 0];
+                    int count = data.group_objects[i * 2 + 1];
+                    for(int j = 0; j < count; j++) {
+                        found |= triangle_intersect(triangles, start + j, r, tmin, hit);
+                    }
+                }
+                if(state == from_parent) {
+                    g = data.group_links[i * 2 + 1];
+                    state = from_sibling;
+                } else {
+                    child = g;
+                    g = data.group_links[i * 2 + 0];
+                    state = from_child;
+                }
+            }
+        }
+    }
+
+    return found;
+}
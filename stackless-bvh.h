@@ -0,0 +1,47 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include "vectormath.h"
+#include "triangle-set.h"
+#include "group.h"
+#include "wide-bvh.h"
+#include "world.h"
+
+// Parent and sibling links for stackless traversal (Hapala et al.,
+// "Efficient Stack-less BVH Traversal for Ray Tracing"), one float2
+// per node in group_links, in place of the eight hit/miss tables.
+//
+// Traversal enters a node from its parent as the near child, from its
+// sibling as the far child, or from a child whose subtree is finished.
+// The near child is the negative one if the ray points along the
+// node's split axis in group_directions, so the same links serve every
+// ray direction.  Children come from group_children.
+
+// Links at or past this end traversal, like terminator in
+// raytracer.es.fs; the root's parent and sibling are stored as
+// stackless_bvh_stop_traversal
+const float stackless_bvh_terminator = 16777215.0f;
+const unsigned int stackless_bvh_stop_traversal = 0x7fffffffU;
+
+// Fills in {parent, sibling} in data.group_links for every node of
+// "tree", which is stored at "base"
+void store_stackless_links(const group_tree& tree, int base, scene_shader_data& data);
+
+// Closest hit through group_children, group_directions, and
+// group_links the way the shader traverses them
+bool stackless_bvh_intersect(const scene_shader_data& data, const triangle_set& triangles, const ray& r, float tmin, ray_hit& hit);
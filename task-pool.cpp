@@ -0,0 +1,171 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "task-pool.h"
+
+namespace
+{
+
+thread_local int current_thread_index = 0;
+
+int default_thread_count = 0;
+
+void initialize_runtime_parameters() __attribute__((constructor));
+void initialize_runtime_parameters()
+{
+    if(getenv("BVH_THREADS") != 0) {
+        default_thread_count = atoi(getenv("BVH_THREADS"));
+        fprintf(stderr, "BVH build threads set to %d\n", default_thread_count);
+    }
+}
+
+}; // unnamed namespace for file scope
+
+int get_default_thread_count()
+{
+    if(default_thread_count > 0) {
+        return default_thread_count;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+task_pool& get_world_pool()
+{
+    static task_pool pool(get_default_thread_count());
+    return pool;
+}
+
+task_pool::task_pool(int thread_count_) :
+    thread_count(std::max(1, thread_count_)),
+    queued(0),
+    stopping(false)
+{
+    for(int i = 0; i < thread_count; i++) {
+        queues.push_back(std::unique_ptr<task_queue>(new task_queue));
+    }
+    current_thread_index = 0;
+    for(int i = 1; i < thread_count; i++) {
+        workers.push_back(std::thread(&task_pool::worker_loop, this, i));
+    }
+}
+
+task_pool::~task_pool()
+{
+    {
+        std::unique_lock<std::mutex> l(sleep_lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for(auto& w : workers) {
+        w.join();
+    }
+}
+
+int task_pool::get_thread_index()
+{
+    return current_thread_index;
+}
+
+void task_pool::spawn(task_group& group, std::function<void()> run)
+{
+    group.pending++;
+    {
+        task_queue& q = *queues[current_thread_index];
+        std::unique_lock<std::mutex> l(q.lock);
+        q.tasks.push_back(task{&group, std::move(run)});
+    }
+    queued++;
+    if(thread_count > 1) {
+        wakeup.notify_one();
+    }
+}
+
+bool task_pool::pop_task(int thread_index, task& t)
+{
+    {
+        task_queue& q = *queues[thread_index];
+        std::unique_lock<std::mutex> l(q.lock);
+        if(!q.tasks.empty()) {
+            t = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for(int i = 1; i < thread_count; i++) {
+        task_queue& q = *queues[(thread_index + i) % thread_count];
+        std::unique_lock<std::mutex> l(q.lock);
+        if(!q.tasks.empty()) {
+            t = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool task_pool::run_one_task(int thread_index)
+{
+    task t;
+    if(!pop_task(thread_index, t)) {
+        return false;
+    }
+    queued--;
+    t.run();
+    t.group->pending--;
+    return true;
+}
+
+void task_pool::worker_loop(int thread_index)
+{
+    current_thread_index = thread_index;
+
+    while(!stopping) {
+        if(!run_one_task(thread_index)) {
+            std::unique_lock<std::mutex> l(sleep_lock);
+            wakeup.wait_for(l, std::chrono::milliseconds(1), [this]{ return stopping || queued > 0; });
+        }
+    }
+}
+
+void task_pool::wait(task_group& group)
+{
+    int thread_index = current_thread_index;
+    while(group.pending > 0) {
+        if(!run_one_task(thread_index)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void task_pool::parallel_for(int begin, int end, int grain, const std::function<void(int, int)>& body)
+{
+    task_group group;
+    for(int s = begin; s < end; s += grain) {
+        int e = std::min(end, s + grain);
+        if(e == end) {
+            body(s, e);
+        } else {
+            spawn(group, [&body, s, e]{ body(s, e); });
+        }
+    }
+    wait(group);
+}
@@ -0,0 +1,95 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts tasks spawned against it that haven't finished yet.
+struct task_group
+{
+    std::atomic<int> pending;
+    task_group() :
+        pending(0)
+    {}
+};
+
+// Work-stealing pool.  The thread that creates the pool is participant 0
+// and only runs tasks while inside wait(); the other participants are
+// worker threads.  Each participant pushes and pops its own queue from
+// the back and steals from the front of the others' queues.
+class task_pool
+{
+    struct task
+    {
+        task_group *group;
+        std::function<void()> run;
+    };
+
+    struct task_queue
+    {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    int thread_count;
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::atomic<int> queued;
+    std::atomic<bool> stopping;
+    std::mutex sleep_lock;
+    std::condition_variable wakeup;
+
+    bool pop_task(int thread_index, task& t);
+    bool run_one_task(int thread_index);
+    void worker_loop(int thread_index);
+
+public:
+    explicit task_pool(int thread_count_);
+    ~task_pool();
+
+    int get_thread_count() const { return thread_count; }
+
+    // Index of the calling participant in [0, get_thread_count()), or 0
+    // if the caller is not part of any pool.
+    static int get_thread_index();
+
+    void spawn(task_group& group, std::function<void()> run);
+
+    // Runs queued tasks until every task spawned against "group" is done.
+    void wait(task_group& group);
+
+    // Calls body(chunk_start, chunk_end) over [begin, end) in chunks of
+    // at most "grain" items.  Chunk boundaries depend only on the
+    // arguments, never on the thread count.
+    void parallel_for(int begin, int end, int grain, const std::function<void(int, int)>& body);
+};
+
+// Default participant count; BVH_THREADS overrides the hardware count.
+int get_default_thread_count();
+
+// One pool with the default participant count, kept for the whole run
+// so builds, packing shader data and per-frame refits don't start
+// threads; create it, by calling this first, from the main thread
+task_pool& get_world_pool();
@@ -0,0 +1,88 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "triangle-records.h"
+
+void store_triangle_record(const triangle_set& triangles, int which, scene_shader_data& data)
+{
+    const indexed_triangle& t = triangles.triangles[which];
+    const vec3& v0 = triangles.vertices[t.i[0]].v;
+    const vec3& v1 = triangles.vertices[t.i[1]].v;
+    const vec3& v2 = triangles.vertices[t.i[2]].v;
+
+    // Inverse of the matrix with columns e0, e1, and their normal n,
+    // computed in double since thin triangles lose a lot to it
+    double e0[3] = {(double)v1.x - v0.x, (double)v1.y - v0.y, (double)v1.z - v0.z};
+    double e1[3] = {(double)v2.x - v0.x, (double)v2.y - v0.y, (double)v2.z - v0.z};
+    double n[3] = {e0[1] * e1[2] - e0[2] * e1[1], e0[2] * e1[0] - e0[0] * e1[2], e0[0] * e1[1] - e0[1] * e1[0]};
+    double det = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+
+    double rows[3][3] = {
+        {e1[1] * n[2] - e1[2] * n[1], e1[2] * n[0] - e1[0] * n[2], e1[0] * n[1] - e1[1] * n[0]},
+        {n[1] * e0[2] - n[2] * e0[1], n[2] * e0[0] - n[0] * e0[2], n[0] * e0[1] - n[1] * e0[0]},
+        {n[0], n[1], n[2]},
+    };
+    const double origin[3] = {v0.x, v0.y, v0.z};
+
+    for(int k = 0; k < triangle_record_texels; k++) {
+        float *texel = data.triangle_records + data.texel(which * triangle_record_texels + k) * 4;
+        if(det == 0) {
+            texel[0] = texel[1] = texel[2] = texel[3] = 0;
+            continue;
+        }
+        double w = 0;
+        for(int a = 0; a < 3; a++) {
+            texel[a] = rows[k][a] / det;
+            w -= rows[k][a] / det * origin[a];
+        }
+        texel[3] = w;
+    }
+}
+
+bool triangle_record_intersect(const scene_shader_data& data, int which, const ray& r, float tmin, ray_hit& hit)
+{
+    const float *u_row = data.triangle_records + data.texel(which * triangle_record_texels + 0) * 4;
+    const float *v_row = data.triangle_records + data.texel(which * triangle_record_texels + 1) * 4;
+    const float *plane = data.triangle_records + data.texel(which * triangle_record_texels + 2) * 4;
+
+    float dz = plane[0] * r.d.x + plane[1] * r.d.y + plane[2] * r.d.z;
+    if(dz == 0) {
+        return false;
+    }
+
+    float d = -(plane[0] * r.o.x + plane[1] * r.o.y + plane[2] * r.o.z + plane[3]) / dz;
+    if(d > hit.t || d < tmin) {
+        return false;
+    }
+
+    float u = u_row[0] * r.o.x + u_row[1] * r.o.y + u_row[2] * r.o.z + u_row[3] +
+        d * (u_row[0] * r.d.x + u_row[1] * r.d.y + u_row[2] * r.d.z);
+    if(u < 0.0 || u > 1.0) {
+        return false;
+    }
+
+    float v = v_row[0] * r.o.x + v_row[1] * r.o.y + v_row[2] * r.o.z + v_row[3] +
+        d * (v_row[0] * r.d.x + v_row[1] * r.d.y + v_row[2] * r.d.z);
+    if(v < 0.0 || u + v > 1.0) {
+        return false;
+    }
+
+    hit.t = d;
+    hit.triangle = which;
+    hit.u = u;
+    hit.v = v;
+    return true;
+}
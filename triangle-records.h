@@ -0,0 +1,47 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include "vectormath.h"
+#include "triangle-set.h"
+#include "wide-bvh.h"
+#include "world.h"
+
+// Precomputed triangle records for the shader, Woop's affine transform
+// of each triangle to the unit triangle, three float4 texels per
+// triangle in place of its three vertex positions:
+//
+//   texel 0: row of the world-to-triangle transform giving u, the
+//            weight of vertex 1
+//   texel 1: the row giving v, the weight of vertex 2
+//   texel 2: the row giving the distance from the triangle's plane
+//
+// Each row is {x, y, z, w} applied as dot(xyz, p) + w, so a test is
+// three dot products for the ray origin and three for its direction
+// instead of Moller-Trumbore's edges and cross products.  Degenerate
+// triangles get all-zero records, which are never hit.
+
+const int triangle_record_texels = 3;
+
+// Fills in the record of triangle "which" at data.texel(which * 3 + k)
+// of data.triangle_records
+void store_triangle_record(const triangle_set& triangles, int which, scene_shader_data& data);
+
+// Same test as triangle_intersect in raytracer.es.fs with
+// TRIANGLE_RECORDS; updates "hit" and returns true if triangle "which"
+// is hit closer than hit.t
+bool triangle_record_intersect(const scene_shader_data& data, int which, const ray& r, float tmin, ray_hit& hit);
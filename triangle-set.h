@@ -68,10 +68,24 @@ struct triangle_set
         int i0 = find_vertex(v0);
         int i1 = find_vertex(v1);
         int i2 = find_vertex(v2);
-        triangles.push_back(indexed_triangle(i0, i1, i2, v0, v1, v2));
-        box.add(triangles[triangles.size() - 1].box);
+        triangles.push_back(indexed_triangle(i0, i1, i2));
+        box.add(v0.v, v1.v, v2.v);
         return triangles.size() - 1;
     }
+
+    box3d bounds(int i) const
+    {
+        const indexed_triangle& t = triangles[i];
+        box3d b;
+        b.add(vertices[t.i[0]].v, vertices[t.i[1]].v, vertices[t.i[2]].v);
+        return b;
+    }
+
+    vec3 barycenter(int i) const
+    {
+        const indexed_triangle& t = triangles[i];
+        return (vertices[t.i[0]].v + vertices[t.i[1]].v + vertices[t.i[2]].v) / 3.0;
+    }
 private:
     int find_vertex(const vertex& v)
     {
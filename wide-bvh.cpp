@@ -0,0 +1,462 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+#include "wide-bvh.h"
+
+namespace
+{
+
+// Per-ray values for the slab tests.  Rays with a negative direction
+// component enter through the max side of the box on that axis.
+struct ray_slabs
+{
+    int near_index[3];
+    float origin[3];
+    float inverse[3];
+
+    ray_slabs(const ray& r)
+    {
+        float d[3] = {r.d.x, r.d.y, r.d.z};
+        float o[3] = {r.o.x, r.o.y, r.o.z};
+        for(int a = 0; a < 3; a++) {
+            near_index[a] = (d[a] < 0) ? 1 : 0;
+            origin[a] = o[a];
+            inverse[a] = 1.0f / d[a];
+        }
+    }
+};
+
+bool box_intersect(const box3d& box, const ray_slabs& s, float tmin, float tmax)
+{
+    const vec3 *bounds[2] = {&box.boxmin, &box.boxmax};
+    for(int a = 0; a < 3; a++) {
+        const float *n = &bounds[s.near_index[a]]->x;
+        const float *f = &bounds[1 - s.near_index[a]]->x;
+        float t0 = (n[a] - s.origin[a]) * s.inverse[a];
+        float t1 = (f[a] - s.origin[a]) * s.inverse[a];
+        tmin = (t0 > tmin) ? t0 : tmin;
+        tmax = (t1 < tmax) ? t1 : tmax;
+    }
+    return tmin <= tmax;
+}
+
+// Slab test every child of "node" at once; returns a bit per child hit
+// within [tmin, tmax] and stores each child's entry distance in "tnear"
+template <int W>
+unsigned int intersect_children(const wide_bvh_node<W>& node, const ray_slabs& s, float tmin, float tmax, float *tnear)
+{
+    unsigned int mask = 0;
+
+#if defined(__SSE2__)
+
+    for(int base = 0; base < W; base += 4) {
+        __m128 t0 = _mm_set1_ps(tmin);
+        __m128 t1 = _mm_set1_ps(tmax);
+        for(int a = 0; a < 3; a++) {
+            __m128 o = _mm_set1_ps(s.origin[a]);
+            __m128 inverse = _mm_set1_ps(s.inverse[a]);
+            __m128 n = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bounds[s.near_index[a]][a][base]), o), inverse);
+            __m128 f = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bounds[1 - s.near_index[a]][a][base]), o), inverse);
+            // NaN (origin on a slab with a zero direction) keeps the old value
+            t0 = _mm_max_ps(n, t0);
+            t1 = _mm_min_ps(f, t1);
+        }
+        _mm_storeu_ps(tnear + base, t0);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << base;
+    }
+
+#else
+
+    for(int i = 0; i < W; i++) {
+        float t0 = tmin;
+        float t1 = tmax;
+        for(int a = 0; a < 3; a++) {
+            float n = (node.bounds[s.near_index[a]][a][i] - s.origin[a]) * s.inverse[a];
+            float f = (node.bounds[1 - s.near_index[a]][a][i] - s.origin[a]) * s.inverse[a];
+            t0 = (n > t0) ? n : t0;
+            t1 = (f < t1) ? f : t1;
+        }
+        tnear[i] = t0;
+        mask |= (t0 <= t1) ? (1u << i) : 0;
+    }
+
+#endif
+
+    return mask;
+}
+
+#if defined(__AVX__)
+
+template <>
+unsigned int intersect_children<8>(const wide_bvh_node<8>& node, const ray_slabs& s, float tmin, float tmax, float *tnear)
+{
+    __m256 t0 = _mm256_set1_ps(tmin);
+    __m256 t1 = _mm256_set1_ps(tmax);
+    for(int a = 0; a < 3; a++) {
+        __m256 o = _mm256_set1_ps(s.origin[a]);
+        __m256 inverse = _mm256_set1_ps(s.inverse[a]);
+        __m256 n = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[s.near_index[a]][a]), o), inverse);
+        __m256 f = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[1 - s.near_index[a]][a]), o), inverse);
+        t0 = _mm256_max_ps(n, t0);
+        t1 = _mm256_min_ps(f, t1);
+    }
+    _mm256_storeu_ps(tnear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+
+#endif
+
+float surface_area(const box3d& box)
+{
+    vec3 d = box.dim();
+    return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+template <int W>
+int collapse(const group_tree& tree, int g, wide_bvh<W>& bvh)
+{
+    int children[W];
+    int child_count = 2;
+    children[0] = tree[g].negative;
+    children[1] = tree[g].positive;
+
+    while(child_count < W) {
+        int largest = -1;
+        float largest_area = -1;
+        for(int i = 0; i < child_count; i++) {
+            if(!tree[children[i]].is_leaf()) {
+                float area = surface_area(tree[children[i]].box);
+                if(area > largest_area) {
+                    largest = i;
+                    largest_area = area;
+                }
+            }
+        }
+        if(largest == -1) {
+            break;
+        }
+        int opened = children[largest];
+        children[largest] = tree[opened].negative;
+        children[child_count++] = tree[opened].positive;
+    }
+
+    int index = bvh.nodes.size();
+    bvh.nodes.push_back(wide_bvh_node<W>());
+
+    wide_bvh_node<W> node;
+    for(int i = 0; i < W; i++) {
+        box3d box;
+        if(i >= child_count) {
+            node.child[i] = -1;
+            node.count[i] = 0;
+        } else if(tree[children[i]].is_leaf()) {
+            box = tree[children[i]].box;
+            node.child[i] = tree[children[i]].start;
+            node.count[i] = tree[children[i]].count;
+        } else {
+            box = tree[children[i]].box;
+            node.child[i] = collapse(tree, children[i], bvh);
+            node.count[i] = 0;
+        }
+        node.bounds[0][0][i] = box.boxmin.x;
+        node.bounds[0][1][i] = box.boxmin.y;
+        node.bounds[0][2][i] = box.boxmin.z;
+        node.bounds[1][0][i] = box.boxmax.x;
+        node.bounds[1][1][i] = box.boxmax.y;
+        node.bounds[1][2][i] = box.boxmax.z;
+    }
+    bvh.nodes[index] = node;
+
+    return index;
+}
+
+}; // unnamed namespace for file scope
+
+bool triangle_intersect(const triangle_set& triangles, int which, const ray& r, float tmin, ray_hit& hit)
+{
+    const indexed_triangle& t = triangles.triangles[which];
+    return triangle_intersect(triangles.vertices[t.i[0]].v, triangles.vertices[t.i[1]].v, triangles.vertices[t.i[2]].v, which, r, tmin, hit);
+}
+
+bool triangle_intersect(const vec3& v0, const vec3& v1, const vec3& v2, int which, const ray& r, float tmin, ray_hit& hit)
+{
+    vec3 e0 = v1 - v0;
+    vec3 e1 = v0 - v2;
+
+    vec3 M = cross(e1, r.d);
+
+    float det = dot(e0, M);
+
+    const float epsilon = 0.0000001;
+    if(det > -epsilon && det < epsilon) {
+        return false;
+    }
+
+    float inv_det = 1.0 / det;
+
+    vec3 T = r.o - v0;
+    vec3 Q = cross(T, e0);
+    float d = -dot(e1, Q) * inv_det;
+    if(d > hit.t || d < tmin) {
+        return false;
+    }
+
+    float u = dot(T, M) * inv_det;
+    if(u < 0.0 || u > 1.0) {
+        return false;
+    }
+
+    float v = dot(r.d, Q) * inv_det;
+    if(v < 0.0 || u + v > 1.0) {
+        return false;
+    }
+
+    hit.t = d;
+    hit.triangle = which;
+    hit.u = u;
+    hit.v = v;
+    return true;
+}
+
+bool group_intersect(const group_tree& tree, const ray& r, float tmin, ray_hit& hit)
+{
+    ray_slabs s(r);
+    const float d[3] = {r.d.x, r.d.y, r.d.z};
+    // Kept per thread and grown as deep trees need, with no depth limit
+    static thread_local std::vector<int> stack;
+    bool found = false;
+
+    stack.clear();
+    stack.push_back(tree.root);
+    while(!stack.empty()) {
+        const group& g = tree[stack.back()];
+        stack.pop_back();
+        if(!box_intersect(g.box, s, tmin, hit.t)) {
+            continue;
+        }
+        if(g.is_leaf()) {
+            for(unsigned int i = 0; i < g.count; i++) {
+                found |= triangle_intersect(*tree.triangles, g.start + i, r, tmin, hit);
+            }
+        } else {
+            // Visit the child nearer along the split axis first, same
+            // as create_hitmiss orders them
+            if(d[g.axis] < 0) {
+                stack.push_back(g.negative);
+                stack.push_back(g.positive);
+            } else {
+                stack.push_back(g.positive);
+                stack.push_back(g.negative);
+            }
+        }
+    }
+
+    return found;
+}
+
+bool instance_intersect(const group_tree& instance_tree, const std::vector<instance>& instances, const std::vector<group_tree*>& meshes, const ray& r, float tmin, ray_hit& hit)
+{
+    ray_slabs s(r);
+    const float d[3] = {r.d.x, r.d.y, r.d.z};
+    static thread_local std::vector<int> stack;
+    bool found = false;
+
+    stack.clear();
+    stack.push_back(instance_tree.root);
+    while(!stack.empty()) {
+        const group& g = instance_tree[stack.back()];
+        stack.pop_back();
+        if(!box_intersect(g.box, s, tmin, hit.t)) {
+            continue;
+        }
+        if(g.is_leaf()) {
+            for(unsigned int i = 0; i < g.count; i++) {
+                const instance& inst = instances[g.start + i];
+                if(group_intersect(*meshes[inst.mesh], transform_ray(inst, r), tmin, hit)) {
+                    hit.instance = g.start + i;
+                    found = true;
+                }
+            }
+        } else {
+            if(d[g.axis] < 0) {
+                stack.push_back(g.negative);
+                stack.push_back(g.positive);
+            } else {
+                stack.push_back(g.positive);
+                stack.push_back(g.negative);
+            }
+        }
+    }
+
+    return found;
+}
+
+void measure_intersection_costs(const group_tree& tree, const std::vector<ray>& rays, double& box_seconds, double& triangle_seconds)
+{
+    // Each ray is tested against the same pseudo-random sample of boxes
+    // and triangles, so both loops see similar cache behavior
+    const int sample_count = 4096;
+    unsigned int seed = 1;
+    std::vector<int> boxes(sample_count);
+    std::vector<int> triangles(sample_count);
+    for(int i = 0; i < sample_count; i++) {
+        seed = seed * 1664525 + 1013904223;
+        boxes[i] = (seed >> 8) % tree.size();
+        seed = seed * 1664525 + 1013904223;
+        triangles[i] = (seed >> 8) % tree.triangles->triangles.size();
+    }
+
+    int box_hits = 0;
+    auto then = std::chrono::system_clock::now();
+    for(const ray& r : rays) {
+        ray_slabs s(r);
+        for(int b : boxes) {
+            box_hits += box_intersect(tree[b].box, s, 0, std::numeric_limits<float>::max()) ? 1 : 0;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - then;
+    box_seconds = elapsed.count() / (rays.size() * sample_count);
+
+    int triangle_hits = 0;
+    then = std::chrono::system_clock::now();
+    for(const ray& r : rays) {
+        ray_hit hit;
+        for(int t : triangles) {
+            triangle_hits += triangle_intersect(*tree.triangles, t, r, 0, hit) ? 1 : 0;
+        }
+    }
+    elapsed = std::chrono::system_clock::now() - then;
+    triangle_seconds = elapsed.count() / (rays.size() * sample_count);
+
+    // Keeps the loops from being optimized away
+    fprintf(stderr, "cost measurement: %d box hits, %d triangle hits\n", box_hits, triangle_hits);
+}
+
+template <int W>
+bool wide_bvh<W>::intersect(const ray& r, float tmin, ray_hit& hit) const
+{
+    struct entry
+    {
+        int node;
+        float t;
+    };
+
+    ray_slabs s(r);
+    static thread_local std::vector<entry> stack;
+    bool found = false;
+
+    stack.clear();
+    stack.push_back(entry{0, tmin});
+    while(!stack.empty()) {
+        entry e = stack.back();
+        stack.pop_back();
+        if(e.t > hit.t) {
+            continue;
+        }
+
+        const wide_bvh_node<W>& node = nodes[e.node];
+        float tnear[W];
+        unsigned int mask = intersect_children<W>(node, s, tmin, hit.t, tnear);
+
+        entry inner[W];
+        int inner_count = 0;
+        while(mask != 0) {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if(node.count[i] > 0) {
+                for(unsigned int j = 0; j < node.count[i]; j++) {
+                    found |= triangle_intersect(*triangles, node.child[i] + j, r, tmin, hit);
+                }
+            } else {
+                inner[inner_count++] = entry{node.child[i], tnear[i]};
+            }
+        }
+
+        // Push farthest first so the nearest child is traversed next
+        for(int i = 1; i < inner_count; i++) {
+            entry x = inner[i];
+            int j = i;
+            for(; j > 0 && inner[j - 1].t < x.t; j--) {
+                inner[j] = inner[j - 1];
+            }
+            inner[j] = x;
+        }
+        for(int i = 0; i < inner_count; i++) {
+            if(inner[i].t <= hit.t) {
+                stack.push_back(inner[i]);
+            }
+        }
+    }
+
+    return found;
+}
+
+template <int W>
+wide_bvh<W> *make_wide_bvh(const group_tree& tree)
+{
+    wide_bvh<W> *bvh = new wide_bvh<W>;
+    bvh->triangles = tree.triangles;
+
+    const group& root = tree[tree.root];
+    if(!root.is_leaf()) {
+        collapse(tree, tree.root, *bvh);
+    } else {
+        // A lone leaf still needs a node to hang from
+        wide_bvh_node<W> node;
+        for(int i = 0; i < W; i++) {
+            box3d box;
+            node.child[i] = -1;
+            node.count[i] = 0;
+            if(i == 0) {
+                box = root.box;
+                node.child[i] = root.start;
+                node.count[i] = root.count;
+            }
+            node.bounds[0][0][i] = box.boxmin.x;
+            node.bounds[0][1][i] = box.boxmin.y;
+            node.bounds[0][2][i] = box.boxmin.z;
+            node.bounds[1][0][i] = box.boxmax.x;
+            node.bounds[1][1][i] = box.boxmax.y;
+            node.bounds[1][2][i] = box.boxmax.z;
+        }
+        bvh->nodes.push_back(node);
+    }
+
+    int used = 0;
+    for(auto& n : bvh->nodes) {
+        for(int i = 0; i < W; i++) {
+            used += (n.child[i] != -1) ? 1 : 0;
+        }
+    }
+    fprintf(stderr, "BVH%d: %zd nodes, %.2f children per node, %zd bytes\n", W, bvh->nodes.size(), used * 1.0 / bvh->nodes.size(), bvh->nodes.size() * sizeof(wide_bvh_node<W>));
+
+    return bvh;
+}
+
+template struct wide_bvh<4>;
+template struct wide_bvh<8>;
+template wide_bvh<4> *make_wide_bvh<4>(const group_tree& tree);
+template wide_bvh<8> *make_wide_bvh<8>(const group_tree& tree);
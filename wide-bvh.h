@@ -0,0 +1,88 @@
+/*
+   Copyright 2018 Brad Grantham.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "vectormath.h"
+#include "triangle-set.h"
+#include "group.h"
+#include "instance.h"
+
+// Closest hit found so far by a CPU ray query
+struct ray_hit
+{
+    float t;
+    int triangle; // -1 if nothing was hit
+    int instance; // -1 unless traced through instances
+    float u, v;
+
+    ray_hit() :
+        t(std::numeric_limits<float>::max()),
+        triangle(-1),
+        instance(-1),
+        u(0),
+        v(0)
+    {}
+};
+
+// Same test as triangle_intersect in raytracer.es.fs; updates "hit" and
+// returns true if triangle "which" is hit closer than hit.t
+bool triangle_intersect(const triangle_set& triangles, int which, const ray& r, float tmin, ray_hit& hit);
+
+// Same, for triangle "which" with vertices already looked up
+bool triangle_intersect(const vec3& v0, const vec3& v1, const vec3& v2, int which, const ray& r, float tmin, ray_hit& hit);
+
+// Closest hit through the binary group tree, the reference for the
+// wide traversal
+bool group_intersect(const group_tree& tree, const ray& r, float tmin, ray_hit& hit);
+
+// Closest hit through the instance tree, tracing the ray through each
+// instance's mesh in that mesh's space
+bool instance_intersect(const group_tree& instance_tree, const std::vector<instance>& instances, const std::vector<group_tree*>& meshes, const ray& r, float tmin, ray_hit& hit);
+
+// Average seconds for one slab test of a node of "tree" and for one
+// triangle test, each over every ray in "rays"
+void measure_intersection_costs(const group_tree& tree, const std::vector<ray>& rays, double& box_seconds, double& triangle_seconds);
+
+// One node of a BVH with "W" children per node, bounds stored by
+// component so all children are slab tested at once.  A child with
+// count == 0 is an inner node at nodes[child], one with count > 0 is a
+// leaf of triangles [child, child + count), and an unused slot has
+// child == -1 and an empty box.
+template <int W>
+struct wide_bvh_node
+{
+    float bounds[2][3][W]; // [0] is min, [1] is max; then x, y, z
+    int32_t child[W];
+    uint32_t count[W];
+};
+
+template <int W>
+struct wide_bvh
+{
+    triangle_set_ptr triangles;
+    std::vector<wide_bvh_node<W>> nodes; // nodes[0] is the root
+
+    bool intersect(const ray& r, float tmin, ray_hit& hit) const;
+};
+
+// Collapse the binary tree into a BVH4 or BVH8, opening the child with
+// the largest surface area until each node is full
+template <int W>
+wide_bvh<W> *make_wide_bvh(const group_tree& tree);
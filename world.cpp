@@ -27,12 +27,22 @@
 #include <cstdio>
 #include <cassert>
 #include <cstdint>
+#include <sys/mman.h>
 #include "triangle-set.h"
 #include "geometry.h"
 #include "obj-support.h"
 #include "trisrc-support.h"
 #include "group.h"
 #include "bvh.h"
+#include "bvh-cache.h"
+#include "task-pool.h"
+#include "wide-bvh.h"
+#include "compressed-bvh.h"
+#include "packed-bvh.h"
+#include "stackless-bvh.h"
+#include "closest-first-bvh.h"
+#include "triangle-records.h"
+#include "compact-vertices.h"
 #include "world.h"
 
 struct scoped_FILE
@@ -43,31 +53,339 @@ struct scoped_FILE
     operator FILE*() { return fp; }
 };
 
-world_ptr load_world(const std::string& filename) // Get world and return pointer.
+// Build with every builder on a copy of the triangles and report time
+// and SAH cost, without touching the world's own tree
+void compare_bvh_builders(world_ptr w)
 {
-    auto w = std::make_shared<world>();
-    w->triangles = std::make_shared<triangle_set>();
+    for(const char *builder : {"sah", "sbvh", "lbvh", "hlbvh"}) {
+        auto triangles = std::make_shared<triangle_set>();
+        triangles->vertices = w->triangles->vertices;
+        triangles->triangles = w->triangles->triangles;
+        triangles->box = w->triangles->box;
+
+        auto then = std::chrono::system_clock::now();
+        group_tree *tree = make_bvh(triangles, 0, triangles->triangles.size(), builder);
+        auto now = std::chrono::system_clock::now();
+        std::chrono::duration<float> elapsed = now - then;
+
+        fprintf(stderr, "BVH (%s): %f seconds, SAH cost %f\n", builder, elapsed.count(), get_bvh_sah_cost(*tree));
+        delete tree;
+    }
+}
+
+// Fixed pseudo-random rays from a sphere around the scene toward points
+// inside its bounds, the same set on every run
+void make_benchmark_rays(world_ptr w, int count, std::vector<ray>& rays)
+{
+    unsigned int seed = 1;
+    auto random_unit = [&seed]() {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) / 16777216.0f;
+    };
+
+    const box3d& box = (w->instance_tree != nullptr) ? (*w->instance_tree)[w->instance_tree->root].box : w->triangles->box;
+    vec3 dim = box.dim();
+    rays.resize(count);
+    for(int i = 0; i < count; i++) {
+        vec3 on_sphere;
+        do {
+            on_sphere = vec3(random_unit(), random_unit(), random_unit()) * 2 - vec3(1);
+        } while(dot(on_sphere, on_sphere) > 1 || dot(on_sphere, on_sphere) < .01);
+        vec3 target = box.boxmin + dim * vec3(random_unit(), random_unit(), random_unit());
+        rays[i].o = w->scene_center + normalize(on_sphere) * w->scene_extent;
+        rays[i].d = normalize(target - rays[i].o);
+    }
+}
+
+// Trace the benchmark rays through the binary tree, BVH4, BVH8, and
+// with BVH_COMPRESSED_NODES, BVH_PACKED_NODES, BVH_STACKLESS_NODES, or
+// BVH_CLOSEST_FIRST the shader nodes, checking each against the binary
+// tree.  With BVH_TRIANGLE_RECORDS or BVH_COMPACT_VERTICES, also time
+// leaf tests with vertices against the same tests with triangle records
+// or compact positions.
+void benchmark_cpu_traversal(world_ptr w)
+{
+    const int ray_count = 1000000;
+    std::vector<ray> rays;
+    make_benchmark_rays(w, ray_count, rays);
+
+    std::vector<ray_hit> reference(ray_count);
+    auto then = std::chrono::system_clock::now();
+    for(int i = 0; i < ray_count; i++) {
+        group_intersect(*w->tree, rays[i], 0, reference[i]);
+    }
+    std::chrono::duration<float> elapsed = std::chrono::system_clock::now() - then;
+    fprintf(stderr, "binary BVH: %.2f Mrays/second\n", ray_count / elapsed.count() / 1e6);
+
+    auto check = [&](const char *name, float seconds, const std::vector<ray_hit>& hits) {
+        int mismatches = 0;
+        for(int i = 0; i < ray_count; i++) {
+            if(hits[i].triangle != reference[i].triangle && hits[i].t != reference[i].t) {
+                mismatches++;
+            }
+        }
+        fprintf(stderr, "%s: %.2f Mrays/second, %d mismatches\n", name, ray_count / seconds / 1e6, mismatches);
+    };
+
+    std::unique_ptr<wide_bvh<4>> bvh4(make_wide_bvh<4>(*w->tree));
+    std::vector<ray_hit> hits(ray_count);
+    then = std::chrono::system_clock::now();
+    for(int i = 0; i < ray_count; i++) {
+        bvh4->intersect(rays[i], 0, hits[i]);
+    }
+    elapsed = std::chrono::system_clock::now() - then;
+    check("BVH4", elapsed.count(), hits);
 
+    std::unique_ptr<wide_bvh<8>> bvh8(make_wide_bvh<8>(*w->tree));
+    hits.assign(ray_count, ray_hit());
+    then = std::chrono::system_clock::now();
+    for(int i = 0; i < ray_count; i++) {
+        bvh8->intersect(rays[i], 0, hits[i]);
+    }
+    elapsed = std::chrono::system_clock::now() - then;
+    check("BVH8", elapsed.count(), hits);
+
+    // Where the shader's node fetches land in its data textures
+    for(unsigned int tile_size : {8, 16}) {
+        const unsigned int data_texture_width = 2048;
+        std::vector<ray> locality_rays(rays.begin(), rays.begin() + 100000);
+        bool tiled = (getenv("BVH_TILED_TEXELS") != nullptr);
+        bvh_locality l = measure_bvh_locality(*w->tree, locality_rays, data_texture_width, tiled, tile_size);
+        fprintf(stderr, "node layout %s%s, %ux%u tiles: %.1f fetches and %.1f tiles per ray, %.2f of fetches in the previous fetch's tile\n",
+            get_bvh_layout_name(), tiled ? " (tiled texels)" : "", tile_size, tile_size, l.fetches_per_ray, l.tiles_per_ray, l.same_tile_fraction);
+    }
+
+    if(getenv("BVH_COMPRESSED_NODES") != nullptr || getenv("BVH_PACKED_NODES") != nullptr || getenv("BVH_STACKLESS_NODES") != nullptr ||
+        getenv("BVH_CLOSEST_FIRST") != nullptr || getenv("BVH_TRIANGLE_RECORDS") != nullptr || getenv("BVH_COMPACT_VERTICES") != nullptr) {
+        const unsigned int data_texture_width = 2048;
+        scene_shader_data data;
+        get_shader_data(w, data, data_texture_width, 0);
+        if(data.compressed_nodes) {
+            hits.assign(ray_count, ray_hit());
+            then = std::chrono::system_clock::now();
+            for(int i = 0; i < ray_count; i++) {
+                compressed_bvh_intersect(data, data_texture_width, *w->triangles, rays[i], 0, hits[i]);
+            }
+            elapsed = std::chrono::system_clock::now() - then;
+            check("compressed nodes", elapsed.count(), hits);
+        }
+        if(data.packed_nodes) {
+            hits.assign(ray_count, ray_hit());
+            then = std::chrono::system_clock::now();
+            for(int i = 0; i < ray_count; i++) {
+                packed_bvh_intersect(data, *w->triangles, rays[i], 0, hits[i]);
+            }
+            elapsed = std::chrono::system_clock::now() - then;
+            check("packed nodes", elapsed.count(), hits);
+        }
+        if(data.stackless_nodes) {
+            hits.assign(ray_count, ray_hit());
+            then = std::chrono::system_clock::now();
+            for(int i = 0; i < ray_count; i++) {
+                stackless_bvh_intersect(data, *w->triangles, rays[i], 0, hits[i]);
+            }
+            elapsed = std::chrono::system_clock::now() - then;
+            check("stackless nodes", elapsed.count(), hits);
+        }
+        if(data.closest_first) {
+            hits.assign(ray_count, ray_hit());
+            then = std::chrono::system_clock::now();
+            for(int i = 0; i < ray_count; i++) {
+                closest_first_bvh_intersect(data, *w->triangles, rays[i], 0, hits[i]);
+            }
+            elapsed = std::chrono::system_clock::now() - then;
+            check("closest-first", elapsed.count(), hits);
+        }
+        if(data.precomputed_triangles || data.compact_positions != nullptr) {
+            // Each ray against the triangle it hits and its neighbors,
+            // which mostly share its leaf and mostly miss
+            const int neighbors = 4;
+            int triangle_count = w->triangles->triangles.size();
+            std::vector<std::pair<int, int>> tests;
+            for(int i = 0; i < ray_count; i++) {
+                if(reference[i].triangle >= 0) {
+                    int first = std::max(0, reference[i].triangle - neighbors);
+                    int last = std::min(triangle_count, reference[i].triangle + neighbors);
+                    for(int t = first; t < last; t++) {
+                        tests.push_back(std::make_pair(i, t));
+                    }
+                }
+            }
+
+            std::vector<ray_hit> vertex_hits(tests.size());
+            then = std::chrono::system_clock::now();
+            for(size_t i = 0; i < tests.size(); i++) {
+                triangle_intersect(*w->triangles, tests[i].second, rays[tests[i].first], 0, vertex_hits[i]);
+            }
+            std::chrono::duration<float> vertex_elapsed = std::chrono::system_clock::now() - then;
+
+            fprintf(stderr, "triangle tests with vertices: %.2f M/second\n", tests.size() / vertex_elapsed.count() / 1e6);
+
+            auto check_tests = [&](const char *name, float seconds, const std::vector<ray_hit>& test_hits) {
+                int mismatches = 0;
+                for(size_t i = 0; i < tests.size(); i++) {
+                    if(vertex_hits[i].triangle != test_hits[i].triangle ||
+                        fabsf(vertex_hits[i].t - test_hits[i].t) > 1e-4f * vertex_hits[i].t) {
+                        mismatches++;
+                    }
+                }
+                fprintf(stderr, "triangle tests with %s: %.2f M/second, %d of %zd mismatches\n",
+                    name, tests.size() / seconds / 1e6, mismatches, tests.size());
+            };
+
+            std::vector<ray_hit> test_hits(tests.size());
+            if(data.precomputed_triangles) {
+                then = std::chrono::system_clock::now();
+                for(size_t i = 0; i < tests.size(); i++) {
+                    triangle_record_intersect(data, tests[i].second, rays[tests[i].first], 0, test_hits[i]);
+                }
+                elapsed = std::chrono::system_clock::now() - then;
+                check_tests("records", elapsed.count(), test_hits);
+            } else {
+                std::vector<box3d> frames(triangle_count, w->triangles->box);
+                get_leaf_frames(*w->tree, 0, data, frames);
+                then = std::chrono::system_clock::now();
+                for(size_t i = 0; i < tests.size(); i++) {
+                    compact_triangle_intersect(data, frames[tests[i].second], tests[i].second, rays[tests[i].first], 0, test_hits[i]);
+                }
+                elapsed = std::chrono::system_clock::now() - then;
+                check_tests("compact positions", elapsed.count(), test_hits);
+            }
+        }
+    }
+}
+
+// Leaves bigger than this lose triangles in the shader; max_leaf_tests
+// in raytracer.es.fs.  Trees are built with it as their leaf cap.
+const unsigned int shader_max_leaf_tests = 10;
+
+// Measure the cost of a triangle test relative to a node test on this
+// machine for the SAH constants, then sweep leaf size and depth limits
+// and keep the pair whose tree traces the benchmark rays fastest.  The
+// result becomes the current parameters and is written to "profile".
+void calibrate_bvh_parameters(world_ptr w, const char *profile)
+{
+    const int cost_ray_count = 1000;
+    const int sweep_ray_count = 50000;
+    const int sweep_pass_count = 3;
+    const unsigned int leaf_max_candidates[] = {1, 2, 3, 4, 6, 8, 10};
+    // Deeper limits would let trees outgrow the compressed and
+    // closest-first traversal stacks wherever the profile is used
+    const int max_depth_candidates[] = {20, 30, 40};
+
+    std::vector<ray> rays;
+    make_benchmark_rays(w, sweep_ray_count, rays);
+
+    auto copy_triangles = [&w]() {
+        auto triangles = std::make_shared<triangle_set>();
+        triangles->vertices = w->triangles->vertices;
+        triangles->triangles = w->triangles->triangles;
+        triangles->box = w->triangles->box;
+        return triangles;
+    };
+
+    bvh_parameters params = get_bvh_parameters();
+    {
+        std::unique_ptr<group_tree> tree(make_bvh(copy_triangles(), 0, w->triangle_count));
+        std::vector<ray> cost_rays(rays.begin(), rays.begin() + cost_ray_count);
+        double box_seconds, triangle_seconds;
+        measure_intersection_costs(*tree, cost_rays, box_seconds, triangle_seconds);
+        params.sah_ctrav = 1;
+        params.sah_cisec = triangle_seconds / box_seconds;
+        fprintf(stderr, "calibration: %.2f ns per node test, %.2f ns per triangle test, SAH intersection cost %f\n",
+            box_seconds * 1e9, triangle_seconds * 1e9, params.sah_cisec);
+    }
+
+    // The leaf cap keeps every configuration within the shader's limit,
+    // so they only compete on speed
+    float best_seconds = std::numeric_limits<float>::max();
+    bvh_parameters best = params;
+    for(int max_depth : max_depth_candidates) {
+        for(unsigned int leaf_max : leaf_max_candidates) {
+            params.leaf_max = leaf_max;
+            params.max_depth = max_depth;
+            set_bvh_parameters(params);
+            std::unique_ptr<group_tree> tree(make_bvh(copy_triangles(), 0, w->triangle_count));
+
+            // Fastest of a few passes, to ride out other load
+            float seconds = std::numeric_limits<float>::max();
+            for(int pass = 0; pass < sweep_pass_count; pass++) {
+                auto then = std::chrono::system_clock::now();
+                for(const ray& r : rays) {
+                    ray_hit hit;
+                    group_intersect(*tree, r, 0, hit);
+                }
+                std::chrono::duration<float> elapsed = std::chrono::system_clock::now() - then;
+                seconds = std::min(seconds, elapsed.count());
+            }
+            fprintf(stderr, "calibration: leaf max %2u, max depth %2d: %.2f Mrays/second, SAH cost %f\n",
+                leaf_max, max_depth, sweep_ray_count / seconds / 1e6, get_bvh_sah_cost(*tree));
+
+            if(seconds < best_seconds) {
+                best_seconds = seconds;
+                best = params;
+            }
+        }
+    }
+
+    set_bvh_parameters(best);
+    fprintf(stderr, "calibration: chose leaf max %u, max depth %d\n", best.leaf_max, best.max_depth);
+    if(save_bvh_profile(profile, best)) {
+        fprintf(stderr, "calibration: wrote BVH profile \"%s\"\n", profile);
+    }
+}
+
+// Trace a sample of the benchmark rays through the instance tree,
+// checking each against testing every instance
+void benchmark_instance_traversal(world_ptr w)
+{
+    const int ray_count = 1000000;
+    const int checked_ray_count = 10000;
+    std::vector<ray> rays;
+    make_benchmark_rays(w, ray_count, rays);
+
+    std::vector<ray_hit> hits(ray_count);
+    auto then = std::chrono::system_clock::now();
+    for(int i = 0; i < ray_count; i++) {
+        instance_intersect(*w->instance_tree, w->instances, w->meshes, rays[i], 0, hits[i]);
+    }
+    std::chrono::duration<float> elapsed = std::chrono::system_clock::now() - then;
+
+    int mismatches = 0;
+    for(int i = 0; i < checked_ray_count; i++) {
+        ray_hit reference;
+        for(size_t j = 0; j < w->instances.size(); j++) {
+            const instance& inst = w->instances[j];
+            group_intersect(*w->meshes[inst.mesh], transform_ray(inst, rays[i]), 0, reference);
+        }
+        if(hits[i].triangle != reference.triangle && hits[i].t != reference.t) {
+            mismatches++;
+        }
+    }
+    fprintf(stderr, "instanced BVH: %.2f Mrays/second, %d mismatches in %d rays\n", ray_count / elapsed.count() / 1e6, mismatches, checked_ray_count);
+}
+
+// Appends the triangles in an .obj or .trisrc file to "triangles"
+bool load_triangles(const std::string& filename, triangle_set_ptr triangles)
+{
     int index = filename.find_last_of(".");
     std::string extension = filename.substr(index + 1);
 
     bool success = false;
 
-    auto then = std::chrono::system_clock::now();
-
     if(extension == "trisrc") {
 
         scoped_FILE fp(fopen(filename.c_str(), "r"));
         if(fp == nullptr) {
             std::cerr << "Cannot open \"" << filename << "\" for input, errno " << errno << "\n";
-            return nullptr;
+            return false;
         }
 
-        success = ParseTriSrc(fp, w->triangles);
+        success = ParseTriSrc(fp, triangles);
 
         if(!success) {
             fprintf(stderr, "Couldn't parse triangles from file.\n");
-            return nullptr;
+            return false;
         }
 
     } else if(extension == "obj") {
@@ -76,22 +394,224 @@ world_ptr load_world(const std::string& filename) // Get world and return pointe
         if (!obj.load_object_from_file(filename))
         {
             std::cerr << "Cannot open \"" << filename << "\" for input, errno " << errno << "\n";
-            return nullptr;
+            return false;
         }
-        success = obj.fill_triangle_set(w->triangles);
+        success = obj.fill_triangle_set(triangles);
 
         if(!success) {
             fprintf(stderr, "Couldn't parse triangles from file.\n");
-            return nullptr;
+            return false;
         }
 
     } else {
 
         std::cerr << "This program doesn't know how to load a file with extension " + extension << "\n";
-        return nullptr;
+        return false;
 
     }
 
+    return true;
+}
+
+// Triangles [start, start + count) of world::triangles, from one file
+struct mesh_range
+{
+    int start;
+    int count;
+};
+
+struct instance_placement
+{
+    int mesh;
+    float matrix[16];
+};
+
+// An .instances file has one statement per line, and "#" starts a
+// comment line:
+//
+//   mesh <name> <file.obj or file.trisrc>
+//   instance <name> <x> <y> <z>
+//   instance <name> <3 rows of 4 floats, mesh space to scene space>
+//
+// Mesh files are relative to the .instances file.
+bool load_instances(const std::string& filename, triangle_set_ptr triangles, std::vector<mesh_range>& meshes, std::vector<instance_placement>& placements)
+{
+    scoped_FILE fp(fopen(filename.c_str(), "r"));
+    if(fp == nullptr) {
+        std::cerr << "Cannot open \"" << filename << "\" for input, errno " << errno << "\n";
+        return false;
+    }
+
+    std::string directory;
+    size_t slash = filename.find_last_of("/");
+    if(slash != std::string::npos) {
+        directory = filename.substr(0, slash + 1);
+    }
+
+    std::map<std::string, int> mesh_names;
+    char line[2048];
+    int line_number = 0;
+    while(fgets(line, sizeof(line), fp) != nullptr) {
+        line_number++;
+
+        char keyword[64];
+        char name[256];
+        char file[1024];
+        int consumed;
+
+        if(sscanf(line, "%63s", keyword) != 1 || keyword[0] == '#') {
+            continue;
+        }
+
+        if(strcmp(keyword, "mesh") == 0) {
+
+            if(sscanf(line, "%*s %255s %1023s", name, file) != 2) {
+                fprintf(stderr, "%s:%d: expected \"mesh name file\"\n", filename.c_str(), line_number);
+                return false;
+            }
+            std::string mesh_file = (file[0] == '/') ? file : directory + file;
+            mesh_range mesh;
+            mesh.start = triangles->triangles.size();
+            if(!load_triangles(mesh_file, triangles)) {
+                return false;
+            }
+            mesh.count = triangles->triangles.size() - mesh.start;
+            if(mesh.count == 0) {
+                fprintf(stderr, "%s:%d: mesh \"%s\" has no triangles\n", filename.c_str(), line_number, name);
+                return false;
+            }
+            mesh_names[name] = meshes.size();
+            meshes.push_back(mesh);
+
+        } else if(strcmp(keyword, "instance") == 0) {
+
+            float f[12];
+            int count = 0;
+            if(sscanf(line, "%*s %255s%n", name, &consumed) == 1) {
+                count = sscanf(line + consumed, "%f %f %f %f %f %f %f %f %f %f %f %f",
+                    &f[0], &f[1], &f[2], &f[3], &f[4], &f[5],
+                    &f[6], &f[7], &f[8], &f[9], &f[10], &f[11]);
+            }
+            auto found = mesh_names.find(name);
+            if(found == mesh_names.end()) {
+                fprintf(stderr, "%s:%d: no mesh named \"%s\"\n", filename.c_str(), line_number, name);
+                return false;
+            }
+
+            instance_placement placement;
+            placement.mesh = found->second;
+            if(count == 3) {
+                mat4_make_translation(f[0], f[1], f[2], placement.matrix);
+            } else if(count == 12) {
+                mat4_make_identity(placement.matrix);
+                for(int row = 0; row < 3; row++) {
+                    for(int column = 0; column < 4; column++) {
+                        placement.matrix[column * 4 + row] = f[row * 4 + column];
+                    }
+                }
+            } else {
+                fprintf(stderr, "%s:%d: expected a translation or a 3x4 matrix\n", filename.c_str(), line_number);
+                return false;
+            }
+            placements.push_back(placement);
+
+        } else {
+
+            fprintf(stderr, "%s:%d: unknown statement \"%s\"\n", filename.c_str(), line_number, keyword);
+            return false;
+        }
+    }
+
+    if(placements.empty()) {
+        fprintf(stderr, "%s: no instances\n", filename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Build a tree for each mesh and one over the instances of them
+world_ptr finish_instanced_world(world_ptr w, const std::vector<mesh_range>& meshes, const std::vector<instance_placement>& placements)
+{
+    auto then = std::chrono::system_clock::now();
+
+    // SBVH replaces a mesh's triangles with its references, so every
+    // later mesh moves by however many that added
+    int added = 0;
+    for(auto& m : meshes) {
+        size_t before = w->triangles->triangles.size();
+        group_tree *tree = make_bvh(w->triangles, m.start + added, m.count);
+        added += w->triangles->triangles.size() - before;
+        fprintf(stderr, "mesh BVH (%s): %d triangles, SAH cost %f\n", get_bvh_builder_name(), m.count, get_bvh_sah_cost(*tree));
+        layout_bvh(*tree);
+        w->meshes.push_back(tree);
+    }
+
+    auto now = std::chrono::system_clock::now();
+    std::chrono::duration<float> elapsed = now - then;
+    fprintf(stderr, "BVH: %f seconds for %zd meshes\n", elapsed.count(), meshes.size());
+
+    long long instanced_triangles = 0;
+    for(auto& p : placements) {
+        const group_tree& mesh = *w->meshes[p.mesh];
+        w->instances.push_back(instance(p.mesh, p.matrix, mesh[mesh.root].box));
+        instanced_triangles += meshes[p.mesh].count;
+    }
+    fprintf(stderr, "%zd instances of %zd meshes, %lld triangles in the scene\n", w->instances.size(), meshes.size(), instanced_triangles);
+
+    w->instance_tree = make_instance_bvh(w->instances);
+    layout_bvh(*w->instance_tree);
+
+    const box3d& box = (*w->instance_tree)[w->instance_tree->root].box;
+    vec3 dim = box.dim();
+    w->scene_center = box.center();
+    w->scene_extent = sqrtf(dot(dim, dim));
+
+    if(getenv("BVH_BENCHMARK_CPU") != nullptr) {
+        benchmark_instance_traversal(w);
+    }
+
+    return w;
+}
+
+world_ptr load_world(const std::string& filename) // Get world and return pointer.
+{
+    auto w = std::make_shared<world>();
+    w->triangles = std::make_shared<triangle_set>();
+    w->filename = filename;
+
+    int index = filename.find_last_of(".");
+    std::string extension = filename.substr(index + 1);
+
+    std::vector<mesh_range> meshes;
+    std::vector<instance_placement> placements;
+
+    // The shader only tests this many triangles per leaf
+    bvh_parameters params = get_bvh_parameters();
+    params.leaf_cap = shader_max_leaf_tests;
+    set_bvh_parameters(params);
+
+    // A cached tree comes with its triangles, so the file isn't parsed
+    uint64_t cache_key = 0;
+    group_tree *cached_tree = nullptr;
+
+    auto then = std::chrono::system_clock::now();
+
+    if(extension == "instances") {
+        if(!load_instances(filename, w->triangles, meshes, placements)) {
+            return nullptr;
+        }
+    } else {
+        // Calibration changes the parameters the key depends on
+        if(bvh_cache_enabled() && getenv("BVH_CALIBRATE") == nullptr) {
+            cache_key = get_bvh_cache_key(filename);
+            cached_tree = load_bvh_cache(cache_key, w->triangles);
+        }
+        if(cached_tree == nullptr && !load_triangles(filename, w->triangles)) {
+            return nullptr;
+        }
+    }
+
     auto now = std::chrono::system_clock::now();
     std::chrono::duration<float> elapsed = now - then;
     fprintf(stderr, "Parsing: %f seconds\n", elapsed.count());
@@ -101,6 +621,10 @@ world_ptr load_world(const std::string& filename) // Get world and return pointe
     fprintf(stderr, "%zd independent vertices.\n", w->triangles->vertices.size());
     fprintf(stderr, "%.2f vertices per triangle.\n", w->triangles->vertices.size() * 1.0 / w->triangle_count);
 
+    if(!placements.empty()) {
+        return finish_instanced_world(w, meshes, placements);
+    }
+
     then = std::chrono::system_clock::now();
 
     w->scene_center = w->triangles->box.center();
@@ -120,92 +644,172 @@ world_ptr load_world(const std::string& filename) // Get world and return pointe
     elapsed = now - then;
     fprintf(stderr, "Finding scene center and extent: %f seconds\n", elapsed.count());
 
-    then = std::chrono::system_clock::now();
-    w->root = make_bvh(w->triangles, 0, w->triangle_count);
+    if(cached_tree == nullptr && getenv("BVH_CALIBRATE") != nullptr) {
+        calibrate_bvh_parameters(w, getenv("BVH_CALIBRATE"));
+    }
 
-    now = std::chrono::system_clock::now();
-    elapsed = now - then;
+    if(cached_tree != nullptr) {
+        w->tree = cached_tree;
+        fprintf(stderr, "BVH (%s) SAH cost: %f\n", get_bvh_builder_name(), get_bvh_sah_cost(*w->tree));
+    } else {
+        then = std::chrono::system_clock::now();
+        w->tree = make_bvh(w->triangles, 0, w->triangle_count);
+
+        now = std::chrono::system_clock::now();
+        elapsed = now - then;
+
+        fprintf(stderr, "BVH: %f seconds\n", elapsed.count());
+        fprintf(stderr, "BVH (%s) SAH cost: %f\n", get_bvh_builder_name(), get_bvh_sah_cost(*w->tree));
 
-    fprintf(stderr, "BVH: %f seconds\n", elapsed.count());
+        print_bvh_stats();
 
-    print_bvh_stats();
+        save_bvh_cache(cache_key, *w->tree);
+    }
+
+    // After caching, so cached trees don't depend on the layout
+    layout_bvh(*w->tree);
+
+    if(getenv("BVH_COMPARE_BUILDERS") != nullptr) {
+        compare_bvh_builders(w);
+    }
+
+    if(getenv("BVH_BENCHMARK_CPU") != nullptr) {
+        benchmark_cpu_traversal(w);
+    }
 
     return w;
 }
 
-int get_node_count(group *g)
+void refit_world(world_ptr w, const std::vector<vec3>& positions)
 {
-    int count = 1;
-    if(g->negative != nullptr) {
-        count += get_node_count(g->negative) + get_node_count(g->positive);
-    }
-    return count;
+    std::vector<vertex>& vertices = w->triangles->vertices;
+    assert(w->tree != nullptr);
+    assert(positions.size() == vertices.size());
+
+    task_pool& pool = get_world_pool();
+    pool.parallel_for(0, vertices.size(), 65536, [&](int first, int last) {
+        for(int i = first; i < last; i++) {
+            vertices[i].v = positions[i];
+        }
+    });
+
+    refit_bvh(*w->tree, pool);
+    w->triangles->box = (*w->tree)[w->tree->root].box;
 }
 
-void generate_group_indices(group *g, int starting, int *used_, int max, int rowsize)
+bool vertex_cache::open(const char *filename, size_t vertex_count_)
 {
-    assert(starting < max);
+    fp = fopen(filename, "rb");
+    if(fp == nullptr) {
+        fprintf(stderr, "couldn't open vertex cache \"%s\"\n", filename);
+        return false;
+    }
 
-    int mine;
-    int used;
+    vertex_count = vertex_count_;
+    size_t frame_bytes = vertex_count * 3 * sizeof(float);
+    fseek(fp, 0, SEEK_END);
+    long file_bytes = ftell(fp);
+    if(frame_bytes == 0 || file_bytes <= 0 || file_bytes % frame_bytes != 0) {
+        fprintf(stderr, "vertex cache \"%s\" is %ld bytes, not a multiple of %zd vertices\n", filename, file_bytes, vertex_count);
+        fclose(fp);
+        fp = nullptr;
+        return false;
+    }
+    frame_count = file_bytes / frame_bytes;
+    fprintf(stderr, "vertex cache \"%s\": %d frames\n", filename, frame_count);
+    return true;
+}
 
-    if(g->negative != nullptr) {
+bool vertex_cache::read_frame(int frame, std::vector<vec3>& positions)
+{
+    std::vector<float> floats(vertex_count * 3);
+    fseek(fp, frame * floats.size() * sizeof(float), SEEK_SET);
+    if(fread(floats.data(), sizeof(float), floats.size(), fp) != floats.size()) {
+        fprintf(stderr, "couldn't read vertex cache frame %d\n", frame);
+        return false;
+    }
+    positions.resize(vertex_count);
+    for(size_t i = 0; i < vertex_count; i++) {
+        positions[i] = vec3(floats[i * 3 + 0], floats[i * 3 + 1], floats[i * 3 + 2]);
+    }
+    return true;
+}
 
-        int neg_used;
-        int pos_used;
+// Stores "tree" at "base" in the group arrays
+void store_group_data(const group_tree& tree, int base, scene_shader_data &data, task_pool& pool)
+{
+    pool.parallel_for(0, tree.size(), 16384, [&](int first, int last) {
+        for(int i = first; i < last; i++) {
 
-        generate_group_indices(g->negative, starting, &neg_used, max, rowsize);
-        assert(starting + neg_used <= max);
+            const group& g = tree[i];
+            int mine = data.texel(base + i);
 
-        mine = starting + neg_used;
+            data.group_boxmin[mine * 3 + 0] = g.box.boxmin.x;
+            data.group_boxmin[mine * 3 + 1] = g.box.boxmin.y;
+            data.group_boxmin[mine * 3 + 2] = g.box.boxmin.z;
+            data.group_boxmax[mine * 3 + 0] = g.box.boxmax.x;
+            data.group_boxmax[mine * 3 + 1] = g.box.boxmax.y;
+            data.group_boxmax[mine * 3 + 2] = g.box.boxmax.z;
 
-        generate_group_indices(g->positive, mine + 1, &pos_used, max, rowsize);
-        assert(mine + 1 + pos_used <= max);
+            if(!g.is_leaf()) {
 
-        used = neg_used + 1 + pos_used;
+                data.group_directions[mine * 3 + 0] = (g.axis == 0) ? 1 : 0;
+                data.group_directions[mine * 3 + 1] = (g.axis == 1) ? 1 : 0;
+                data.group_directions[mine * 3 + 2] = (g.axis == 2) ? 1 : 0;
+                data.group_children[mine * 2 + 0] = base + g.negative;
+                data.group_children[mine * 2 + 1] = base + g.positive;
+                data.group_objects[mine * 2 + 0] = 0;
+                data.group_objects[mine * 2 + 1] = 0;
 
-    } else {
+            } else {
 
-        mine = starting;
-        used = 1;
-    }
+                data.group_children[mine * 2 + 0] = 0x7fffffff;
+                data.group_children[mine * 2 + 1] = 0x7fffffff;
+                data.group_objects[mine * 2 + 0] = g.start;
+                data.group_objects[mine * 2 + 1] = g.count;
+            }
+        }
+    });
+}
 
-    assert(mine < max);
-    // g->my_index = renumber_to_improve_bvh_coherence(mine, rowsize);
-    g->my_index = mine;
-    *used_ = used;
+int get_tree_depth(const group_tree& tree, int g)
+{
+    if(tree[g].is_leaf()) {
+        return 0;
+    }
+    return 1 + std::max(get_tree_depth(tree, tree[g].negative), get_tree_depth(tree, tree[g].positive));
 }
 
-void store_group_data(group *g, scene_shader_data &data)
+// Subtrees are encoded as separate tasks down to this depth
+const int compressed_task_levels = 10;
+
+void store_compressed_group_data(const group_tree& tree, int g, const box3d& parent, int depth, scene_shader_data &data, task_pool& pool)
 {
-    int mine = g->my_index;
+    unsigned int *node = data.group_nodes + data.texel(g) * 4;
 
-    data.group_boxmin[mine * 3 + 0] = g->box.boxmin.x;
-    data.group_boxmin[mine * 3 + 1] = g->box.boxmin.y;
-    data.group_boxmin[mine * 3 + 2] = g->box.boxmin.z;
-    data.group_boxmax[mine * 3 + 0] = g->box.boxmax.x;
-    data.group_boxmax[mine * 3 + 1] = g->box.boxmax.y;
-    data.group_boxmax[mine * 3 + 2] = g->box.boxmax.z;
+    if(!tree[g].is_leaf()) {
 
-    if(g->negative != nullptr) {
+        box3d decoded = encode_compressed_bounds(tree[g].box, parent, depth, tree[g].axis, node);
 
-        store_group_data(g->negative, data);
-        store_group_data(g->positive, data);
+        if(depth < compressed_task_levels) {
+            task_group children;
+            pool.spawn(children, [&]{ store_compressed_group_data(tree, tree[g].negative, decoded, depth + 1, data, pool); });
+            store_compressed_group_data(tree, tree[g].positive, decoded, depth + 1, data, pool);
+            pool.wait(children);
+        } else {
+            store_compressed_group_data(tree, tree[g].negative, decoded, depth + 1, data, pool);
+            store_compressed_group_data(tree, tree[g].positive, decoded, depth + 1, data, pool);
+        }
 
-        data.group_directions[mine * 3 + 0] = g->D.x;
-        data.group_directions[mine * 3 + 1] = g->D.y;
-        data.group_directions[mine * 3 + 2] = g->D.z;
-        data.group_children[mine * 2 + 0] = g->negative->my_index;
-        data.group_children[mine * 2 + 1] = g->positive->my_index;
-        data.group_objects[mine * 2 + 0] = 0;
-        data.group_objects[mine * 2 + 1] = 0;
+        node[2] = tree[g].negative;
+        node[3] = tree[g].positive;
 
     } else {
 
-        data.group_children[mine * 2 + 0] = 0x7fffffff;
-        data.group_children[mine * 2 + 1] = 0x7fffffff;
-        data.group_objects[mine * 2 + 0] = g->start;
-        data.group_objects[mine * 2 + 1] = g->count;
+        encode_compressed_bounds(tree[g].box, parent, depth, 0, node);
+        node[1] |= compressed_bvh_leaf;
+        node[2] = tree[g].start;
+        node[3] = tree[g].count;
     }
 }
 
@@ -225,149 +829,626 @@ vec3 get_coded_dir(int dircode)
     return vec3(x, y, z);
 }
 
-const int hitmiss_max_stack_size = 64;
 const unsigned long hitmiss_stop_traversal = 0x7fffffffU;
 
-void create_hitmiss(group *root, int dircode)
+// Fills "hit" and "miss" for every node of "tree", -1 where traversal
+// stops
+void create_hitmiss(const group_tree& tree, int dircode, std::vector<int>& hit, std::vector<int>& miss)
 {
     vec3 dir = get_coded_dir(dircode);
+    const float d[3] = {dir.x, dir.y, dir.z};
 
-    group *stack[hitmiss_max_stack_size];
-    group *g = root;
-    int stack_top = -1;
+    std::vector<int> stack;
+    int g = tree.root;
 
-    while(g != nullptr) {
+    while(g != -1) {
 
-        group *miss;
-        if(stack_top == -1) {
-            miss = nullptr;
+        int next_miss;
+        if(stack.empty()) {
+            next_miss = -1;
         } else {
-            miss = stack[stack_top];
+            next_miss = stack.back();
         }
 
-        if(g->negative == nullptr) {
+        if(tree[g].is_leaf()) {
 
-            g->dirhit[dircode] = miss;
-            g->dirmiss[dircode] = miss;
-            if(stack_top > -1) {
-                g = stack[stack_top--];
+            hit[g] = next_miss;
+            miss[g] = next_miss;
+            if(!stack.empty()) {
+                g = stack.back();
+                stack.pop_back();
             } else {
-                g = nullptr;
+                g = -1;
             }
 
         } else {
 
-            group* g1;
-            group* g2;
+            int g1;
+            int g2;
 
-            if(dot(dir, g->D) < 0) {
-                g1 = g->positive;
-                g2 = g->negative;
+            if(d[tree[g].axis] < 0) {
+                g1 = tree[g].positive;
+                g2 = tree[g].negative;
             } else {
-                g1 = g->negative;
-                g2 = g->positive;
+                g1 = tree[g].negative;
+                g2 = tree[g].positive;
             }
 
-            g->dirhit[dircode] = g1;
-            g->dirmiss[dircode] = miss;
-            assert(stack_top < hitmiss_max_stack_size);
-            stack[++stack_top] = g2;
+            hit[g] = g1;
+            miss[g] = next_miss;
+            stack.push_back(g2);
             g = g1;
         }
     }
 }
 
-void store_hitmiss(group *g, scene_shader_data& data, int dircode, int base)
+// "offset" is where the links for this direction start and "base" is
+// where the tree starts
+void store_hitmiss(const std::vector<int>& hit, const std::vector<int>& miss, scene_shader_data& data, int offset, int base)
+{
+    for(size_t g = 0; g < hit.size(); g++) {
+        unsigned int texel = data.texel(offset + base + g);
+        data.group_hitmiss[texel * 2 + 0] = (hit[g] != -1) ? base + hit[g] : hitmiss_stop_traversal;
+        data.group_hitmiss[texel * 2 + 1] = (miss[g] != -1) ? base + miss[g] : hitmiss_stop_traversal;
+    }
+}
+
+void store_miss(const std::vector<int>& miss, scene_shader_data& data, int base)
 {
-    data.group_hitmiss[(base + g->my_index) * 2 + 0] = g->dirhit[dircode] ? g->dirhit[dircode]->my_index : hitmiss_stop_traversal;
-    data.group_hitmiss[(base + g->my_index) * 2 + 1] = g->dirmiss[dircode] ? g->dirmiss[dircode]->my_index : hitmiss_stop_traversal;
-    if(g->negative != nullptr) {
-        store_hitmiss(g->negative, data, dircode, base);
-        store_hitmiss(g->positive, data, dircode, base);
+    for(size_t g = 0; g < miss.size(); g++) {
+        data.group_miss[data.texel(base + g)] = (miss[g] != -1) ? miss[g] : compressed_bvh_stop_traversal;
+    }
+}
+
+// Miss links for direction "dircode" into the packed records of the
+// tree at "base"
+void store_packed_miss(const std::vector<int>& miss, scene_shader_data& data, int dircode, int base)
+{
+    for(size_t g = 0; g < miss.size(); g++) {
+        unsigned int *links = data.group_records + data.texel((base + g) * packed_bvh_texels_per_node + 2 + dircode / 4) * 4;
+        links[dircode % 4] = (miss[g] != -1) ? base + miss[g] : packed_bvh_stop_traversal;
     }
 }
 
 };
 
+const char *get_node_format_name(const scene_shader_data& data)
+{
+    if(data.compressed_nodes) {
+        return "compressed";
+    } else if(data.packed_nodes) {
+        return "packed";
+    } else if(data.stackless_nodes) {
+        return "stackless";
+    } else if(data.closest_first) {
+        return "closest-first";
+    }
+    return "uncompressed";
+}
+
 template <class T>
 inline T round_up(T v, unsigned int r)
 {
     return ((v + r - 1) / r) * r;
 }
 
-void get_shader_data(world_ptr w, scene_shader_data &data, unsigned int data_texture_width)
+unsigned int get_data_texel(unsigned int which, unsigned int width, bool tiled)
 {
-    unsigned int size;
+    if(!tiled) {
+        return which;
+    }
+
+    const unsigned int tile_texels = data_texture_tile * data_texture_tile;
+    unsigned int tile = which / tile_texels;
+    unsigned int morton = which % tile_texels;
+    unsigned int x = 0;
+    unsigned int y = 0;
+    for(unsigned int bit = 0; (1U << bit) < data_texture_tile; bit++) {
+        x |= ((morton >> (2 * bit)) & 1) << bit;
+        y |= ((morton >> (2 * bit + 1)) & 1) << bit;
+    }
+
+    unsigned int tiles_per_row = width / data_texture_tile;
+    x += (tile % tiles_per_row) * data_texture_tile;
+    y += (tile / tiles_per_row) * data_texture_tile;
+    return y * width + x;
+}
+
+unsigned int get_data_rows(const scene_shader_data& data, unsigned int count)
+{
+    unsigned int rows = (count + data.data_texture_width - 1) / data.data_texture_width;
+    return data.paged_rows(data.tiled_texels ? round_up(rows, data_texture_tile) : rows);
+}
+
+void get_shader_data(world_ptr w, scene_shader_data &data, unsigned int data_texture_width, unsigned int max_data_rows)
+{
+    size_t size;
     auto then = std::chrono::system_clock::now();
 
+    data.data_texture_width = data_texture_width;
+    data.tiled_texels = (getenv("BVH_TILED_TEXELS") != nullptr);
+    if(data.tiled_texels && data_texture_width % data_texture_tile != 0) {
+        fprintf(stderr, "data textures %u texels wide don't hold whole %ux%u tiles, not tiling texels\n", data_texture_width, data_texture_tile, data_texture_tile);
+        data.tiled_texels = false;
+    }
+
+    // Every tree is stored at its own base in the group arrays, the
+    // meshes first and then the instance tree if there are instances
+    std::vector<const group_tree*> trees;
+    if(w->instance_tree != nullptr) {
+        trees.insert(trees.end(), w->meshes.begin(), w->meshes.end());
+        trees.push_back(w->instance_tree);
+    } else {
+        trees.push_back(w->tree);
+    }
+    std::vector<int> bases;
+    data.group_count = 0;
+    for(auto *t : trees) {
+        bases.push_back(data.group_count);
+        data.group_count += t->size();
+    }
+
     data.vertex_count = w->triangles->triangles.size() * 3;
-    data.vertex_data_rows = (data.vertex_count + data_texture_width - 1) / data_texture_width;
-    size = 3 * data_texture_width * data.vertex_data_rows;
-    data.vertex_positions = new float[size];
-    data.vertex_normals = new float[size];
-    data.vertex_colors = new float[size];
-    for(unsigned int i = 0; i < w->triangles->triangles.size(); i++) {
-        const indexed_triangle& t = w->triangles->triangles[i];
-        for(unsigned int j = 0; j < 3; j++) {
-            const vertex& vtx = w->triangles->vertices[t.i[j]];
-            vtx.v.store(data.vertex_positions, i * 3 + j);
-            vtx.n.store(data.vertex_normals, i * 3 + j);
-            vtx.c.store(data.vertex_colors, i * 3 + j);
-        }
-    }
-
-    data.group_count = get_node_count(w->root);
-    data.group_data_rows = (data.group_count + data_texture_width - 1) / data_texture_width;
-    size = data_texture_width * data.group_data_rows;
-    data.group_directions = new float[3 * size];
-    data.group_boxmin = new float[3 * size];
-    data.group_boxmax = new float[3 * size];
-    data.group_children = new float[2 * size];
-    data.group_objects = new float[2 * size];
-    data.group_hitmiss = new float[8 * 2 * size];
-
-    int used;
-    generate_group_indices(w->root, 0, &used, data.group_count, data_texture_width);
-    assert(used == data.group_count);
-    data.tree_root = w->root->my_index;
-
-    store_group_data(w->root, data);
-
-    for(int i = 0; i < hitmiss_directions_count; i++) {
-        create_hitmiss(w->root, i); 
+    data.instance_count = w->instances.size();
+
+    // Page if the tallest texture wouldn't fit, counting a table of
+    // links for all 8 directions even for formats without one
+    unsigned int page_rows = max_data_rows;
+    if(getenv("BVH_TEXTURE_PAGE_ROWS") != nullptr) {
+        page_rows = atoi(getenv("BVH_TEXTURE_PAGE_ROWS"));
+    }
+    if(data.tiled_texels) {
+        page_rows = page_rows / data_texture_tile * data_texture_tile;
+    }
+    unsigned int tallest = std::max(get_data_rows(data, data.vertex_count), get_data_rows(data, data.group_count) * 8);
+    tallest = std::max(tallest, get_data_rows(data, data.instance_count * 4));
+    if(page_rows != 0 && tallest > page_rows) {
+        data.data_page_rows = page_rows;
+        fprintf(stderr, "data textures up to %u rows tall, paging them in layers of %u rows\n", tallest, page_rows);
+    }
+
+    data.vertex_data_rows = get_data_rows(data, data.vertex_count);
+    size = size_t(data_texture_width) * data.vertex_data_rows;
+    data.precomputed_triangles = (getenv("BVH_TRIANGLE_RECORDS") != nullptr);
+    data.compact_vertices = (getenv("BVH_COMPACT_VERTICES") != nullptr);
+    if(data.compact_vertices && !data.precomputed_triangles) {
+        for(auto *t : trees) {
+            if(t != w->instance_tree && !leaves_contain_triangles(*t)) {
+                fprintf(stderr, "triangles reach outside their leaf boxes, not using compact vertices\n");
+                data.compact_vertices = false;
+                break;
+            }
+        }
+    }
+
+    // Every array is zeroed first, so the rows past the last item and
+    // fields a node kind doesn't use are the same in every scene image
+    if(data.precomputed_triangles) {
+        data.triangle_records = new float[4 * size]();
+    } else if(data.compact_vertices) {
+        // Filled in once the leaf boxes are known, below
+        data.compact_positions = new unsigned short[3 * size]();
+    } else {
+        data.vertex_positions = new float[3 * size]();
+    }
+    if(data.compact_vertices) {
+        data.compact_normals = new unsigned int[size]();
+    } else {
+        data.vertex_normals = new float[3 * size]();
+    }
+    task_pool& pool = get_world_pool();
+    pool.parallel_for(0, w->triangles->triangles.size(), 16384, [&](int first, int last) {
+        for(int i = first; i < last; i++) {
+            const indexed_triangle& t = w->triangles->triangles[i];
+            for(unsigned int j = 0; j < 3; j++) {
+                const vertex& vtx = w->triangles->vertices[t.i[j]];
+                unsigned int texel = data.texel(i * 3 + j);
+                if(data.vertex_positions != nullptr) {
+                    vtx.v.store(data.vertex_positions, texel);
+                }
+                if(data.compact_vertices) {
+                    data.compact_normals[texel] = encode_octahedral_normal(vtx.n);
+                } else {
+                    vtx.n.store(data.vertex_normals, texel);
+                }
+            }
+            if(data.precomputed_triangles) {
+                store_triangle_record(*w->triangles, i, data);
+            }
+        }
+    });
+    auto vertices_done = std::chrono::system_clock::now();
+
+    data.group_data_rows = get_data_rows(data, data.group_count);
+    size = size_t(data_texture_width) * data.group_data_rows;
+
+    data.compressed_nodes = (getenv("BVH_COMPRESSED_NODES") != nullptr);
+    if(data.compressed_nodes && w->instance_tree != nullptr) {
+        fprintf(stderr, "scene has instances, not compressing nodes\n");
+        data.compressed_nodes = false;
+    }
+    if(data.compressed_nodes && get_tree_depth(*w->tree, w->tree->root) > compressed_bvh_max_depth) {
+        fprintf(stderr, "BVH deeper than %d levels, not compressing nodes\n", compressed_bvh_max_depth);
+        data.compressed_nodes = false;
+    }
+
+    data.packed_nodes = !data.compressed_nodes && (getenv("BVH_PACKED_NODES") != nullptr);
+    if(data.packed_nodes && w->instance_tree != nullptr) {
+        fprintf(stderr, "scene has instances, not packing nodes\n");
+        data.packed_nodes = false;
+    }
+    if(data.packed_nodes && (unsigned int)data.group_count > packed_bvh_max_nodes) {
+        fprintf(stderr, "more than %u BVH nodes, not packing nodes\n", packed_bvh_max_nodes);
+        data.packed_nodes = false;
+    }
+
+    data.stackless_nodes = !data.compressed_nodes && !data.packed_nodes && (getenv("BVH_STACKLESS_NODES") != nullptr);
+    if(data.stackless_nodes && w->instance_tree != nullptr) {
+        fprintf(stderr, "scene has instances, not using stackless traversal\n");
+        data.stackless_nodes = false;
+    }
+
+    data.closest_first = !data.compressed_nodes && !data.packed_nodes && !data.stackless_nodes && (getenv("BVH_CLOSEST_FIRST") != nullptr);
+    if(data.closest_first && w->instance_tree != nullptr) {
+        fprintf(stderr, "scene has instances, not using closest-first traversal\n");
+        data.closest_first = false;
+    }
+    if(data.closest_first && get_tree_depth(*w->tree, w->tree->root) > closest_first_max_depth) {
+        fprintf(stderr, "BVH deeper than %d levels, not using closest-first traversal\n", closest_first_max_depth);
+        data.closest_first = false;
+    }
+
+    size_t node_bytes;
+    if(data.compressed_nodes) {
+        data.group_nodes = new unsigned int[4 * size]();
+        data.group_miss = new unsigned int[size_t(data_texture_width) * data.paged_rows(data.group_data_rows * 8)]();
+        node_bytes = sizeof(unsigned int) * (4 + 8);
+    } else if(data.packed_nodes) {
+        data.group_records = new unsigned int[4 * size_t(data_texture_width) * data.paged_rows(data.group_data_rows * packed_bvh_texels_per_node)]();
+        node_bytes = sizeof(unsigned int) * packed_bvh_texels_per_node * 4;
+    } else {
+        data.group_directions = new float[3 * size]();
+        data.group_boxmin = new float[3 * size]();
+        data.group_boxmax = new float[3 * size]();
+        data.group_children = new float[2 * size]();
+        data.group_objects = new float[2 * size]();
+        if(data.stackless_nodes) {
+            data.group_links = new float[2 * size]();
+            node_bytes = sizeof(float) * (3 + 3 + 3 + 2 + 2 + 2);
+        } else if(data.closest_first) {
+            node_bytes = sizeof(float) * (3 + 3 + 3 + 2 + 2);
+        } else {
+            data.group_hitmiss = new float[2 * size_t(data_texture_width) * data.paged_rows(data.group_data_rows * 8)]();
+            node_bytes = sizeof(float) * (3 + 3 + 3 + 2 + 8 * 2);
+        }
     }
+
+    // Nodes are stored at their index in the tree plus the tree's base
+    data.tree_root = bases.back() + trees.back()->root;
+
+    if(data.compressed_nodes) {
+        const group_tree& tree = *w->tree;
+        tree[tree.root].box.boxmin.store(data.root_boxmin, 0);
+        tree[tree.root].box.boxmax.store(data.root_boxmax, 0);
+        store_compressed_group_data(tree, tree.root, tree[tree.root].box, 0, data, pool);
+    } else if(data.packed_nodes) {
+        for(size_t t = 0; t < trees.size(); t++) {
+            pool.parallel_for(0, trees[t]->size(), 16384, [&](int first_node, int last_node) {
+                for(int g = first_node; g < last_node; g++) {
+                    unsigned int first = (bases[t] + g) * packed_bvh_texels_per_node;
+                    encode_packed_node((*trees[t])[g], bases[t],
+                        data.group_records + data.texel(first + 0) * 4, data.group_records + data.texel(first + 1) * 4);
+                }
+            });
+        }
+    } else {
+        for(size_t t = 0; t < trees.size(); t++) {
+            store_group_data(*trees[t], bases[t], data, pool);
+        }
+    }
+    auto nodes_done = std::chrono::system_clock::now();
+
+    // One task per tree and direction, each writing only its own
+    // links; closest-first traversal needs no links
+    task_group links;
+    for(size_t t = 0; t < trees.size(); t++) {
+        const group_tree& tree = *trees[t];
+        int base = bases[t];
+        if(data.stackless_nodes) {
+            pool.spawn(links, [&tree, &data, base]{ store_stackless_links(tree, base, data); });
+        } else if(!data.closest_first) {
+            for(int i = 0; i < hitmiss_directions_count; i++) {
+                pool.spawn(links, [&tree, &data, base, i, data_texture_width]{
+                    std::vector<int> hit(tree.size());
+                    std::vector<int> miss(tree.size());
+                    create_hitmiss(tree, i, hit, miss);
+                    if(data.compressed_nodes) {
+                        store_miss(miss, data, i * (data_texture_width * data.group_data_rows));
+                    } else if(data.packed_nodes) {
+                        store_packed_miss(miss, data, i, base);
+                    } else {
+                        store_hitmiss(hit, miss, data, i * (data_texture_width * data.group_data_rows), base);
+                    }
+                });
+            }
+        }
+    }
+    pool.wait(links);
+    auto links_done = std::chrono::system_clock::now();
+
+    if(data.compact_positions != nullptr) {
+        std::vector<box3d> frames(w->triangles->triangles.size(), w->triangles->box);
+        for(size_t t = 0; t < trees.size(); t++) {
+            if(trees[t] != w->instance_tree) {
+                get_leaf_frames(*trees[t], bases[t], data, frames);
+            }
+        }
+        store_compact_positions(*w->triangles, frames, data, pool);
+    }
+
+    if(data.instance_count > 0) {
+        data.instance_data_rows = get_data_rows(data, data.instance_count * 4);
+        data.instance_data = new float[4 * size_t(data_texture_width) * data.instance_data_rows]();
+        for(int i = 0; i < data.instance_count; i++) {
+            const instance& inst = w->instances[i];
+            for(int row = 0; row < 3; row++) {
+                float *texel = data.instance_data + data.texel(i * 4 + row) * 4;
+                for(int column = 0; column < 4; column++) {
+                    texel[column] = inst.inverse[column * 4 + row];
+                }
+            }
+            const group_tree& mesh = *w->meshes[inst.mesh];
+            float *texel = data.instance_data + data.texel(i * 4 + 3) * 4;
+            texel[0] = bases[inst.mesh] + mesh.root;
+            texel[1] = 0;
+            texel[2] = 0;
+            texel[3] = 0;
+        }
+    }
+
     auto now = std::chrono::system_clock::now();
     std::chrono::duration<float> elapsed = now - then;
+    std::chrono::duration<float> vertices_elapsed = vertices_done - then;
+    std::chrono::duration<float> nodes_elapsed = nodes_done - vertices_done;
+    std::chrono::duration<float> links_elapsed = links_done - nodes_done;
+    std::chrono::duration<float> rest_elapsed = now - links_done;
+
+    fprintf(stderr, "shader data: %f seconds on %d threads, %f vertices, %f nodes, %f links, %f compact positions and instances\n",
+        elapsed.count(), pool.get_thread_count(), vertices_elapsed.count(), nodes_elapsed.count(), links_elapsed.count(), rest_elapsed.count());
+
+    fprintf(stderr, "BVH node data (%s): %zd bytes per node, %f megabytes\n", get_node_format_name(data), node_bytes, node_bytes * size / 1000000.0);
+}
 
-    fprintf(stderr, "hitmiss: %f seconds\n", elapsed.count());
+namespace
+{
+
+void write_bvh_quality(FILE *fp, const char *name, const group_tree& tree)
+{
+    bvh_quality q = get_bvh_quality(tree, shader_max_leaf_tests);
+    fprintf(fp, "    {\n");
+    fprintf(fp, "      \"name\": \"%s\",\n", name);
+    fprintf(fp, "      \"sah_cost\": %f,\n", q.sah_cost);
+    fprintf(fp, "      \"sibling_overlap\": %f,\n", q.sibling_overlap);
+    fprintf(fp, "      \"nodes\": %d,\n", q.node_count);
+    fprintf(fp, "      \"leaves\": %d,\n", q.leaf_count);
+    fprintf(fp, "      \"average_leaf_depth\": %f,\n", q.average_leaf_depth);
+    fprintf(fp, "      \"max_leaf_depth\": %d,\n", q.max_leaf_depth);
+    fprintf(fp, "      \"average_leaf_size\": %f,\n", q.average_leaf_size);
+    fprintf(fp, "      \"max_leaf_size\": %u,\n", q.max_leaf_size);
+    fprintf(fp, "      \"leaves_over_shader_limit\": %d,\n", q.leaves_over_limit);
+    fprintf(fp, "      \"triangles_over_shader_limit\": %d,\n", q.triangles_over_limit);
+    fprintf(fp, "      \"node_bytes\": %zd\n", tree.groups.size() * sizeof(group));
+    fprintf(fp, "    }");
+}
 
-    for(int i = 0; i < hitmiss_directions_count; i++) {
-        store_hitmiss(w->root, data, i, i * (data_texture_width * data.group_data_rows));
+// Writes "s" as a JSON string
+void write_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\') {
+            fputc('\\', fp);
+        }
+        if((unsigned char)*s < 0x20) {
+            fprintf(fp, "\\u%04x", *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+};
+
+bool write_bvh_report(world_ptr w, const scene_shader_data& data, unsigned int data_texture_width, const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if(fp == nullptr) {
+        fprintf(stderr, "couldn't create BVH report \"%s\"\n", filename);
+        return false;
+    }
+
+    bvh_parameters params = get_bvh_parameters();
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"model\": ");
+    write_json_string(fp, w->filename.c_str());
+    fprintf(fp, ",\n");
+    fprintf(fp, "  \"builder\": ");
+    write_json_string(fp, get_bvh_builder_name());
+    fprintf(fp, ",\n");
+    fprintf(fp, "  \"node_layout\": \"%s\",\n", get_bvh_layout_name());
+    fprintf(fp, "  \"tiled_texels\": %s,\n", data.tiled_texels ? "true" : "false");
+    fprintf(fp, "  \"data_page_rows\": %u,\n", data.data_page_rows);
+    fprintf(fp, "  \"parameters\": {\"leaf_max\": %u, \"max_depth\": %d, \"sah_ctrav\": %f, \"sah_cisec\": %f},\n",
+        params.leaf_max, params.max_depth, params.sah_ctrav, params.sah_cisec);
+    fprintf(fp, "  \"shader_max_leaf_tests\": %u,\n", shader_max_leaf_tests);
+    fprintf(fp, "  \"triangles\": %zd,\n", w->triangles->triangles.size());
+    fprintf(fp, "  \"vertices\": %zd,\n", w->triangles->vertices.size());
+    fprintf(fp, "  \"instances\": %zd,\n", w->instances.size());
+
+    fprintf(fp, "  \"trees\": [\n");
+    if(w->instance_tree != nullptr) {
+        for(size_t i = 0; i < w->meshes.size(); i++) {
+            write_bvh_quality(fp, ("mesh " + std::to_string(i)).c_str(), *w->meshes[i]);
+            fprintf(fp, ",\n");
+        }
+        write_bvh_quality(fp, "instances", *w->instance_tree);
+    } else {
+        write_bvh_quality(fp, "scene", *w->tree);
+    }
+    fprintf(fp, "\n  ],\n");
+
+    // Texture bytes in the formats load_scene_data uploads, padded out
+    // to whole rows; normals are half floats, or a uint if compact, and
+    // directions are 8-bit
+    size_t vertex_texels = data_texture_width * data.vertex_data_rows;
+    size_t group_texels = data_texture_width * data.group_data_rows;
+    size_t instance_texels = data_texture_width * data.instance_data_rows;
+    size_t position_texel_bytes = data.precomputed_triangles ? 16 : (data.compact_vertices ? 6 : 12);
+    size_t vertex_texel_bytes = position_texel_bytes + (data.compact_vertices ? 4 : 6);
+    size_t node_texel_bytes = data.compressed_nodes ? 16 : (data.packed_nodes ? 32 : (8 + 3 + 12 + 12));
+    size_t link_texel_bytes = (data.compressed_nodes || data.packed_nodes) ? 4 : 8;
+    size_t link_tables = hitmiss_directions_count;
+    if(data.stackless_nodes || data.closest_first) {
+        // Children are uploaded as another RG32F texture
+        node_texel_bytes += 8;
+        link_tables = data.stackless_nodes ? 1 : 0;
+    }
+    size_t cpu_node_bytes = 0;
+    for(const group_tree *t : w->meshes) {
+        cpu_node_bytes += t->groups.size() * sizeof(group);
+    }
+    for(const group_tree *t : {w->tree, w->instance_tree}) {
+        cpu_node_bytes += (t != nullptr) ? t->groups.size() * sizeof(group) : 0;
+    }
+
+    fprintf(fp, "  \"memory\": {\n");
+    fprintf(fp, "    \"cpu_vertices\": %zd,\n", w->triangles->vertices.size() * sizeof(vertex));
+    fprintf(fp, "    \"cpu_triangles\": %zd,\n", w->triangles->triangles.size() * sizeof(indexed_triangle));
+    fprintf(fp, "    \"cpu_nodes\": %zd,\n", cpu_node_bytes);
+    fprintf(fp, "    \"cpu_instances\": %zd,\n", w->instances.size() * sizeof(instance));
+    fprintf(fp, "    \"shader_vertices\": %zd,\n", vertex_texels * vertex_texel_bytes);
+    fprintf(fp, "    \"shader_nodes\": %zd,\n", group_texels * node_texel_bytes);
+    fprintf(fp, "    \"shader_links\": %zd,\n", size_t(data_texture_width) * data.paged_rows(data.group_data_rows * link_tables) * link_texel_bytes);
+    fprintf(fp, "    \"shader_instances\": %zd,\n", instance_texels * 16);
+    fprintf(fp, "    \"shader_triangle_format\": \"%s\",\n", data.precomputed_triangles ? "records" : (data.compact_vertices ? "compact" : "vertices"));
+    fprintf(fp, "    \"shader_node_format\": \"%s\"\n", get_node_format_name(data));
+    fprintf(fp, "  }\n");
+    fprintf(fp, "}\n");
+
+    if(fclose(fp) != 0) {
+        fprintf(stderr, "couldn't write BVH report \"%s\"\n", filename);
+        return false;
+    }
+    fprintf(stderr, "wrote BVH report \"%s\"\n", filename);
+    return true;
+}
+
+void update_shader_data_bounds(world_ptr w, scene_shader_data &data)
+{
+    assert(w->tree != nullptr);
+    const triangle_set& triangles = *w->triangles;
+    const group_tree& tree = *w->tree;
+    task_pool& pool = get_world_pool();
+
+    pool.parallel_for(0, triangles.triangles.size(), 16384, [&](int first, int last) {
+        for(int i = first; i < last; i++) {
+            if(data.precomputed_triangles) {
+                store_triangle_record(triangles, i, data);
+            } else if(data.vertex_positions != nullptr) {
+                const indexed_triangle& t = triangles.triangles[i];
+                for(unsigned int j = 0; j < 3; j++) {
+                    triangles.vertices[t.i[j]].v.store(data.vertex_positions, data.texel(i * 3 + j));
+                }
+            }
+        }
+    });
+
+    if(data.compressed_nodes) {
+        // Children are quantized relative to their parents, so every
+        // node is reencoded
+        tree[tree.root].box.boxmin.store(data.root_boxmin, 0);
+        tree[tree.root].box.boxmax.store(data.root_boxmax, 0);
+        store_compressed_group_data(tree, tree.root, tree[tree.root].box, 0, data, pool);
+    } else if(data.packed_nodes) {
+        pool.parallel_for(0, tree.size(), 16384, [&](int first, int last) {
+            for(int i = first; i < last; i++) {
+                unsigned int record = i * packed_bvh_texels_per_node;
+                encode_packed_bounds(tree[i].box, data.group_records + data.texel(record + 0) * 4, data.group_records + data.texel(record + 1) * 4);
+            }
+        });
+    } else {
+        pool.parallel_for(0, tree.size(), 16384, [&](int first, int last) {
+            for(int i = first; i < last; i++) {
+                tree[i].box.boxmin.store(data.group_boxmin, data.texel(i));
+                tree[i].box.boxmax.store(data.group_boxmax, data.texel(i));
+            }
+        });
+    }
+
+    // Quantized in the new leaf boxes
+    if(data.compact_positions != nullptr) {
+        std::vector<box3d> frames(triangles.triangles.size(), triangles.box);
+        get_leaf_frames(tree, 0, data, frames);
+        store_compact_positions(triangles, frames, data, pool);
     }
 }
 
 scene_shader_data::scene_shader_data() :
+    data_texture_width(0),
+    tiled_texels(false),
+    data_page_rows(0),
     vertex_positions(nullptr),
     vertex_colors(nullptr),
     vertex_normals(nullptr),
+    precomputed_triangles(false),
+    triangle_records(nullptr),
+    compact_vertices(false),
+    compact_positions(nullptr),
+    compact_normals(nullptr),
     group_boxmin(nullptr),
     group_boxmax(nullptr),
     group_directions(nullptr),
     group_children(nullptr),
     group_hitmiss(nullptr),
-    group_objects(nullptr)
+    group_objects(nullptr),
+    stackless_nodes(false),
+    group_links(nullptr),
+    closest_first(false),
+    compressed_nodes(false),
+    group_nodes(nullptr),
+    group_miss(nullptr),
+    packed_nodes(false),
+    group_records(nullptr),
+    instance_count(0),
+    instance_data_rows(0),
+    instance_data(nullptr),
+    image(nullptr),
+    image_bytes(0)
 {
 }
 
 scene_shader_data::~scene_shader_data()
 {
+    if(image != nullptr) {
+        munmap(image, image_bytes);
+        return;
+    }
     delete[] vertex_positions;
     delete[] vertex_colors;
     delete[] vertex_normals;
+    delete[] triangle_records;
+    delete[] compact_positions;
+    delete[] compact_normals;
     delete[] group_directions;
     delete[] group_children;
     delete[] group_objects;
     delete[] group_boxmin;
     delete[] group_boxmax;
     delete[] group_hitmiss;
+    delete[] group_nodes;
+    delete[] group_miss;
+    delete[] group_records;
+    delete[] group_links;
+    delete[] instance_data;
 }
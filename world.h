@@ -17,13 +17,16 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdio>
 #include <vector>
 #include <map>
 #include <memory>
+#include <string>
 #include "vectormath.h"
 #include "geometry.h"
 #include "triangle-set.h"
 #include "group.h"
+#include "instance.h"
 
 struct camera { /* Viewpoint specification. */
     float fov; /* Entire View angle, left to right. */
@@ -31,10 +34,18 @@ struct camera { /* Viewpoint specification. */
 
 struct world
 {
+    std::string filename; // as passed to load_world
     int triangle_count;
-    triangle_set_ptr triangles; // base triangles, only traced through "root"
+    triangle_set_ptr triangles; // base triangles, only traced through "tree"
 
-    group *root;
+    group_tree *tree;
+
+    // A scene loaded from a .instances file has no "tree"; each mesh
+    // has a tree over its own range of "triangles" instead, and
+    // "instance_tree" is over "instances"
+    std::vector<group_tree*> meshes;
+    std::vector<instance> instances;
+    group_tree *instance_tree;
 
     vec3 scene_center;
     float scene_extent;
@@ -43,11 +54,16 @@ struct world
     int xsub, ysub;
 
     world() :
-        root(nullptr)
+        tree(nullptr),
+        instance_tree(nullptr)
     {};
     ~world()
     {
-        delete root;
+        delete tree;
+        for(auto *m : meshes) {
+            delete m;
+        }
+        delete instance_tree;
     }
 
     float camera_matrix[16];
@@ -62,17 +78,84 @@ struct world
 typedef std::shared_ptr<world> world_ptr;
 
 world_ptr load_world(const std::string& filename);
+
+// Moves the vertices of w->triangles to "positions", one per vertex in
+// the same order, and refits w->tree to them
+void refit_world(world_ptr w, const std::vector<vec3>& positions);
+
+// Per-frame vertex positions for playing back a simulation, in a file of
+// consecutive frames of float x, y, z for every vertex of
+// world::triangles in triangle_set::vertices order
+struct vertex_cache
+{
+    FILE *fp;
+    size_t vertex_count;
+    int frame_count;
+
+    vertex_cache() :
+        fp(nullptr),
+        vertex_count(0),
+        frame_count(0)
+    {}
+    ~vertex_cache()
+    {
+        if(fp) fclose(fp);
+    }
+
+    bool open(const char *filename, size_t vertex_count_);
+    bool read_frame(int frame, std::vector<vec3>& positions);
+};
 void trace_image(int width, int height, float aspect, unsigned char *image, const world_ptr Wd, const vec3& light_dir);
 
 
+// Side of the square tiles of BVH_TILED_TEXELS, a texture cache block
+const unsigned int data_texture_tile = 8;
+
+// Texel holding element "which" of a data texture "width" texels wide,
+// as an index into its rows.  Elements go row by row, or with "tiled"
+// fill data_texture_tile square tiles in Morton order, the tiles going
+// row by row.  Same as index_to_texel in raytracer.es.fs.
+unsigned int get_data_texel(unsigned int which, unsigned int width, bool tiled);
+
 struct scene_shader_data
 {
+    // Every array below holds element i at texel(i); with tiled
+    // texels the row counts are multiples of data_texture_tile
+    unsigned int data_texture_width;
+    bool tiled_texels;
+    unsigned int texel(unsigned int which) const { return get_data_texel(which, data_texture_width, tiled_texels); }
+
+    // If nonzero, a data texture taller than data_page_rows is uploaded
+    // as an array of layers that many rows high, and its rows are
+    // padded to fill the last layer; the arrays keep the same layout
+    unsigned int data_page_rows;
+    unsigned int paged_rows(unsigned int rows) const
+    {
+        if(data_page_rows == 0 || rows <= data_page_rows) {
+            return rows;
+        }
+        return (rows + data_page_rows - 1) / data_page_rows * data_page_rows;
+    }
+
     unsigned int vertex_count;
     unsigned int vertex_data_rows;
     float *vertex_positions; // array of float3 {x, y, z, x, y, z, x, y, z}
-    float *vertex_colors; // array of float3 {r, g, b, r, g, b, r, g, b}
+    float *vertex_colors; // array of float3 {r, g, b, r, g, b, r, g, b}; null, the shader doesn't read colors
     float *vertex_normals; // array of float3: {x, y, z, x, y, z, x, y, z}
 
+    // With BVH_TRIANGLE_RECORDS set, triangle_records replaces
+    // vertex_positions, which is left null; see triangle-records.h
+    bool precomputed_triangles;
+    float *triangle_records; // array of float4, triangle_record_texels per triangle
+
+    // With BVH_COMPACT_VERTICES set, compact_normals replaces
+    // vertex_normals and compact_positions replaces vertex_positions
+    // (unless triangle_records does), and those are left null; see
+    // compact-vertices.h
+    bool compact_vertices;
+    unsigned short *compact_positions; // array of ushort3, in the box of the triangle's leaf
+    unsigned int *compact_normals; // array of uint, octahedral
+
     int group_count;
     int group_data_rows;
     int tree_root;
@@ -88,8 +171,63 @@ struct scene_shader_data
 
     float *group_objects; // array of {start, count}, count==0 if not leaf
 
+    // With BVH_STACKLESS_NODES set, group_links replaces group_hitmiss,
+    // which is left null, and the shader also reads group_children and
+    // group_directions; see stackless-bvh.h
+    bool stackless_nodes;
+    float *group_links; // array of float2 {parent, sibling}, >= 0x7fffffff at the root
+
+    // With BVH_CLOSEST_FIRST set, the shader reads group_children and
+    // keeps a stack instead of following links, and group_hitmiss is
+    // left null; see closest-first-bvh.h
+    bool closest_first;
+
+    // With BVH_COMPRESSED_NODES set, group_nodes and group_miss replace
+    // all of the group_ arrays above, which are left null; see
+    // compressed-bvh.h
+    bool compressed_nodes;
+    unsigned int *group_nodes; // array of uint4
+    unsigned int *group_miss; // array of uint, 8 directions like group_hitmiss
+    float root_boxmin[3];
+    float root_boxmax[3];
+
+    // With BVH_PACKED_NODES set instead, group_records replaces all of
+    // the group_ arrays; see packed-bvh.h
+    bool packed_nodes;
+    unsigned int *group_records; // array of uint4, packed_bvh_texels_per_node per node
+
+    // With instances, the group_ arrays hold every mesh's tree and then
+    // the instance tree, whose leaves index instance_data, and
+    // tree_root is the instance tree's root
+    int instance_count;
+    int instance_data_rows;
+    float *instance_data; // array of float4: rows 0-2 of instance::inverse, then {mesh root, 0, 0, 0}
+
+    // If non-null, the arrays point into this mapping of a scene image
+    // (see scene-image.h) and are unmapped with it instead of deleted
+    void *image;
+    size_t image_bytes;
+
     scene_shader_data();
     ~scene_shader_data();
 };
 
-void get_shader_data(world_ptr w, scene_shader_data &data, unsigned int data_texture_width);
+// Rows of "data"'s textures for "count" elements, whole tiles of them
+// if tiled and whole layers if paged
+unsigned int get_data_rows(const scene_shader_data& data, unsigned int count);
+
+// Data textures are paged if any would be taller than max_data_rows,
+// or BVH_TEXTURE_PAGE_ROWS if set; 0 for no limit
+void get_shader_data(world_ptr w, scene_shader_data &data, unsigned int data_texture_width, unsigned int max_data_rows);
+
+// Which node layout and traversal "data" was made for, for reports
+const char *get_node_format_name(const scene_shader_data& data);
+
+// Writes a JSON report on the quality and size of the world's trees
+// and their shader data, from a get_shader_data with the same width
+bool write_bvh_report(world_ptr w, const scene_shader_data& data, unsigned int data_texture_width, const char *filename);
+
+// After refit_world, rewrites the vertex positions (triangle_records if
+// precomputed) and group bounds of "data" (group_nodes if compressed);
+// everything else is unchanged
+void update_shader_data_bounds(world_ptr w, scene_shader_data &data);